@@ -0,0 +1,60 @@
+/*
+ * LD_PRELOAD shim for the benchmarks: counts malloc/calloc/realloc calls and
+ * requested bytes, and prints them with the peak RSS (VmHWM) at exit.
+ * glibc only (uses the __libc_* entry points to avoid dlsym recursion).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long n_alloc;
+static unsigned long long n_bytes;
+
+static void
+count(size_t n)
+{
+	__atomic_fetch_add(&n_alloc, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&n_bytes, n, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t n)
+{
+	count(n);
+	return __libc_malloc(n);
+}
+void *
+calloc(size_t m, size_t n)
+{
+	count(m * n);
+	return __libc_calloc(m, n);
+}
+void *
+realloc(void *p, size_t n)
+{
+	count(n);
+	return __libc_realloc(p, n);
+}
+
+__attribute__((destructor)) static void
+report(void)
+{
+	char line[256];
+	long hwm_kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (strncmp(line, "VmHWM:", 6) == 0)
+				hwm_kb = strtol(line + 6, NULL, 10);
+		fclose(f);
+	}
+	fprintf(stderr, "allocs=%lu alloc_bytes=%llu peak_rss_kb=%ld\n",
+	    n_alloc, n_bytes, hwm_kb);
+}
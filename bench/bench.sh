@@ -0,0 +1,155 @@
+#!/bin/bash
+#
+# Build-mode benchmark on a generated corpus (make bench).
+#
+#   bench/bench.sh [HUAP]
+#   bench/bench.sh -c OLD.jsonl NEW.jsonl
+#
+# bench/corpus.c writes the same tree for the same SCALE and SEED, so runs on
+# different commits measure the same work. For each -j in JOBS the best of
+# RUNS clean builds is kept, and one more build under bench/runstat -s counts
+# system calls. Results are printed as a table and appended, one JSON object
+# per -j value, to OUT (default: bench/results/COMMIT.jsonl). With -c, two
+# result files are compared -j by -j.
+#
+#   SCALE=1 SEED=1 JOBS="1 2 4 8" RUNS=3 HUAP_FLAGS="--io-uring" OUT=...
+
+set -eu
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+ROOT="$SCRIPT_DIR/.."
+
+# "key":value of one JSON line, as awk sees it
+jget='function jget(line, k,    m) {
+	if (!match(line, "\"" k "\":[^,}]*"))
+		return ""
+	m = substr(line, RSTART + length(k) + 3, RLENGTH - length(k) - 3)
+	gsub(/"/, "", m)
+	return m
+}'
+
+if [[ "${1:-}" == "-c" ]]; then
+	OLD="${2:?usage: bench/bench.sh -c OLD.jsonl NEW.jsonl}"
+	NEW="${3:?usage: bench/bench.sh -c OLD.jsonl NEW.jsonl}"
+	awk "$jget"'
+	function pct(a, b) {
+		if (a == "" || b == "" || a + 0 == 0)
+			return "-"
+		return sprintf("%+.1f%%", (b - a) * 100 / a)
+	}
+	BEGIN {
+		nk = split("wall_ms pages_per_s mb_per_s maxrss_kb syscalls", keys)
+		printf "%-6s", "jobs"
+		for (i = 1; i <= nk; i++)
+			printf " %22s", keys[i]
+		printf "\n"
+	}
+	FNR == 1 { file++ }
+	{
+		j = jget($0, "jobs")
+		for (i = 1; i <= nk; i++)
+			v[file, j, keys[i]] = jget($0, keys[i])
+		if (file == 2)
+			order[++n] = j
+	}
+	END {
+		for (r = 1; r <= n; r++) {
+			j = order[r]
+			printf "%-6s", j
+			for (i = 1; i <= nk; i++) {
+				a = v[1, j, keys[i]]
+				b = v[2, j, keys[i]]
+				printf " %22s", sprintf("%s -> %s %s",
+				    a == "" ? "?" : a, b == "" ? "?" : b,
+				    pct(a, b))
+			}
+			printf "\n"
+		}
+	}' "$OLD" "$NEW"
+	exit 0
+fi
+
+abspath() { echo "$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"; }
+HUAP="$(abspath "${1:-$ROOT/huap}")"
+SCALE="${SCALE:-1}"
+SEED="${SEED:-1}"
+JOBS="${JOBS:-1 2 4 8}"
+RUNS="${RUNS:-3}"
+HUAP_FLAGS="${HUAP_FLAGS:-}"
+COMMIT="$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+if ! git -C "$ROOT" diff --quiet HEAD -- huap.c 2>/dev/null; then
+	COMMIT="$COMMIT-dirty"
+fi
+OUT="${OUT:-$SCRIPT_DIR/results/$COMMIT.jsonl}"
+WORK="$(mktemp -d)"
+
+trap 'rm -rf "$WORK"' EXIT
+
+CC="${CC:-cc}"
+"$CC" -O2 -std=c11 "$SCRIPT_DIR/corpus.c" -o "$WORK/corpus"
+"$CC" -O2 "$SCRIPT_DIR/runstat.c" -o "$WORK/runstat"
+
+# pages=N assets=N bytes=N
+eval "$("$WORK/corpus" "$WORK/src" "$SCALE" "$SEED")"
+
+# runstat's key=value line for one clean build
+build() {
+	rm -rf "$WORK/out"
+	# shellcheck disable=SC2086
+	(cd "$WORK/src" &&
+		"$WORK/runstat" "$@" "$HUAP" $HUAP_FLAGS -j "$J" "$WORK/out" \
+			2>&1 >/dev/null | grep '^wall_ms=' | tail -n 1)
+}
+# value of key in a runstat line
+field() { tr ' ' '\n' <<<"$1" | sed -n "s/^$2=//p"; }
+
+mkdir -p "$(dirname "$OUT")"
+echo "corpus: $pages pages, $assets assets, $(( bytes / 1048576 )) MiB" \
+	"(scale $SCALE, seed $SEED); $(nproc) CPUs; $HUAP $HUAP_FLAGS"
+printf "%-6s %10s %10s %8s %12s %10s\n" \
+	"jobs" "wall_ms" "pages/s" "MB/s" "maxrss_kb" "syscalls"
+for J in $JOBS; do
+	best=""
+	for (( r = 0; r < RUNS; r++ )); do
+		line="$(build)"
+		[[ "$(field "$line" status)" == 0 ]] || {
+			echo "build failed at -j $J" >&2
+			exit 1
+		}
+		if [[ -z "$best" ]] || awk -v a="$(field "$line" wall_ms)" \
+			-v b="$(field "$best" wall_ms)" 'BEGIN { exit !(a < b) }'; then
+			best="$line"
+		fi
+	done
+	# a traced build only for the counts; ptrace may not be allowed
+	traced="$(build -s || true)"
+	[[ "$(field "$traced" status)" == 0 ]] || traced=""
+
+	wall="$(field "$best" wall_ms)"
+	pps="$(awk -v n="$pages" -v t="$wall" \
+		'BEGIN { printf "%.1f", n * 1000 / t }')"
+	mbs="$(awk -v n="$bytes" -v t="$wall" \
+		'BEGIN { printf "%.1f", n / 1048576 * 1000 / t }')"
+	rss="$(field "$best" maxrss_kb)"
+	sys="$(field "$traced" syscalls)"
+	printf "%-6s %10s %10s %8s %12s %10s\n" \
+		"$J" "$wall" "$pps" "$mbs" "$rss" "${sys:--}"
+
+	{
+		printf '{"commit":"%s","flags":"%s","scale":%s,"seed":%s,' \
+			"$COMMIT" "$HUAP_FLAGS" "$SCALE" "$SEED"
+		printf '"jobs":%s,"pages":%s,"assets":%s,"bytes":%s,' \
+			"$J" "$pages" "$assets" "$bytes"
+		printf '"wall_ms":%s,"user_ms":%s,"sys_ms":%s,"maxrss_kb":%s,' \
+			"$wall" "$(field "$best" user_ms)" \
+			"$(field "$best" sys_ms)" "$rss"
+		printf '"pages_per_s":%s,"mb_per_s":%s,"syscalls":%s' \
+			"$pps" "$mbs" "${sys:-null}"
+		for kv in $traced; do
+			[[ "$kv" == calls_* ]] &&
+				printf ',"%s":%s' "${kv%%=*}" "${kv#*=}"
+		done
+		printf '}\n'
+	} >>"$OUT"
+done
+echo "results: $OUT"
@@ -0,0 +1,372 @@
+/*
+ * Deterministic synthetic site for bench/bench.sh:
+ *
+ *   corpus DIR [SCALE] [SEED]
+ *
+ * The same SCALE and SEED always give the same tree, byte for byte. SCALE
+ * (default 1) multiplies the file counts; the huge pages stay the same size.
+ *
+ *   posts/YYYY/MM/    many small dated posts linking to each other
+ *   huge/             a few pages of 1 to 8 MiB
+ *   code/, notes/     source files with snippets, and pages made mostly of
+ *                     $code directives and sidenotes
+ *   deep/             a 24-level chain and a 4-way tree 5 levels deep
+ *   assets/           lots of copied files, 256 B to 128 KiB
+ *
+ * plus a root layout.html and an override in posts/. Prints one line of
+ * key=value counts on stdout.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static uint64_t rng;
+static unsigned long npages, nassets;
+static unsigned long long nbytes;
+
+static uint64_t
+next(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+/* uniform in [lo, hi] */
+static unsigned long
+pick(unsigned long lo, unsigned long hi)
+{
+	return lo + (unsigned long)(next() % (hi - lo + 1));
+}
+
+static void
+mkdirs(const char *path)
+{
+	char p[4096];
+	snprintf(p, sizeof(p), "%s", path);
+	for (char *s = p + 1; *s; s++) {
+		if (*s != '/')
+			continue;
+		*s = '\0';
+		(void)mkdir(p, 0755);
+		*s = '/';
+	}
+	if (mkdir(p, 0755) == -1 && errno != EEXIST) {
+		perror(p);
+		exit(1);
+	}
+}
+
+static FILE *
+create(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static FILE *
+create(const char *fmt, ...)
+{
+	char path[4096];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(path, sizeof(path), fmt, ap);
+	va_end(ap);
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	return f;
+}
+static void
+finish(FILE *f, int page)
+{
+	nbytes += (unsigned long long)ftell(f);
+	if (page)
+		npages++;
+	else
+		nassets++;
+	if (fclose(f) != 0) {
+		perror("fclose");
+		exit(1);
+	}
+}
+
+static const char *const words[] = {"latency", "cache", "thread", "page",
+	"render", "buffer", "kernel", "queue", "arena", "layout", "snippet",
+	"markdown", "syscall", "index", "stream", "worker", "memory", "branch",
+	"vector", "inline"};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static void
+sentence(FILE *f)
+{
+	unsigned long n = pick(6, 18);
+	for (unsigned long i = 0; i < n; i++) {
+		const char *w = words[next() % NWORDS];
+		switch (next() % 16) {
+		case 0:
+			fprintf(f, "*%s*", w);
+			break;
+		case 1:
+			fprintf(f, "`%s()`", w);
+			break;
+		case 2:
+			fprintf(f, "**%s**", w);
+			break;
+		default:
+			fputs(w, f);
+		}
+		fputc(i + 1 < n ? ' ' : '.', f);
+	}
+	fputc(' ', f);
+}
+
+/* about kb KiB of prose; link(f) is called now and then for a link */
+static void
+prose(FILE *f, unsigned long kb, void (*link)(FILE *))
+{
+	long start = ftell(f);
+	while (ftell(f) - start < (long)(kb * 1024)) {
+		switch (next() % 10) {
+		case 0:
+			fprintf(f, "## %s %s\n\n", words[next() % NWORDS],
+			    words[next() % NWORDS]);
+			break;
+		case 1:
+			for (unsigned long i = pick(2, 5); i; i--) {
+				fputs("- ", f);
+				sentence(f);
+				fputc('\n', f);
+			}
+			fputc('\n', f);
+			break;
+		case 2:
+			fputs("```c\nint\nmain(void)\n{\n\treturn 0;\n}\n"
+			      "```\n\n",
+			    f);
+			break;
+		default:
+			for (unsigned long i = pick(2, 5); i; i--)
+				sentence(f);
+			if (link && next() % 2)
+				link(f);
+			fputs("\n\n", f);
+		}
+	}
+}
+
+static unsigned long post_count;
+
+static void
+post_path(unsigned long i, char *buf, size_t n, int md)
+{
+	unsigned long y = 2010 + i % 16, m = 1 + i / 16 % 12,
+		      d = 1 + i / 192 % 28;
+	snprintf(buf, n, "%lu/%02lu/%lu-%02lu-%02lu-post-%lu%s", y, m, y, m, d,
+	    i, md ? ".md" : "");
+}
+static void
+post_link(FILE *f)
+{
+	char p[256];
+	post_path(next() % post_count, p, sizeof(p), 1);
+	fprintf(f, "See [this post](/posts/%s). ", p);
+}
+
+static void
+posts(const char *root, unsigned long n)
+{
+	post_count = n;
+	for (unsigned long i = 0; i < n; i++) {
+		char p[256], dir[4096];
+		post_path(i, p, sizeof(p), 1);
+		snprintf(dir, sizeof(dir), "%s/posts/%s", root, p);
+		*strrchr(dir, '/') = '\0';
+		mkdirs(dir);
+		FILE *f = create("%s/posts/%s", root, p);
+		fprintf(f, "# Post %lu\n\n", i);
+		prose(f, pick(1, 6), post_link);
+		if (next() % 8 == 0) {
+			fputs("[sidenote]\n\n", f);
+			sentence(f);
+			fputs("\n\n[/sidenote]\n\n", f);
+		}
+		finish(f, 1);
+	}
+}
+
+static void
+huge(const char *root)
+{
+	char dir[4096];
+	snprintf(dir, sizeof(dir), "%s/huge", root);
+	mkdirs(dir);
+	for (unsigned long mb = 1; mb <= 8; mb *= 2) {
+		FILE *f = create("%s/huge/page-%lumb.md", root, mb);
+		fprintf(f, "# Huge page (%lu MiB)\n\n", mb);
+		prose(f, mb * 1024, post_link);
+		finish(f, 1);
+	}
+}
+
+#define NCODE 100
+#define SNIPPETS 8
+
+static void
+code(const char *root, unsigned long nnotes)
+{
+	char dir[4096];
+	snprintf(dir, sizeof(dir), "%s/code", root);
+	mkdirs(dir);
+	for (int i = 0; i < NCODE; i++) {
+		FILE *f = create("%s/code/src%d.c", root, i);
+		fprintf(f, "/* source %d */\n#include <stdio.h>\n\n", i);
+		for (int s = 0; s < SNIPPETS; s++) {
+			fprintf(f, "//snippet s%d\nstatic int\nf%d(int x)\n{\n",
+			    s, s);
+			for (unsigned long k = pick(3, 30); k; k--)
+				fprintf(f, "\tx = x * %lu + %lu; /* %s */\n",
+				    pick(2, 99), pick(0, 999),
+				    words[next() % NWORDS]);
+			fputs("\treturn x;\n}\n//endsnippet\n\n", f);
+		}
+		finish(f, 0);
+	}
+
+	snprintf(dir, sizeof(dir), "%s/notes", root);
+	mkdirs(dir);
+	for (unsigned long i = 0; i < nnotes; i++) {
+		FILE *f = create("%s/notes/note-%lu.md", root, i);
+		fprintf(f, "# Note %lu\n\n", i);
+		for (unsigned long k = pick(10, 30); k; k--) {
+			sentence(f);
+			fputs("\n\n", f);
+			if (next() % 3 == 0)
+				fprintf(f, "$code code/src%lu.c\n\n",
+				    pick(0, NCODE - 1));
+			else
+				fprintf(f, "$code code/src%lu.c [s%lu]\n\n",
+				    pick(0, NCODE - 1), pick(0, SNIPPETS - 1));
+			if (next() % 2) {
+				fputs("[sidenote]\n\n", f);
+				sentence(f);
+				fputs("\n\n[/sidenote]\n\n", f);
+			}
+		}
+		finish(f, 1);
+	}
+}
+
+static void
+deep_page(const char *dir, int i)
+{
+	FILE *f = create("%s/page-%d.md", dir, i);
+	fputs("# Deep page\n\n[up](../page-0.md)\n\n", f);
+	prose(f, 1, NULL);
+	finish(f, 1);
+}
+static void
+tree(char *dir, size_t len, int depth)
+{
+	mkdirs(dir);
+	deep_page(dir, 0);
+	if (depth == 0)
+		return;
+	for (int i = 0; i < 4; i++) {
+		snprintf(dir + len, 4096 - len, "/t%d", i);
+		tree(dir, strlen(dir), depth - 1);
+		dir[len] = '\0';
+	}
+}
+static void
+deep(const char *root, unsigned long scale)
+{
+	char dir[4096];
+	for (unsigned long s = 0; s < scale; s++) {
+		int n = snprintf(dir, sizeof(dir), "%s/deep/chain%lu", root, s);
+		for (int lvl = 0; lvl < 24; lvl++) {
+			n += snprintf(dir + n, sizeof(dir) - (size_t)n, "/l%d",
+			    lvl);
+			mkdirs(dir);
+			deep_page(dir, 0);
+			deep_page(dir, 1);
+		}
+		snprintf(dir, sizeof(dir), "%s/deep/tree%lu", root, s);
+		tree(dir, strlen(dir), 5);
+	}
+}
+
+static void
+assets(const char *root, unsigned long n)
+{
+	static const char *const ext[] = {"png", "jpg", "css", "js", "svg",
+		"woff2"};
+	static const char alpha[] = "abcdef {};\n"; /* text assets */
+	static uint8_t buf[128 * 1024];
+	char dir[4096];
+	for (unsigned long i = 0; i < n; i++) {
+		if (i % 200 == 0) {
+			snprintf(dir, sizeof(dir), "%s/assets/a%lu", root,
+			    i / 200);
+			mkdirs(dir);
+		}
+		/* mostly small, log-uniform between 256 B and 128 KiB */
+		size_t sz = (size_t)256 << pick(0, 8);
+		sz += (size_t)(next() % sz);
+		const char *e = ext[next() % 6];
+		int text = e[0] == 'c' || e[0] == 'j' || e[0] == 's';
+		for (size_t k = 0; k < sz; k += 8) {
+			uint64_t v = next();
+			for (size_t b = 0; b < 8 && k + b < sz; b++, v >>= 8)
+				buf[k + b] = text
+				    ? (uint8_t)alpha[(v & 0xff) % (sizeof(alpha) - 1)]
+				    : (uint8_t)v;
+		}
+		FILE *f = create("%s/asset-%lu.%s", dir, i, e);
+		fwrite(buf, 1, sz, f);
+		finish(f, 0);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: corpus DIR [SCALE] [SEED]\n");
+		return 2;
+	}
+	const char *root = argv[1];
+	unsigned long scale = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+	rng = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+	if (scale < 1)
+		scale = 1;
+	if (rng == 0)
+		rng = 1;
+
+	mkdirs(root);
+	FILE *f = create("%s/layout.html", root);
+	fputs("<!doctype html>\n<html><head><title>{{Title}}</title></head>\n"
+	      "<body><main>{{Body}}</main>\n"
+	      "<footer>{{Path}} - {{Date}}</footer></body></html>\n",
+	    f);
+	fclose(f);
+
+	posts(root, 2000 * scale);
+	f = create("%s/posts/layout.html", root);
+	fputs("<!doctype html>\n<html><head><title>{{Title}}</title></head>\n"
+	      "<body><article>{{Body}}</article>\n"
+	      "<footer>{{Date}}</footer></body></html>\n",
+	    f);
+	fclose(f);
+	huge(root);
+	code(root, 300 * scale);
+	deep(root, scale);
+	assets(root, 3000 * scale);
+
+	printf("pages=%lu assets=%lu bytes=%llu\n", npages, nassets, nbytes);
+	return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * entity_lookup(): perfect hash vs. the bsearch() it replaced.
+ *
+ *   bench/micro.sh entity [MB]
+ *
+ * "lookup" resolves a stream of names drawn like entity-heavy converted
+ * documents: mostly &nbsp;, &mdash; and friends, some of every other entity,
+ * and a few names that are not entities. Both lookups are first checked to
+ * agree on every name. "render" is md_html() over MB (default 4) of such
+ * text, for the end-to-end effect.
+ */
+
+/* the table is static; this copy is only read, the linked one serves md4c */
+#define entity_lookup entity_lookup_copy
+#include "../vendor/md4c/entity.c"
+#undef entity_lookup
+const ENTITY *entity_lookup(const char *name, size_t name_size);
+
+#include "md4c-html.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static const ENTITY *sorted[ENTITY_COUNT];
+
+static int
+cmp_sorted(const void *a, const void *b)
+{
+	return strcmp((*(const ENTITY *const *)a)->name,
+	    (*(const ENTITY *const *)b)->name);
+}
+
+/* the bsearch() entity_lookup() used before the hash, kept for comparison */
+typedef struct {
+	const char *name;
+	size_t size;
+} Key;
+
+static int
+cmp_key(const void *k, const void *e)
+{
+	const Key *key = k;
+	return strncmp(key->name, (*(const ENTITY *const *)e)->name,
+	    key->size);
+}
+
+static const ENTITY *
+lookup_bsearch(const char *name, size_t size)
+{
+	Key key = {name, size};
+	const ENTITY *const *e =
+	    bsearch(&key, sorted, ENTITY_COUNT, sizeof(sorted[0]), cmp_key);
+	return e ? *e : NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long long rng = 1;
+
+static unsigned
+next(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (unsigned)((rng * 2685821657736338717ULL) >> 32);
+}
+
+static const char *const common[] = {"&nbsp;", "&mdash;", "&ndash;",
+	"&hellip;", "&rsquo;", "&lsquo;", "&ldquo;", "&rdquo;", "&amp;",
+	"&lt;", "&gt;", "&quot;", "&copy;", "&eacute;", "&times;"};
+static const char *const misses[] = {"&nbps;", "&foo;", "&Mdash;",
+	"&hellip2;", "&x;", "&notanentityatall;"};
+
+/* one name as a converted document would have it */
+static const char *
+pick_name(void)
+{
+	unsigned r = next() % 100;
+	if (r < 70)
+		return common[next() % (sizeof(common) / sizeof(common[0]))];
+	if (r < 95)
+		return ENTITY_MAP[next() % ENTITY_COUNT].entity.name;
+	return misses[next() % (sizeof(misses) / sizeof(misses[0]))];
+}
+
+/* the linked table is another copy, so entries are compared by name */
+static int
+same(const ENTITY *a, const ENTITY *b)
+{
+	return a == b || (a && b && strcmp(a->name, b->name) == 0);
+}
+
+static void
+check(void)
+{
+	char buf[64];
+	for (size_t i = 0; i < ENTITY_COUNT; i++) {
+		const char *name = sorted[i]->name;
+		size_t n = strlen(name);
+		if (!same(entity_lookup(name, n), sorted[i]) ||
+		    lookup_bsearch(name, n) != sorted[i]) {
+			fprintf(stderr, "%s: lookups disagree\n", name);
+			exit(1);
+		}
+		/* md4c only asks for whole "&...;" references: try each
+		 * shorter one and each with one letter's case flipped */
+		for (size_t k = 2; k < n; k++) {
+			memcpy(buf, name, k - 1);
+			buf[k - 1] = ';';
+			buf[k] = '\0';
+			if (!same(entity_lookup(buf, k), lookup_bsearch(buf, k)))
+				goto disagree;
+		}
+		for (size_t k = 1; k + 1 < n; k++) {
+			memcpy(buf, name, n + 1);
+			buf[k] ^= 0x20;
+			if (!same(entity_lookup(buf, n), lookup_bsearch(buf, n)))
+				goto disagree;
+		}
+	}
+	for (size_t i = 0; i < sizeof(misses) / sizeof(misses[0]); i++)
+		if (entity_lookup(misses[i], strlen(misses[i])) ||
+		    lookup_bsearch(misses[i], strlen(misses[i]))) {
+			fprintf(stderr, "%s: found\n", misses[i]);
+			exit(1);
+		}
+	return;
+disagree:
+	fprintf(stderr, "%s: lookups disagree\n", buf);
+	exit(1);
+}
+
+static void
+bench_lookup(void)
+{
+	enum { N = 1 << 16, ITERS = 200 };
+	static const char *names[N];
+	static size_t sizes[N];
+	for (size_t i = 0; i < N; i++) {
+		names[i] = pick_name();
+		sizes[i] = strlen(names[i]);
+	}
+
+	volatile size_t found = 0;
+	double t0 = now();
+	for (int it = 0; it < ITERS; it++)
+		for (size_t i = 0; i < N; i++)
+			found += lookup_bsearch(names[i], sizes[i]) != NULL;
+	double t1 = now();
+	for (int it = 0; it < ITERS; it++)
+		for (size_t i = 0; i < N; i++)
+			found += entity_lookup(names[i], sizes[i]) != NULL;
+	double t2 = now();
+
+	double n = (double)N * ITERS;
+	printf("%-8s %8.1f ns bsearch  %8.1f ns hash  (x%.1f)\n", "lookup",
+	    (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n, (t1 - t0) / (t2 - t1));
+}
+
+static void
+count_out(const MD_CHAR *text, MD_SIZE size, void *userdata)
+{
+	(void)text;
+	*(size_t *)userdata += size;
+}
+
+static void
+bench_render(size_t bytes)
+{
+	char *src = malloc(bytes + 256);
+	size_t n = 0;
+	if (!src)
+		exit(1);
+	while (n < bytes) {
+		/* a paragraph of words and entities, about one in four */
+		for (int w = 0; w < 40; w++)
+			n += (size_t)sprintf(src + n, "%s ",
+			    next() % 4 ? "word" : pick_name());
+		n += (size_t)sprintf(src + n, "\n\n");
+	}
+
+	enum { ITERS = 10 };
+	size_t out = 0;
+	double t0 = now();
+	for (int it = 0; it < ITERS; it++)
+		md_html(src, (MD_SIZE)n, count_out, &out, 0, 0);
+	double t1 = now();
+	printf("%-8s %8.1f MB/s  (%zu MB in, %zu MB out)\n", "render",
+	    (double)n * ITERS / (1024 * 1024) / (t1 - t0), n >> 20,
+	    out / ITERS >> 20);
+	free(src);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t mb = argc > 1 ? (size_t)atol(argv[1]) : 4;
+
+	for (size_t i = 0; i < ENTITY_COUNT; i++)
+		sorted[i] = &ENTITY_MAP[i].entity;
+	qsort(sorted, ENTITY_COUNT, sizeof(sorted[0]), cmp_sorted);
+	check();
+
+	bench_lookup();
+	bench_render(mb << 20);
+	return 0;
+}
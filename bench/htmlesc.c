@@ -0,0 +1,258 @@
+/*
+ * render_html_escaped(): vector scans vs. the per-byte loop they replaced.
+ *
+ *   bench/micro.sh htmlesc [MB]
+ *
+ * First a fuzz pass: random buffers of every length up to a few vectors,
+ * heavy in & < > " and NUL, plus every escapable byte at every position,
+ * must come out byte for byte as the old loop wrote them at each scan
+ * width this CPU runs. Then MB (default 8) of sparse prose and of dense
+ * markup are timed through each.
+ */
+
+/* the renderer's statics are needed; this copy's entry points step aside
+ * for the linked one */
+#define md_html md_html_copy
+#define md_html_ex md_html_ex_copy
+#include "../vendor/md4c/md4c-html.c"
+#undef md_html
+#undef md_html_ex
+
+#include <stdio.h>
+#include <time.h>
+
+/* the loop render_html_escaped() used before find_html_esc(), kept for
+ * comparison */
+static void
+escaped_bytes(MD_HTML *r, const MD_CHAR *data, MD_SIZE size)
+{
+	MD_OFFSET beg = 0;
+	MD_OFFSET off = 0;
+
+	while (1) {
+		while (off + 3 < size && !NEED_HTML_ESC(data[off + 0]) &&
+		    !NEED_HTML_ESC(data[off + 1]) &&
+		    !NEED_HTML_ESC(data[off + 2]) &&
+		    !NEED_HTML_ESC(data[off + 3]))
+			off += 4;
+		while (off < size && !NEED_HTML_ESC(data[off]))
+			off++;
+
+		if (off > beg)
+			render_verbatim(r, data + beg, off - beg);
+
+		if (off < size) {
+			switch (data[off]) {
+			case '&':
+				RENDER_VERBATIM(r, "&amp;");
+				break;
+			case '<':
+				RENDER_VERBATIM(r, "&lt;");
+				break;
+			case '>':
+				RENDER_VERBATIM(r, "&gt;");
+				break;
+			case '"':
+				RENDER_VERBATIM(r, "&quot;");
+				break;
+			}
+			off++;
+		} else {
+			break;
+		}
+		beg = off;
+	}
+}
+
+typedef struct {
+	char *p;
+	size_t len, cap;
+} Out;
+
+static void
+collect(const MD_CHAR *text, MD_SIZE size, void *userdata)
+{
+	Out *o = userdata;
+	if (o->len + size > o->cap) {
+		o->cap = (o->len + size) * 2;
+		o->p = realloc(o->p, o->cap);
+		if (!o->p) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(o->p + o->len, text, size);
+	o->len += size;
+}
+static void
+discard(const MD_CHAR *text, MD_SIZE size, void *userdata)
+{
+	(void)text;
+	*(size_t *)userdata += size;
+}
+
+/* a renderer as md_html_ex() sets one up, at scan width simd */
+static void
+render_init(MD_HTML *r, int simd, void (*out)(const MD_CHAR *, MD_SIZE,
+    void *), void *userdata)
+{
+	memset(r, 0, sizeof(*r));
+	r->process_output = out;
+	r->userdata = userdata;
+	r->simd = simd;
+	for (int i = 0; i < 256; i++)
+		if (strchr("\"&<>", i) != NULL)
+			r->escape_map[i] |= NEED_HTML_ESC_FLAG;
+}
+
+static const char *const simd_names[] = {"scalar", "16-byte", "32-byte"};
+
+static void
+escape(int simd, int old, const char *data, size_t n, Out *o)
+{
+	MD_HTML r;
+	o->len = 0;
+	render_init(&r, simd, collect, o);
+	if (old)
+		escaped_bytes(&r, data, (MD_SIZE)n);
+	else
+		render_html_escaped(&r, data, (MD_SIZE)n);
+	render_flush(&r);
+}
+
+static unsigned long long rng = 1;
+
+static unsigned
+next(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (unsigned)((rng * 2685821657736338717ULL) >> 32);
+}
+
+static void
+check_one(int top, const char *data, size_t n, Out *want, Out *got)
+{
+	escape(MD_HTML_SIMD_NONE, 1, data, n, want);
+	for (int simd = MD_HTML_SIMD_NONE; simd <= top; simd++) {
+		escape(simd, 0, data, n, got);
+		if (got->len != want->len ||
+		    memcmp(got->p, want->p, want->len) != 0) {
+			fprintf(stderr, "%s: output differs for %zu bytes\n",
+			    simd_names[simd], n);
+			exit(1);
+		}
+	}
+}
+
+static void
+fuzz(int top)
+{
+	static const char special[] = "&<>\"\0a";
+	char buf[256];
+	Out want = {0}, got = {0};
+	unsigned long cases = 0;
+
+	for (int round = 0; round < 20000; round++) {
+		size_t n = next() % sizeof(buf);
+		unsigned density = next() % 4;
+		for (size_t i = 0; i < n; i++) {
+			unsigned r = next();
+			if (density == 0)
+				buf[i] = (char)(r >> 8); /* any byte */
+			else if (r % (density * 16) == 0)
+				buf[i] = special[(r >> 8) % (sizeof(special) - 1)];
+			else
+				buf[i] = (char)('a' + (r >> 8) % 26);
+		}
+		check_one(top, buf, n, &want, &got);
+		cases++;
+	}
+	/* each escapable byte (and NUL) alone at every position */
+	for (size_t n = 1; n <= 96; n++) {
+		for (size_t at = 0; at < n; at++) {
+			for (size_t k = 0; k < sizeof(special) - 2; k++) {
+				memset(buf, 'x', n);
+				buf[at] = special[k];
+				check_one(top, buf, n, &want, &got);
+				cases++;
+			}
+		}
+	}
+	free(want.p);
+	free(got.p);
+	printf("fuzz: %lu cases agree at", cases);
+	for (int simd = MD_HTML_SIMD_NONE; simd <= top; simd++)
+		printf(" %s", simd_names[simd]);
+	printf("\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+run(const char *name, const char *src, size_t n, int top)
+{
+	enum { ITERS = 10 };
+	double mb = (double)n * ITERS / (1024 * 1024);
+	size_t sink = 0;
+	MD_HTML r;
+
+	printf("%-8s", name);
+	for (int simd = -1; simd <= top; simd++) {
+		render_init(&r, simd < 0 ? MD_HTML_SIMD_NONE : simd, discard,
+		    &sink);
+		double t0 = now();
+		for (int it = 0; it < ITERS; it++) {
+			if (simd < 0)
+				escaped_bytes(&r, src, (MD_SIZE)n);
+			else
+				render_html_escaped(&r, src, (MD_SIZE)n);
+			render_flush(&r);
+		}
+		double t1 = now();
+		printf(" %8.1f MB/s %s", mb / (t1 - t0),
+		    simd < 0 ? "bytes" : simd_names[simd]);
+	}
+	printf("\n");
+}
+
+/* prose with a rare entity, or markup with one every few bytes */
+static char *
+gen(size_t bytes, int dense)
+{
+	char *s = malloc(bytes);
+	if (!s)
+		exit(1);
+	for (size_t i = 0; i < bytes; i++) {
+		unsigned r = next();
+		if (r % (dense ? 6 : 400) == 0)
+			s[i] = "&<>\""[(r >> 8) % 4];
+		else
+			s[i] = (char)(r % 7 == 0 ? ' ' : 'a' + (r >> 8) % 26);
+	}
+	return s;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t mb = argc > 1 ? (size_t)atol(argv[1]) : 8;
+	int top = find_html_esc_simd();
+
+	fuzz(top);
+
+	char *sparse = gen(mb << 20, 0);
+	char *dense = gen(mb << 20, 1);
+	run("sparse", sparse, mb << 20, top);
+	run("dense", dense, mb << 20, top);
+	free(sparse);
+	free(dense);
+	return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/bash
+#
+# Build and run a C microbenchmark from bench/NAME.c.
+#
+#   bench/micro.sh NAME [ARGS...]
+#
+# Microbenchmarks #include "../huap.c" (with its main() renamed) so they can
+# call internal functions directly.
+
+set -eu
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+ROOT="$SCRIPT_DIR/.."
+NAME="${1:?usage: bench/micro.sh NAME [ARGS...]}"
+shift
+
+CC="${CC:-cc}"
+CFLAGS="${CFLAGS:--std=c11 -Wall -Wextra -O2}"
+BIN="$(mktemp -d)/$NAME"
+trap 'rm -rf "$(dirname "$BIN")"' EXIT
+
+# shellcheck disable=SC2086
+"$CC" -D_DEFAULT_SOURCE -I"$ROOT/vendor/md4c" -I"$ROOT/vendor/mongoose" \
+	$CFLAGS "$SCRIPT_DIR/$NAME.c" "$ROOT/vendor/mongoose/mongoose.c" \
+	"$ROOT"/vendor/md4c/*.c "$ROOT/deflate.c" -pthread -o "$BIN"
+"$BIN" "$@"
@@ -0,0 +1,132 @@
+/*
+ * preprocess(): directive scanner vs. the previous line-by-line loop.
+ *
+ *   bench/micro.sh preprocess [MB]
+ *
+ * Each corpus is checked for identical output before it is timed.
+ */
+
+#define main huap_main
+#include "../huap.c"
+#undef main
+
+#include <time.h>
+
+/* the loop preprocess() used before the scanner, kept for comparison */
+static char *
+preprocess_lines(const char *src)
+{
+	Buf out = {0};
+	const char *p = src;
+
+	while (*p) {
+		const char *line = p;
+		const char *nl = strchr(p, '\n');
+		size_t ln = nl ? (size_t)(nl - line) : strlen(line);
+
+		const char *ts;
+		size_t tn;
+		line_trim(line, ln, &ts, &tn);
+
+		if (tn == strlen(SIDENOTE_S) &&
+		    memcmp(ts, SIDENOTE_S, tn) == 0) {
+			buf_puts(&out, SIDENOTE_R_S);
+			buf_putn(&out, "\n", 1);
+		} else if (tn == strlen(SIDENOTE_E) &&
+			   memcmp(ts, SIDENOTE_E, tn) == 0) {
+			buf_puts(&out, SIDENOTE_R_E);
+			buf_putn(&out, "\n", 1);
+		} else if (tn >= strlen(CODE_CMD) &&
+			   memcmp(ts, CODE_CMD, strlen(CODE_CMD)) == 0) {
+			handle_code_line(ts, tn, &out, NULL);
+			buf_putn(&out, "\n", 1);
+		} else {
+			buf_putn(&out, line, ln);
+			if (nl)
+				buf_putn(&out, "\n", 1);
+		}
+
+		if (!nl)
+			break;
+		p = nl + 1;
+	}
+	if (!out.p)
+		out.p = strdup("");
+	return out.p;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* plain prose with links; every sparse-th paragraph gets a sidenote */
+static char *
+gen(size_t bytes, int sparse)
+{
+	Buf b = {0};
+	for (unsigned i = 0; b.len < bytes; i++) {
+		char line[256];
+		snprintf(line, sizeof(line),
+		    "Paragraph %u has [a link](page%u.md), some $money and "
+		    "plain words to fill the line.\n\n",
+		    i, i);
+		buf_puts(&b, line);
+		if (sparse && i % (unsigned)sparse == 0)
+			buf_puts(&b, "[sidenote]\n\nAn aside.\n\n[/sidenote]\n\n");
+	}
+	return b.p;
+}
+
+static void
+run(const char *name, char *src, int iters)
+{
+	size_t n = strlen(src), plen;
+	Arena a;
+	arena_init(&a, ARENA_BLOCK);
+
+	char *old = preprocess_lines(src);
+	char *cur = preprocess(&a, src, n, NULL, &plen);
+	if (plen != strlen(old) || memcmp(cur, old, plen) != 0) {
+		fprintf(stderr, "%s: output mismatch\n", name);
+		exit(1);
+	}
+	free(old);
+	arena_reset(&a);
+
+	double t0 = now();
+	for (int i = 0; i < iters; i++)
+		free(preprocess_lines(src));
+	double t1 = now();
+	for (int i = 0; i < iters; i++) {
+		(void)preprocess(&a, src, n, NULL, &plen);
+		arena_reset(&a);
+	}
+	double t2 = now();
+	arena_destroy(&a);
+
+	double mb = (double)n * iters / (1024 * 1024);
+	printf("%-12s %8.1f MB/s lines  %8.1f MB/s scan  (x%.1f)\n", name,
+	    mb / (t1 - t0), mb / (t2 - t1), (t1 - t0) / (t2 - t1));
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t mb = argc > 1 ? (size_t)atol(argv[1]) : 8;
+	int iters = 20;
+
+	char *none = gen(mb << 20, 0);
+	char *sparse = gen(mb << 20, 200);
+	char *dense = gen(mb << 20, 2);
+	run("no-directive", none, iters);
+	run("sparse", sparse, iters);
+	run("dense", dense, iters);
+	free(none);
+	free(sparse);
+	free(dense);
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * read_file(): copying read() into the arena vs. mapping the file.
+ *
+ *   bench/micro.sh readpath [DIR]
+ *
+ * For each size a file of Markdown is written to DIR (default: $TMPDIR or
+ * /tmp) and loaded through both paths, each followed by the preprocess()
+ * scan that consumes it next. "warm" reads from the page cache; "cold"
+ * drops the file's pages first with posix_fadvise(POSIX_FADV_DONTNEED).
+ * MMAP_MIN in huap.c is picked from where the columns cross.
+ */
+
+#define main huap_main
+#include "../huap.c"
+#undef main
+
+#include <time.h>
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+gen(const char *path, size_t bytes)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	for (unsigned i = 0; bytes > 0; i++) {
+		char line[256];
+		int n = snprintf(line, sizeof(line),
+		    "Paragraph %u has [a link](page%u.md), some *emphasis* "
+		    "and plain words to fill the line.\n\n",
+		    i, i);
+		size_t k = (size_t)n < bytes ? (size_t)n : bytes;
+		fwrite(line, 1, k, f);
+		bytes -= k;
+	}
+	fclose(f);
+}
+
+/* seconds per load of path through one path, averaged over iters */
+static double
+load(Arena *a, const char *path, size_t n, int map, int cold, int iters)
+{
+	double t = 0;
+	for (int i = 0; i < iters; i++) {
+		int fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			perror(path);
+			exit(1);
+		}
+		if (cold)
+			(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		double t0 = now();
+		char *src = map ? arena_map(a, fd, n) : arena_read(a, fd, n);
+		size_t plen;
+		if (!src || !preprocess(a, src, n, NULL, &plen)) {
+			fprintf(stderr, "%s: load failed\n", path);
+			exit(1);
+		}
+		close(fd);
+		arena_reset(a);
+		t += now() - t0;
+	}
+	return t / iters;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t sizes_kb[] = {4, 16, 64, 256, 1024, 4096, 16384,
+	    65536};
+	const char *dir = argc > 1 ? argv[1] : getenv("TMPDIR");
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/huap-readpath.md", dir ? dir : "/tmp");
+
+	Arena a;
+	arena_init(&a, ARENA_BLOCK);
+	printf("%8s  %12s %12s  %12s %12s\n", "size_kb", "warm read",
+	    "warm mmap", "cold read", "cold mmap");
+	for (size_t i = 0; i < sizeof(sizes_kb) / sizeof(sizes_kb[0]); i++) {
+		size_t n = sizes_kb[i] * 1024;
+		int iters = (int)((256u << 20) / n);
+		iters = iters < 5 ? 5 : iters > 2000 ? 2000 : iters;
+		gen(path, n);
+
+		double r[4];
+		for (int k = 0; k < 4; k++) {
+			(void)load(&a, path, n, k & 1, k >> 1, 2);
+			r[k] = load(&a, path, n, k & 1, k >> 1, iters);
+		}
+		double mb = (double)n / (1024 * 1024);
+		printf("%8zu  %7.0f MB/s %7.0f MB/s  %7.0f MB/s %7.0f MB/s\n",
+		    sizes_kb[i], mb / r[0], mb / r[1], mb / r[2], mb / r[3]);
+	}
+	arena_destroy(&a);
+	unlink(path);
+	return 0;
+}
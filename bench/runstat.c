@@ -0,0 +1,194 @@
+/*
+ * Run a command and report what it cost, for bench/bench.sh:
+ *
+ *   runstat [-s] CMD [ARGS...]
+ *
+ * Prints one line of key=value pairs on stderr once CMD exits: wall, user
+ * and system time in ms, peak RSS in KiB and the exit status. With -s every
+ * thread of CMD is traced with ptrace(2) and the line also carries the number
+ * of system calls, in total and for the ones a build mostly makes. Tracing
+ * slows CMD down, so timed runs go without it. Linux only.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef NT_PRSTATUS
+#define NT_PRSTATUS 1
+#endif
+
+/* the calls counted one by one; the rest only add to the total */
+static const struct {
+	const char *name;
+	long nr;
+} counted[] = {
+	{"openat", SYS_openat},
+	{"read", SYS_read},
+	{"write", SYS_write},
+	{"close", SYS_close},
+#ifdef SYS_newfstatat
+	{"newfstatat", SYS_newfstatat},
+#endif
+	{"fstat", SYS_fstat},
+	{"statx", SYS_statx},
+	{"mmap", SYS_mmap},
+	{"munmap", SYS_munmap},
+	{"getdents64", SYS_getdents64},
+	{"io_uring_enter", SYS_io_uring_enter},
+	{"futex", SYS_futex},
+};
+#define NCOUNTED (sizeof(counted) / sizeof(counted[0]))
+
+/* number of the call pid is entering, -1 if unknown */
+static long
+syscall_nr(pid_t pid)
+{
+	struct user_regs_struct r;
+	struct iovec iov = {&r, sizeof(r)};
+	if (ptrace(PTRACE_GETREGSET, pid, (void *)NT_PRSTATUS, &iov) == -1)
+		return -1;
+#if defined(__x86_64__)
+	return (long)r.orig_rax;
+#elif defined(__aarch64__)
+	return (long)r.regs[8];
+#else
+	return -1;
+#endif
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/* Follow pid and every thread it starts until pid exits; counts syscall
+ * entries. A thread stops at entry and exit alike, so only every other stop
+ * per thread is an entry: in_call remembers which threads are inside one. */
+static int
+trace(pid_t pid, unsigned long *total, unsigned long *n)
+{
+	enum { MAXT = 4096 };
+	static pid_t tids[MAXT];
+	static char in_call[MAXT];
+	size_t ntids = 0;
+	int status = 0, code = -1;
+
+	if (waitpid(pid, &status, __WALL) == -1)
+		return -1;
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	    (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+		PTRACE_O_EXITKILL));
+	ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+	for (;;) {
+		pid_t t = waitpid(-1, &status, __WALL);
+		if (t == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (t == pid)
+				code = WIFEXITED(status) ? WEXITSTATUS(status)
+							 : 128 + WTERMSIG(status);
+			continue;
+		}
+		int sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			size_t i;
+			for (i = 0; i < ntids && tids[i] != t; i++)
+				;
+			if (i == ntids && ntids < MAXT) {
+				tids[ntids] = t;
+				in_call[ntids++] = 0;
+			}
+			if (i < ntids && (in_call[i] ^= 1)) {
+				long nr = syscall_nr(t);
+				(*total)++;
+				for (size_t k = 0; k < NCOUNTED; k++)
+					if (counted[k].nr == nr)
+						n[k]++;
+			}
+		} else if (WSTOPSIG(status) != SIGTRAP &&
+		    WSTOPSIG(status) != SIGSTOP) {
+			sig = WSTOPSIG(status); /* the command's own */
+		}
+		ptrace(PTRACE_SYSCALL, t, NULL, (void *)(long)sig);
+	}
+	return code;
+}
+
+int
+main(int argc, char **argv)
+{
+	int sys = 0;
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+		sys = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "usage: runstat [-s] CMD [ARGS...]\n");
+		return 2;
+	}
+
+	double t0 = now_ms();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		if (sys) {
+			ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+			raise(SIGSTOP);
+		}
+		execvp(argv[1], argv + 1);
+		perror(argv[1]);
+		_exit(127);
+	}
+
+	unsigned long total = 0, n[NCOUNTED] = {0};
+	int code;
+	if (sys) {
+		code = trace(pid, &total, n);
+	} else {
+		int status;
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+			;
+		code = WIFEXITED(status) ? WEXITSTATUS(status)
+					 : 128 + WTERMSIG(status);
+	}
+	double wall = now_ms() - t0;
+
+	struct rusage ru;
+	getrusage(RUSAGE_CHILDREN, &ru);
+	fprintf(stderr, "wall_ms=%.1f user_ms=%.1f sys_ms=%.1f maxrss_kb=%ld "
+	    "status=%d",
+	    wall, (double)ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3,
+	    (double)ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3,
+	    ru.ru_maxrss, code);
+	if (sys) {
+		fprintf(stderr, " syscalls=%lu", total);
+		for (size_t k = 0; k < NCOUNTED; k++)
+			fprintf(stderr, " calls_%s=%lu", counted[k].name, n[k]);
+	}
+	fprintf(stderr, "\n");
+	return code;
+}
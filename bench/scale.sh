@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Clean-build wall time of build mode from 1 to 64 worker threads.
+#
+#   bench/scale.sh [HUAP] [BASELINE_HUAP]
+#
+# The corpus is a tree of DIRS directories, FILES files each: mostly small
+# pages, some copied assets and, in every tenth directory, one large page, so
+# both the walk and the tail of the build show up. Each thread count is run
+# RUNS times and the best time is kept.
+
+set -eu
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+HUAP="${1:-$SCRIPT_DIR/../huap}"
+BASE="${2:-}"
+WORK="$(mktemp -d)"
+DIRS="${DIRS:-200}"
+FILES="${FILES:-50}"
+RUNS="${RUNS:-3}"
+THREADS="${THREADS:-1 2 4 8 16 32 64}"
+
+trap 'rm -rf "$WORK"' EXIT
+
+abspath() { echo "$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"; }
+HUAP="$(abspath "$HUAP")"
+[[ -n "$BASE" ]] && BASE="$(abspath "$BASE")"
+
+# a page of roughly $1 KiB
+gen_page() {
+	local kb="$1" i=0
+	echo "# Page"
+	while (( i * 120 < kb * 1024 )); do
+		echo "Paragraph $i with *emphasis*, a [link](p$i.md) and plain text."
+		echo
+		i=$((i + 1))
+	done
+}
+
+gen_page 2 > "$WORK/small.md"
+gen_page 4096 > "$WORK/large.md"
+head -c 16384 /dev/urandom > "$WORK/asset.bin"
+for (( d = 0; d < DIRS; d++ )); do
+	dir="$WORK/src/s$((d % 10))/d$d"
+	mkdir -p "$dir"
+	for (( f = 0; f < FILES; f++ )); do
+		if (( f % 5 == 4 )); then
+			cp "$WORK/asset.bin" "$dir/a$f.bin"
+		else
+			cp "$WORK/small.md" "$dir/p$f.md"
+		fi
+	done
+	(( d % 10 == 0 )) && cp "$WORK/large.md" "$dir/large.md"
+done
+
+# best of RUNS clean builds, in ms
+run() {
+	local bin="$1" j="$2" best="" t0 t1 ms
+	for (( r = 0; r < RUNS; r++ )); do
+		rm -rf "$WORK/out"
+		t0=$(date +%s%N)
+		(cd "$WORK/src" && "$bin" -j "$j" "$WORK/out" >/dev/null)
+		t1=$(date +%s%N)
+		ms=$(( (t1 - t0) / 1000000 ))
+		[[ -z "$best" || "$ms" -lt "$best" ]] && best="$ms"
+	done
+	echo "$best"
+}
+
+echo "$(find "$WORK/src" -type f | wc -l) files," \
+	"$(du -sh "$WORK/src" | cut -f1), $(nproc) CPUs"
+printf "%-8s %10s %8s" "threads" "huap_ms" "speedup"
+[[ -n "$BASE" ]] && printf " %12s" "baseline_ms"
+printf "\n"
+first=""
+for j in $THREADS; do
+	ms="$(run "$HUAP" "$j")"
+	[[ -z "$first" ]] && first="$ms"
+	printf "%-8s %10s %8s" "$j" "$ms" \
+		"$(awk -v a="$first" -v b="$ms" 'BEGIN { printf "%.2f", a / (b ? b : 1) }')"
+	[[ -n "$BASE" ]] && printf " %12s" "$(run "$BASE" "$j")"
+	printf "\n"
+done
@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# Per-page allocations and peak RSS of build mode on large documents.
+#
+#   bench/stream.sh [HUAP] [BASELINE_HUAP]
+#
+# With a second binary, both are run on the same corpus so the numbers can be
+# compared directly (e.g. a build of the previous commit).
+
+set -eu
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+HUAP="${1:-$SCRIPT_DIR/../huap}"
+BASE="${2:-}"
+WORK="$(mktemp -d)"
+SIZES_KB="${SIZES_KB:-256 1024 4096 7000}"
+
+trap 'rm -rf "$WORK"' EXIT
+
+abspath() { echo "$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"; }
+HUAP="$(abspath "$HUAP")"
+[[ -n "$BASE" ]] && BASE="$(abspath "$BASE")"
+
+cc -O2 -shared -fPIC "$SCRIPT_DIR/alloccount.c" -o "$WORK/alloccount.so"
+
+# one page of roughly $1 KiB of mixed Markdown
+gen_page() {
+	local kb="$1" i=0
+	{
+		echo "# Large page"
+		while (( i * 160 < kb * 1024 )); do
+			echo "Paragraph $i with *emphasis*, \`code\`, a [link](p$i.md) and"
+			echo "some plain text to pad the line out a little further."
+			echo
+			i=$((i + 1))
+		done
+	} > "$2"
+}
+
+run() {
+	local bin="$1" src="$2"
+	rm -rf "$WORK/out"
+	(cd "$src" && LD_PRELOAD="$WORK/alloccount.so" "$bin" -j 1 "$WORK/out" \
+		2>&1 >/dev/null | tail -n 1)
+}
+
+printf "%-10s %-10s %s\n" "size_kb" "binary" "result"
+for kb in $SIZES_KB; do
+	src="$WORK/src-$kb"
+	mkdir -p "$src"
+	gen_page "$kb" "$src/page.md"
+	printf "%-10s %-10s %s\n" "$kb" "huap" "$(run "$HUAP" "$src")"
+	if [[ -n "$BASE" ]]; then
+		printf "%-10s %-10s %s\n" "$kb" "baseline" "$(run "$BASE" "$src")"
+	fi
+done
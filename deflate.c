@@ -0,0 +1,742 @@
+/*
+ * Small in-memory DEFLATE (RFC 1951) / gzip (RFC 1952) encoder, for the .gz
+ * siblings of -z builds and gzip responses in serve mode. Checked against
+ * zlib's inflate by test/deflate.c (make test).
+ *
+ * Design notes:
+ *
+ *  - LZ77 over a 32 KiB window with hash chains and one-step lazy matching.
+ *    Chain length, lazy threshold and "nice" length depend on the level.
+ *  - Symbols are buffered per block; each block is emitted as whichever of
+ *    stored, fixed-Huffman or dynamic-Huffman is smallest.
+ *  - Huffman code lengths are limited by rebuilding the tree with halved
+ *    frequencies until the limit holds. This is slightly worse than
+ *    package-merge but simple and adequate for text.
+ *  - Everything is reentrant: all state lives on the stack or in buffers
+ *    allocated per call, so the encoder is safe to use from many threads.
+ */
+
+#include "deflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WSIZE 32768
+#define WMASK (WSIZE - 1)
+#define HBITS 15
+#define HSIZE (1 << HBITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define TOO_FAR 4096 /* drop length-3 matches further away than this */
+
+#define BLOCK_SYMS 32768
+
+#define NLITLEN 286
+#define NDIST 30
+#define NCLEN 19
+
+/* CRC-32 */
+
+static const uint32_t crc_table[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+uint32_t
+dfl_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Static tables (RFC 1951, 3.2.5) */
+
+static const uint16_t len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15,
+	17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227,
+	258};
+static const uint8_t len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2,
+	2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33,
+	49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+	6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5,
+	5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t clen_order[NCLEN] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5,
+	11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static const struct {
+	uint16_t chain; /* max hash chain entries to probe */
+	uint16_t lazy;  /* only look one byte ahead below this length */
+	uint16_t nice;  /* stop searching at this length */
+} level_cfg[10] = {
+	{0, 0, 0},
+	{4, 0, 8},
+	{8, 0, 16},
+	{16, 0, 32},
+	{16, 4, 16},
+	{32, 16, 32},
+	{128, 16, 128},
+	{256, 32, 128},
+	{1024, 128, 258},
+	{4096, 258, 258},
+};
+
+static int
+ilog2(unsigned v)
+{
+	int n = 0;
+	while (v >>= 1)
+		n++;
+	return n;
+}
+static int
+len_code(unsigned len)
+{
+	unsigned x;
+	int n;
+	if (len == MAX_MATCH)
+		return 28;
+	x = len - 3;
+	if (x < 8)
+		return (int)x;
+	n = ilog2(x);
+	return 4 * (n - 1) + (int)((x >> (n - 2)) & 3);
+}
+static int
+dist_code(unsigned dist)
+{
+	unsigned x = dist - 1;
+	int n;
+	if (x < 4)
+		return (int)x;
+	n = ilog2(x);
+	return 2 * n + (int)((x >> (n - 1)) & 1);
+}
+
+/* Bit output */
+
+typedef struct {
+	unsigned char *p;
+	size_t len;
+	size_t cap;
+	uint64_t bits;
+	int nbits;
+	int oom;
+} Out;
+
+static void
+out_bytes(Out *o, const void *s, size_t n)
+{
+	if (o->oom)
+		return;
+	if (o->len + n > o->cap) {
+		size_t ncap = o->cap ? o->cap : 4096;
+		unsigned char *np;
+		while (ncap < o->len + n)
+			ncap *= 2;
+		np = realloc(o->p, ncap);
+		if (!np) {
+			o->oom = 1;
+			return;
+		}
+		o->p = np;
+		o->cap = ncap;
+	}
+	memcpy(o->p + o->len, s, n);
+	o->len += n;
+}
+static void
+put_bits(Out *o, uint32_t v, int n)
+{
+	o->bits |= (uint64_t)v << o->nbits;
+	o->nbits += n;
+	if (o->nbits >= 32) {
+		unsigned char b[4];
+		b[0] = (unsigned char)o->bits;
+		b[1] = (unsigned char)(o->bits >> 8);
+		b[2] = (unsigned char)(o->bits >> 16);
+		b[3] = (unsigned char)(o->bits >> 24);
+		out_bytes(o, b, 4);
+		o->bits >>= 32;
+		o->nbits -= 32;
+	}
+}
+static void
+flush_bits(Out *o)
+{
+	while (o->nbits > 0) {
+		unsigned char b = (unsigned char)o->bits;
+		out_bytes(o, &b, 1);
+		o->bits >>= 8;
+		o->nbits -= 8;
+	}
+	o->bits = 0;
+	o->nbits = 0;
+}
+
+/* Huffman codes */
+
+/* Compute code lengths (<= maxbits) for n symbols from freq[]. */
+static void
+build_lengths(const uint32_t *freq, int n, int maxbits, uint8_t *lens)
+{
+	uint32_t f[NLITLEN + 2];
+	int sym[NLITLEN + 2];
+	uint32_t w[2 * (NLITLEN + 2)];
+	int parent[2 * (NLITLEN + 2)];
+	uint8_t depth[2 * (NLITLEN + 2)];
+	int m = 0, i;
+
+	memset(lens, 0, (size_t)n);
+	for (i = 0; i < n; i++) {
+		if (freq[i]) {
+			sym[m] = i;
+			f[m] = freq[i];
+			m++;
+		}
+	}
+	if (m == 0)
+		return;
+	if (m == 1) {
+		lens[sym[0]] = 1;
+		return;
+	}
+
+	for (;;) {
+		int leaf = 0, node = m, nnodes = m, maxd = 0;
+
+		/* sort leaves by weight (insertion sort: m <= 288) */
+		for (i = 1; i < m; i++) {
+			uint32_t fw = f[i];
+			int s = sym[i], j = i - 1;
+			while (j >= 0 && f[j] > fw) {
+				f[j + 1] = f[j];
+				sym[j + 1] = sym[j];
+				j--;
+			}
+			f[j + 1] = fw;
+			sym[j + 1] = s;
+		}
+		for (i = 0; i < m; i++)
+			w[i] = f[i];
+
+		/* two-queue merge: leaves in order, internal nodes in order */
+		while (nnodes < 2 * m - 1) {
+			int pick[2], k;
+			for (k = 0; k < 2; k++) {
+				if (leaf < m &&
+				    (node >= nnodes || w[leaf] <= w[node]))
+					pick[k] = leaf++;
+				else
+					pick[k] = node++;
+			}
+			w[nnodes] = w[pick[0]] + w[pick[1]];
+			parent[pick[0]] = nnodes;
+			parent[pick[1]] = nnodes;
+			nnodes++;
+		}
+		depth[nnodes - 1] = 0;
+		for (i = nnodes - 2; i >= 0; i--) {
+			depth[i] = (uint8_t)(depth[parent[i]] + 1);
+			if (i < m && depth[i] > maxd)
+				maxd = depth[i];
+		}
+		if (maxd <= maxbits) {
+			for (i = 0; i < m; i++)
+				lens[sym[i]] = depth[i];
+			return;
+		}
+		for (i = 0; i < m; i++)
+			f[i] = (f[i] + 1) >> 1;
+	}
+}
+
+/* Canonical codes, bit-reversed for LSB-first output. */
+static void
+build_codes(const uint8_t *lens, int n, uint16_t *codes)
+{
+	uint16_t count[16] = {0}, next[16];
+	uint16_t code = 0;
+	int i, b;
+
+	for (i = 0; i < n; i++)
+		count[lens[i]]++;
+	count[0] = 0;
+	for (b = 1; b < 16; b++) {
+		code = (uint16_t)((code + count[b - 1]) << 1);
+		next[b] = code;
+	}
+	for (i = 0; i < n; i++) {
+		uint16_t c, r = 0;
+		int l = lens[i];
+		if (!l)
+			continue;
+		c = next[l]++;
+		for (b = 0; b < l; b++)
+			r = (uint16_t)((r << 1) | ((c >> b) & 1));
+		codes[i] = r;
+	}
+}
+
+/* Block encoding */
+
+typedef struct {
+	uint16_t *ll;  /* literal byte, or match length */
+	uint16_t *dd;  /* 0 for literal, else match distance */
+	size_t n;
+	uint32_t lfreq[NLITLEN];
+	uint32_t dfreq[NDIST];
+} Syms;
+
+static void
+emit_symbols(Out *o, const Syms *s, const uint8_t *llen, const uint16_t *lcode,
+    const uint8_t *dlen, const uint16_t *dcode)
+{
+	size_t i;
+	for (i = 0; i < s->n; i++) {
+		unsigned d = s->dd[i];
+		if (!d) {
+			put_bits(o, lcode[s->ll[i]], llen[s->ll[i]]);
+		} else {
+			unsigned l = s->ll[i];
+			int lc = len_code(l), dc = dist_code(d);
+			put_bits(o, lcode[257 + lc], llen[257 + lc]);
+			if (len_extra[lc])
+				put_bits(o, l - len_base[lc], len_extra[lc]);
+			put_bits(o, dcode[dc], dlen[dc]);
+			if (dist_extra[dc])
+				put_bits(o, d - dist_base[dc], dist_extra[dc]);
+		}
+	}
+	put_bits(o, lcode[256], llen[256]);
+}
+
+static uint64_t
+symbol_bits(const Syms *s, const uint8_t *llen, const uint8_t *dlen)
+{
+	uint64_t bits = 0;
+	int i;
+	for (i = 0; i < NLITLEN; i++)
+		bits += (uint64_t)s->lfreq[i] * llen[i];
+	for (i = 0; i < NDIST; i++)
+		bits += (uint64_t)s->dfreq[i] * dlen[i];
+	for (i = 0; i < 29; i++)
+		bits += (uint64_t)s->lfreq[257 + i] * len_extra[i];
+	for (i = 0; i < NDIST; i++)
+		bits += (uint64_t)s->dfreq[i] * dist_extra[i];
+	return bits;
+}
+
+/* Run-length encode the code length sequence (codes 16/17/18). */
+static size_t
+rle_lengths(const uint8_t *lens, int n, uint8_t *rsym, uint8_t *rext)
+{
+	size_t k = 0;
+	int i = 0;
+	while (i < n) {
+		int l = lens[i], run = 1;
+		while (i + run < n && lens[i + run] == l)
+			run++;
+		i += run;
+		if (l == 0) {
+			while (run >= 11) {
+				int r = run > 138 ? 138 : run;
+				rsym[k] = 18;
+				rext[k++] = (uint8_t)(r - 11);
+				run -= r;
+			}
+			if (run >= 3) {
+				rsym[k] = 17;
+				rext[k++] = (uint8_t)(run - 3);
+				run = 0;
+			}
+		} else {
+			rsym[k] = (uint8_t)l;
+			rext[k++] = 0;
+			run--;
+			while (run >= 3) {
+				int r = run > 6 ? 6 : run;
+				rsym[k] = 16;
+				rext[k++] = (uint8_t)(r - 3);
+				run -= r;
+			}
+		}
+		while (run-- > 0) {
+			rsym[k] = (uint8_t)l;
+			rext[k++] = 0;
+		}
+	}
+	return k;
+}
+
+static void
+emit_stored(Out *o, const unsigned char *raw, size_t n, int final)
+{
+	do {
+		size_t chunk = n > 65535 ? 65535 : n;
+		unsigned char hdr[4];
+		put_bits(o, (final && chunk == n) ? 1 : 0, 1);
+		put_bits(o, 0, 2);
+		flush_bits(o);
+		hdr[0] = (unsigned char)chunk;
+		hdr[1] = (unsigned char)(chunk >> 8);
+		hdr[2] = (unsigned char)~chunk;
+		hdr[3] = (unsigned char)(~chunk >> 8);
+		out_bytes(o, hdr, 4);
+		out_bytes(o, raw, chunk);
+		raw += chunk;
+		n -= chunk;
+	} while (n);
+}
+
+static void
+flush_block(Out *o, Syms *s, const unsigned char *raw, size_t rawlen,
+    int final)
+{
+	uint8_t flen[NLITLEN + 2], fdlen[NDIST];
+	uint8_t llen[NLITLEN], dlen[NDIST], clen[NCLEN];
+	uint16_t lcode[NLITLEN + 2], dcode[NDIST], ccode[NCLEN];
+	uint8_t all[NLITLEN + NDIST], rsym[NLITLEN + NDIST],
+	    rext[NLITLEN + NDIST];
+	uint32_t cfreq[NCLEN] = {0};
+	uint64_t dyn_bits, fix_bits, sto_bits;
+	int hlit, hdist, hclen, i, nused;
+	size_t nr, k;
+
+	s->lfreq[256]++;
+
+	/* fixed code lengths */
+	for (i = 0; i < 144; i++)
+		flen[i] = 8;
+	for (; i < 256; i++)
+		flen[i] = 9;
+	for (; i < 280; i++)
+		flen[i] = 7;
+	for (; i < NLITLEN + 2; i++)
+		flen[i] = 8;
+	for (i = 0; i < NDIST; i++)
+		fdlen[i] = 5;
+
+	/* dynamic code lengths; keep at least two codes in each tree */
+	nused = 0;
+	for (i = 0; i < NDIST; i++)
+		nused += s->dfreq[i] != 0;
+	if (nused < 2) {
+		uint32_t df[NDIST];
+		memcpy(df, s->dfreq, sizeof(df));
+		if (!df[0])
+			df[0] = 1;
+		else
+			df[1] = 1;
+		build_lengths(df, NDIST, 15, dlen);
+	} else {
+		build_lengths(s->dfreq, NDIST, 15, dlen);
+	}
+	nused = 0;
+	for (i = 0; i < NLITLEN; i++)
+		nused += s->lfreq[i] != 0;
+	if (nused < 2) {
+		uint32_t lf[NLITLEN];
+		memcpy(lf, s->lfreq, sizeof(lf));
+		lf[0] = 1;
+		build_lengths(lf, NLITLEN, 15, llen);
+	} else {
+		build_lengths(s->lfreq, NLITLEN, 15, llen);
+	}
+
+	for (hlit = NLITLEN; hlit > 257 && !llen[hlit - 1]; hlit--)
+		;
+	for (hdist = NDIST; hdist > 1 && !dlen[hdist - 1]; hdist--)
+		;
+	memcpy(all, llen, (size_t)hlit);
+	memcpy(all + hlit, dlen, (size_t)hdist);
+	nr = rle_lengths(all, hlit + hdist, rsym, rext);
+	for (k = 0; k < nr; k++)
+		cfreq[rsym[k]]++;
+	build_lengths(cfreq, NCLEN, 7, clen);
+	for (hclen = NCLEN; hclen > 4 && !clen[clen_order[hclen - 1]]; hclen--)
+		;
+
+	dyn_bits = 3 + 5 + 5 + 4 + 3 * (uint64_t)hclen;
+	for (k = 0; k < nr; k++) {
+		dyn_bits += clen[rsym[k]];
+		dyn_bits += rsym[k] == 16 ? 2 : rsym[k] == 17 ? 3 :
+		    rsym[k] == 18                              ? 7 :
+								 0;
+	}
+	dyn_bits += symbol_bits(s, llen, dlen);
+	fix_bits = 3 + symbol_bits(s, flen, fdlen);
+	sto_bits = ((uint64_t)rawlen + 5 * (rawlen / 65535 + 1)) * 8 + 7;
+
+	if (raw && sto_bits <= fix_bits && sto_bits <= dyn_bits) {
+		emit_stored(o, raw, rawlen, final);
+	} else if (fix_bits <= dyn_bits) {
+		put_bits(o, final ? 1 : 0, 1);
+		put_bits(o, 1, 2);
+		build_codes(flen, NLITLEN + 2, lcode);
+		build_codes(fdlen, NDIST, dcode);
+		emit_symbols(o, s, flen, lcode, fdlen, dcode);
+	} else {
+		put_bits(o, final ? 1 : 0, 1);
+		put_bits(o, 2, 2);
+		put_bits(o, (uint32_t)(hlit - 257), 5);
+		put_bits(o, (uint32_t)(hdist - 1), 5);
+		put_bits(o, (uint32_t)(hclen - 4), 4);
+		for (i = 0; i < hclen; i++)
+			put_bits(o, clen[clen_order[i]], 3);
+		build_codes(clen, NCLEN, ccode);
+		for (k = 0; k < nr; k++) {
+			put_bits(o, ccode[rsym[k]], clen[rsym[k]]);
+			if (rsym[k] == 16)
+				put_bits(o, rext[k], 2);
+			else if (rsym[k] == 17)
+				put_bits(o, rext[k], 3);
+			else if (rsym[k] == 18)
+				put_bits(o, rext[k], 7);
+		}
+		build_codes(llen, NLITLEN, lcode);
+		build_codes(dlen, NDIST, dcode);
+		emit_symbols(o, s, llen, lcode, dlen, dcode);
+	}
+
+	s->n = 0;
+	memset(s->lfreq, 0, sizeof(s->lfreq));
+	memset(s->dfreq, 0, sizeof(s->dfreq));
+}
+
+/* LZ77 */
+
+static uint32_t
+hash3(const unsigned char *p)
+{
+	uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+	return (v * 2654435761u) >> (32 - HBITS);
+}
+
+static unsigned
+longest_match(const unsigned char *in, size_t len, size_t pos,
+    const int32_t *head, const int32_t *prev, int chain, unsigned nice,
+    unsigned *distp)
+{
+	unsigned best = MIN_MATCH - 1, maxlen;
+	int32_t cur = head[hash3(in + pos)];
+	size_t avail = len - pos;
+
+	maxlen = avail > MAX_MATCH ? MAX_MATCH : (unsigned)avail;
+	if (nice > maxlen)
+		nice = maxlen;
+	while (cur >= 0 && chain-- > 0) {
+		size_t dist = pos - (size_t)cur;
+		const unsigned char *a, *b;
+		unsigned l;
+		int32_t next;
+
+		if (dist >= WSIZE)
+			break;
+		a = in + cur;
+		b = in + pos;
+		if (a[best] == b[best] && a[0] == b[0] && a[1] == b[1]) {
+			l = 2;
+			while (l < maxlen && a[l] == b[l])
+				l++;
+			if (l > best) {
+				best = l;
+				*distp = (unsigned)dist;
+				if (l >= nice)
+					break;
+			}
+		}
+		next = prev[cur & WMASK];
+		if (next >= cur)
+			break;
+		cur = next;
+	}
+	return best;
+}
+
+static void
+insert_pos(const unsigned char *in, size_t pos, int32_t *head, int32_t *prev)
+{
+	uint32_t h = hash3(in + pos);
+	prev[pos & WMASK] = head[h];
+	head[h] = (int32_t)pos;
+}
+
+unsigned char *
+dfl_deflate(const void *src, size_t len, int level, size_t *outlen)
+{
+	const unsigned char *in = src;
+	Out o = {0};
+	Syms *s = NULL;
+	int32_t *head = NULL, *prev = NULL;
+	size_t pos = 0, bstart = 0;
+	int chain, lazy, i;
+	unsigned nice;
+
+	if (level < 1)
+		level = 1;
+	if (level > 9)
+		level = 9;
+	chain = level_cfg[level].chain;
+	lazy = level_cfg[level].lazy;
+	nice = level_cfg[level].nice;
+
+	s = calloc(1, sizeof(*s));
+	head = malloc(HSIZE * sizeof(*head));
+	prev = malloc(WSIZE * sizeof(*prev));
+	if (s) {
+		s->ll = malloc(BLOCK_SYMS * sizeof(*s->ll));
+		s->dd = malloc(BLOCK_SYMS * sizeof(*s->dd));
+	}
+	if (!s || !head || !prev || !s->ll || !s->dd)
+		goto oom;
+	for (i = 0; i < HSIZE; i++)
+		head[i] = -1;
+
+	while (pos < len) {
+		unsigned mlen = 0, mdist = 0;
+
+		if (len - pos >= MIN_MATCH) {
+			mlen = longest_match(in, len, pos, head, prev, chain,
+			    nice, &mdist);
+			if (mlen == MIN_MATCH && mdist > TOO_FAR)
+				mlen = 0;
+			insert_pos(in, pos, head, prev);
+			if (mlen >= MIN_MATCH && (int)mlen < lazy &&
+			    len - (pos + 1) >= MIN_MATCH) {
+				unsigned d2 = 0;
+				unsigned l2 = longest_match(in, len, pos + 1,
+				    head, prev, chain, nice, &d2);
+				if (l2 > mlen)
+					mlen = 0; /* take the later match */
+			}
+		}
+
+		if (mlen >= MIN_MATCH) {
+			s->ll[s->n] = (uint16_t)mlen;
+			s->dd[s->n] = (uint16_t)mdist;
+			s->n++;
+			s->lfreq[257 + len_code(mlen)]++;
+			s->dfreq[dist_code(mdist)]++;
+			for (size_t k = pos + 1;
+			     k < pos + mlen && len - k >= MIN_MATCH; k++)
+				insert_pos(in, k, head, prev);
+			pos += mlen;
+		} else {
+			s->ll[s->n] = in[pos];
+			s->dd[s->n] = 0;
+			s->n++;
+			s->lfreq[in[pos]]++;
+			pos++;
+		}
+
+		if (s->n == BLOCK_SYMS) {
+			flush_block(&o, s, in + bstart, pos - bstart,
+			    pos == len);
+			bstart = pos;
+			if (o.oom)
+				goto oom;
+		}
+	}
+	/* a full block ending exactly at len was already flushed as final */
+	if (s->n || len == 0)
+		flush_block(&o, s, len ? in + bstart : NULL, pos - bstart, 1);
+	flush_bits(&o);
+	if (o.oom)
+		goto oom;
+
+	free(s->ll);
+	free(s->dd);
+	free(s);
+	free(head);
+	free(prev);
+	*outlen = o.len;
+	return o.p;
+
+oom:
+	if (s) {
+		free(s->ll);
+		free(s->dd);
+	}
+	free(s);
+	free(head);
+	free(prev);
+	free(o.p);
+	return NULL;
+}
+
+unsigned char *
+dfl_gzip(const void *in, size_t len, int level, size_t *outlen)
+{
+	static const unsigned char hdr[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0,
+		3};
+	unsigned char *raw, *out;
+	size_t rawlen;
+	uint32_t crc = dfl_crc32(0, in, len), isize = (uint32_t)len;
+
+	raw = dfl_deflate(in, len, level, &rawlen);
+	if (!raw)
+		return NULL;
+	out = malloc(sizeof(hdr) + rawlen + 8);
+	if (!out) {
+		free(raw);
+		return NULL;
+	}
+	memcpy(out, hdr, sizeof(hdr));
+	memcpy(out + sizeof(hdr), raw, rawlen);
+	free(raw);
+	out[sizeof(hdr) + rawlen + 0] = (unsigned char)crc;
+	out[sizeof(hdr) + rawlen + 1] = (unsigned char)(crc >> 8);
+	out[sizeof(hdr) + rawlen + 2] = (unsigned char)(crc >> 16);
+	out[sizeof(hdr) + rawlen + 3] = (unsigned char)(crc >> 24);
+	out[sizeof(hdr) + rawlen + 4] = (unsigned char)isize;
+	out[sizeof(hdr) + rawlen + 5] = (unsigned char)(isize >> 8);
+	out[sizeof(hdr) + rawlen + 6] = (unsigned char)(isize >> 16);
+	out[sizeof(hdr) + rawlen + 7] = (unsigned char)(isize >> 24);
+	*outlen = sizeof(hdr) + rawlen + 8;
+	return out;
+}
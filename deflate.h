@@ -0,0 +1,35 @@
+/* Small in-memory DEFLATE (RFC 1951) / gzip (RFC 1952) encoder */
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DFL_LEVEL_FAST 1
+#define DFL_LEVEL_DEFAULT 6
+#define DFL_LEVEL_BEST 9
+
+/* Update a running CRC-32 (IEEE 802.3). Start with crc = 0. */
+uint32_t dfl_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* Compress len bytes at in into a raw DEFLATE stream. Returns a malloc()ed
+ * buffer and stores its size in *outlen, or returns NULL on allocation
+ * failure. level is clamped to 1..9. */
+unsigned char *dfl_deflate(const void *in, size_t len, int level,
+    size_t *outlen);
+
+/* Same as dfl_deflate() but wrapped in a gzip member (header, CRC-32 and
+ * size trailer), suitable for "Content-Encoding: gzip" and .gz files. */
+unsigned char *dfl_gzip(const void *in, size_t len, int level,
+    size_t *outlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DEFLATE_H */
@@ -1,90 +1,190 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <ctype.h>
 #include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <math.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <utime.h>
 
+#include "deflate.h"
 #include "vendor/md4c/md4c-html.h"
 #include "vendor/mongoose/mongoose.h"
 
 #define BODY_PH "{{Body}}"
+#define TITLE_PH "{{Title}}"
+#define PATH_PH "{{Path}}"
+#define DATE_PH "{{Date}}"
 #define SIDENOTE_S "[sidenote]"
 #define SIDENOTE_E "[/sidenote]"
 #define SIDENOTE_R_S "<div class=\"sidenote\">"
 #define SIDENOTE_R_E "</div>"
 #define CODE_CMD "$code "
+#define POSTS_CMD "$posts "
+#define FEED_DIR "posts" /* --feed lists the posts in here */
+#define FEED_NAME "rss.xml"
 #define SNIPPET_S "//snippet "
 #define SNIPPET_E "//endsnippet"
+#define GZ_EXT ".gz"
 
-/* Small arena (per-job) */
+/* Arena: a chain of blocks grown on demand. Build workers and render
+ * threads each keep one across jobs; arena_reset() keeps the blocks for the
+ * next job, trimmed to a decaying high-water mark. */
 
 #define ALIGN_UP(n, a) (((n) + ((a) - 1)) & ~((a) - 1))
 #define ARENA_ALIGN(n) ALIGN_UP((n), sizeof(void *))
+#define ARENA_BLOCK (64 * 1024) /* first block of a worker arena */
+#define ARENA_BLOCK_MAX (4 * 1024 * 1024) /* blocks stop doubling here */
+#define ARENA_KEEP_MAX (64 * 1024 * 1024) /* never kept past a reset */
 
-typedef struct {
-	uint8_t *base;
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
 	size_t cap;
-	size_t perm_p;
-	size_t temp_p;
+	size_t used;
+} ArenaBlock; /* cap bytes follow, pointer aligned */
+
+typedef struct ArenaMap {
+	struct ArenaMap *next; /* allocated in the arena itself */
+	void *p;
+	size_t len;
+} ArenaMap;
+
+typedef struct {
+	ArenaBlock *cur;   /* newest first */
+	ArenaBlock *spare; /* kept by arena_reset() */
+	ArenaMap *maps;    /* file mappings, unmapped by arena_reset() */
+	size_t bsize;      /* size of the next fresh block */
+	size_t hwm;        /* bytes the last jobs needed */
 } Arena;
 
+#define ARENA_DATA(b) ((uint8_t *)(b) + ARENA_ALIGN(sizeof(ArenaBlock)))
+
+/* bsize is the first block's size: a hint, not a limit */
 static void
-arena_init(Arena *a, size_t cap)
+arena_init(Arena *a, size_t bsize)
 {
-	a->base = malloc(cap);
-	if (!a->base) {
-		perror("malloc");
-		exit(1);
+	a->cur = NULL;
+	a->spare = NULL;
+	a->maps = NULL;
+	a->bsize = ARENA_ALIGN(bsize ? bsize : ARENA_BLOCK);
+	a->hwm = 0;
+}
+static ArenaBlock *
+arena_block(Arena *a, size_t n)
+{
+	ArenaBlock *b, **pp;
+	for (pp = &a->spare; (b = *pp); pp = &b->next) {
+		if (b->cap >= n) {
+			*pp = b->next;
+			break;
+		}
 	}
-	a->cap = cap;
-	a->perm_p = 0;
-	a->temp_p = cap;
+	if (!b) {
+		size_t cap = n > a->bsize ? n : a->bsize;
+		b = malloc(ARENA_ALIGN(sizeof(*b)) + cap);
+		if (!b)
+			return NULL;
+		b->cap = cap;
+		if (a->bsize < ARENA_BLOCK_MAX)
+			a->bsize *= 2;
+	}
+	b->used = 0;
+	b->next = a->cur;
+	a->cur = b;
+	return b;
 }
+/* Returns NULL only when malloc() fails. */
 static void *
-arena_alloc_perm(Arena *a, size_t n)
+arena_alloc(Arena *a, size_t n)
 {
 	n = ARENA_ALIGN(n);
-	if (n > a->temp_p - a->perm_p)
+	ArenaBlock *b = a->cur;
+	if ((!b || n > b->cap - b->used) && !(b = arena_block(a, n)))
 		return NULL;
-	void *p = a->base + a->perm_p;
-	a->perm_p += n;
+	void *p = ARENA_DATA(b) + b->used;
+	b->used += n;
 	return p;
 }
+/* Resize the allocation p of old bytes to n, in place when it is the
+ * newest one and its block has room. Like realloc(), p may be NULL. */
 static void *
-arena_alloc_temp(Arena *a, size_t n)
+arena_grow(Arena *a, void *p, size_t old, size_t n)
 {
+	ArenaBlock *b = a->cur;
+	old = ARENA_ALIGN(old);
 	n = ARENA_ALIGN(n);
-	if (n > a->temp_p - a->perm_p)
-		return NULL;
-	a->temp_p -= n;
-	return a->base + a->temp_p;
+	if (p && b && (uint8_t *)p + old == ARENA_DATA(b) + b->used &&
+	    n - old <= b->cap - b->used) {
+		b->used += n - old;
+		return p;
+	}
+	void *np = arena_alloc(a, n);
+	if (np && p)
+		memcpy(np, p, old < n ? old : n);
+	return np;
 }
+/* Forget every allocation. Blocks are kept for the next job up to what
+ * recent jobs needed, so one huge page does not pin its memory forever. */
 static void
-arena_reset_temp(Arena *a)
+arena_reset(Arena *a)
 {
-	a->temp_p = a->cap;
+	size_t peak = 0, keep = 0;
+	for (ArenaMap *m = a->maps; m; m = m->next)
+		munmap(m->p, m->len);
+	a->maps = NULL;
+	while (a->cur) {
+		ArenaBlock *b = a->cur;
+		a->cur = b->next;
+		peak += b->cap;
+		b->next = a->spare;
+		a->spare = b;
+	}
+	a->hwm = peak > a->hwm ? peak : a->hwm - a->hwm / 8;
+	for (ArenaBlock *b = a->spare; b; b = b->next)
+		keep += b->cap;
+	while (keep > a->hwm || keep > ARENA_KEEP_MAX) {
+		/* drop the largest block first */
+		ArenaBlock **big = &a->spare;
+		for (ArenaBlock **pp = &a->spare; *pp; pp = &(*pp)->next)
+			if ((*pp)->cap > (*big)->cap)
+				big = pp;
+		ArenaBlock *b = *big;
+		*big = b->next;
+		keep -= b->cap;
+		free(b);
+	}
 }
 static void
 arena_destroy(Arena *a)
 {
-	free(a->base);
+	arena_reset(a);
+	while (a->spare) {
+		ArenaBlock *b = a->spare;
+		a->spare = b->next;
+		free(b);
+	}
 }
 
-/* Growable buffer */
+/* Growable buffer. With a set, storage comes from that arena and is never
+ * passed to free(). */
 
 typedef struct {
 	char *p;
 	size_t len;
 	size_t cap;
+	Arena *a;
 } Buf;
 
 static int
@@ -96,7 +196,8 @@ buf_grow(Buf *b, size_t add)
 	size_t ncap = b->cap ? b->cap : 4096;
 	while (ncap < need)
 		ncap *= 2;
-	char *np = realloc(b->p, ncap);
+	char *np =
+	    b->a ? arena_grow(b->a, b->p, b->cap, ncap) : realloc(b->p, ncap);
 	if (!np)
 		return -1;
 	b->p = np;
@@ -119,6 +220,118 @@ buf_puts(Buf *b, const char *s)
 	return buf_putn(b, s, strlen(s));
 }
 
+/* Hashing (FNV-1a) */
+
+#define HASH_INIT 1469598103934665603ULL
+
+static uint64_t
+hash_update(uint64_t h, const void *p, size_t n)
+{
+	const uint8_t *s = p;
+	while (n--) {
+		h ^= *s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+static uint64_t
+hash_mem(const void *p, size_t n)
+{
+	return hash_update(HASH_INIT, p, n);
+}
+static uint64_t
+hash_str(const char *s)
+{
+	return hash_mem(s, strlen(s));
+}
+
+/* Input dependencies of a rendered page (page, layout, $code files) */
+
+typedef struct {
+	char *path;
+	off_t size; /* -1 if the file did not exist */
+	time_t mtime;
+	uint64_t hash; /* of the contents, 0 if not known */
+} Dep;
+
+typedef struct {
+	Dep *v;
+	size_t n;
+	size_t cap;
+} Deps;
+
+static void
+dep_stat(const char *path, off_t *size, time_t *mtime)
+{
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		*size = st.st_size;
+		*mtime = st.st_mtime;
+	} else {
+		*size = -1;
+		*mtime = 0;
+	}
+}
+/* record path with metadata the caller already has */
+static int
+deps_add_stat(Deps *d, const char *path, off_t size, time_t mtime,
+    uint64_t hash)
+{
+	if (!d)
+		return 0;
+	for (size_t i = 0; i < d->n; i++)
+		if (strcmp(d->v[i].path, path) == 0)
+			return 0;
+	if (d->n == d->cap) {
+		size_t ncap = d->cap ? d->cap * 2 : 4;
+		Dep *nv = realloc(d->v, ncap * sizeof(*nv));
+		if (!nv)
+			return -1;
+		d->v = nv;
+		d->cap = ncap;
+	}
+	Dep *e = &d->v[d->n];
+	e->path = strdup(path);
+	if (!e->path)
+		return -1;
+	e->size = size;
+	e->mtime = mtime;
+	e->hash = hash;
+	d->n++;
+	return 0;
+}
+static int
+deps_add(Deps *d, const char *path)
+{
+	if (!d)
+		return 0;
+	off_t size;
+	time_t mtime;
+	dep_stat(path, &size, &mtime);
+	return deps_add_stat(d, path, size, mtime, 0);
+}
+/* nonzero if any recorded input changed, appeared or disappeared */
+static int
+deps_changed(const Deps *d)
+{
+	for (size_t i = 0; i < d->n; i++) {
+		off_t size;
+		time_t mtime;
+		dep_stat(d->v[i].path, &size, &mtime);
+		if (size != d->v[i].size || mtime != d->v[i].mtime)
+			return 1;
+	}
+	return 0;
+}
+static void
+deps_free(Deps *d)
+{
+	for (size_t i = 0; i < d->n; i++)
+		free(d->v[i].path);
+	free(d->v);
+	memset(d, 0, sizeof(*d));
+}
+
 /* Path helpers */
 
 static int
@@ -187,35 +400,86 @@ mkdir_p(const char *path, mode_t mode)
 
 /* File I/O */
 
+/* Inputs at least this big are mapped instead of copied (bench/readpath) */
+#define MMAP_MIN (1024 * 1024)
+
+/* Set for one-shot builds only. A file truncated while mapped raises SIGBUS
+ * on the next read of the lost pages; serve and watch mode run while
+ * editors and generators rewrite sources in place, and keep $code files in
+ * the include cache for good, so there inputs are always copied. */
+static int map_inputs;
+
+/* Map the n bytes of fd followed by a NUL, as the copy path would give. The
+ * file goes over an anonymous reservation one byte longer, so the NUL is
+ * there even when n is a multiple of the page size. The mapping is private
+ * and writable like a copy, but a file truncated while mapped still raises
+ * SIGBUS, hence mapping only large inputs. Unmap n + 1 bytes. */
 static char *
-read_file(Arena *a, const char *path, int temp)
+map_file(int fd, size_t n)
 {
-	struct stat st;
-	int fd = open(path, O_RDONLY);
-	if (fd == -1)
+	char *p = mmap(NULL, n + 1, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
 		return NULL;
-	if (fstat(fd, &st) == -1 || st.st_size < 0) {
-		close(fd);
+	if (mmap(p, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+		0) == MAP_FAILED) {
+		munmap(p, n + 1);
 		return NULL;
 	}
-	size_t n = (size_t)st.st_size;
-	char *buf =
-	    temp ? arena_alloc_temp(a, n + 1) : arena_alloc_perm(a, n + 1);
-	if (!buf) {
-		close(fd);
+	(void)madvise(p, n, MADV_SEQUENTIAL);
+	return p;
+}
+/* map_file() for the lifetime of a's current job */
+static char *
+arena_map(Arena *a, int fd, size_t n)
+{
+	ArenaMap *m = arena_alloc(a, sizeof(*m));
+	char *p = m ? map_file(fd, n) : NULL;
+	if (!p)
+		return NULL;
+	*m = (ArenaMap){.next = a->maps, .p = p, .len = n + 1};
+	a->maps = m;
+	return p;
+}
+/* read n bytes of fd into a, NUL-terminated */
+static char *
+arena_read(Arena *a, int fd, size_t n)
+{
+	char *buf = arena_alloc(a, n + 1);
+	if (!buf)
 		return NULL;
-	}
 	size_t off = 0;
 	while (off < n) {
 		ssize_t r = read(fd, buf + off, n - off);
-		if (r <= 0) {
-			close(fd);
+		if (r <= 0)
 			return NULL;
-		}
 		off += (size_t)r;
 	}
 	buf[n] = '\0';
+	return buf;
+}
+
+/* lenp (optional) receives the number of bytes read */
+static char *
+read_file(Arena *a, const char *path, size_t *lenp)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || st.st_size < 0) {
+		close(fd);
+		return NULL;
+	}
+	size_t n = (size_t)st.st_size;
+	char *buf = NULL;
+	if (map_inputs && n >= MMAP_MIN)
+		buf = arena_map(a, fd, n);
+	if (!buf)
+		buf = arena_read(a, fd, n);
 	close(fd);
+	if (buf && lenp)
+		*lenp = n;
 	return buf;
 }
 
@@ -236,6 +500,40 @@ write_all(int fd, const void *buf, size_t n)
 	return 0;
 }
 
+/* Give path the n bytes at p through a temporary file and rename(), unless
+ * it holds them already; then it keeps its mtime. 1 if written, 0 if it was
+ * current, -1 on error. */
+static int
+write_replace(const char *path, const void *p, size_t n)
+{
+	Arena a;
+	arena_init(&a, 4096);
+	size_t oldn;
+	const char *old = read_file(&a, path, &oldn);
+	int same = old && oldn == n && memcmp(old, p, n) == 0;
+	arena_destroy(&a);
+	if (same)
+		return 0;
+
+	char tmp[4096];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int rc = -1;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1) {
+		rc = write_all(fd, p, n);
+		if (close(fd) != 0)
+			rc = -1;
+		if (rc == 0 && rename(tmp, path) != 0)
+			rc = -1;
+		if (rc != 0)
+			(void)unlink(tmp);
+	}
+	return rc == 0 ? 1 : -1;
+}
+
 static int
 copy_times(const char *dst, const struct stat *st)
 {
@@ -255,21 +553,70 @@ preserve_mode_mtime(const char *dst, const struct stat *st)
 	return 0;
 }
 
+#ifdef __linux__
+#include <linux/fs.h> /* FICLONE */
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+/* Assets are copied the cheapest way the kernel offers: a reflink shares
+ * the blocks outright, copy_file_range() and sendfile() copy without a trip
+ * through userspace, and read()/write() works everywhere. Each way carries
+ * on from the file offsets the one before it left. */
+typedef enum {
+	CP_CLONE,
+	CP_RANGE,
+	CP_SENDFILE,
+	CP_RW,
+	CP_URING, /* small files, batched by a worker's ring */
+	CP_N
+} CopyHow;
+
+static const char *const copy_how_names[CP_N] = {
+	"reflink", "copy_file_range", "sendfile", "read/write", "io_uring"};
+
+#ifdef __linux__
+/* Returns 1 once in is copied to its end, 0 if how cannot do it here, -1
+ * if the files cannot be rewound after a partial copy. Only all n bytes
+ * count: procfs-like files claim a size of 0, some FUSE and network mounts
+ * return 0 at once, and a file that shrank is read again by the next way. */
 static int
-needs_rebuild_from_mtime(const char *src, const char *dst)
+copy_kernel(int in, int out, size_t n, CopyHow how)
 {
-	struct stat src_st, dst_st;
-	if (stat(src, &src_st) != 0)
-		return 1;
-	if (stat(dst, &dst_st) != 0)
-		return 1;
-	if (!S_ISREG(dst_st.st_mode))
+#ifdef FICLONE
+	if (how == CP_CLONE)
+		return ioctl(out, FICLONE, in) == 0;
+#else
+	if (how == CP_CLONE)
+		return 0;
+#endif
+	if (n == 0)
+		return 0; /* nothing to tell an empty file from a short read */
+	size_t off = 0;
+	while (off < n) {
+		ssize_t r = how == CP_RANGE
+		    ? syscall(SYS_copy_file_range, in, NULL, out, NULL,
+			  n - off, 0)
+		    : sendfile(out, in, NULL, n - off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		off += (size_t)r;
+	}
+	if (off == n)
 		return 1;
-	return dst_st.st_mtime < src_st.st_mtime;
+	if (off > 0 && (lseek(in, 0, SEEK_SET) == -1 ||
+			   lseek(out, 0, SEEK_SET) == -1 || ftruncate(out, 0) == -1))
+		return -1;
+	return 0;
 }
+#endif
 
+/* how receives the way that finished the copy */
 static int
-copy_file(const char *src, const char *dst)
+copy_file(const char *src, const char *dst, CopyHow *how)
 {
 	struct stat st;
 	int in = open(src, O_RDONLY);
@@ -286,783 +633,6905 @@ copy_file(const char *src, const char *dst)
 		return -1;
 	}
 
+	*how = CP_RW;
+#ifdef __linux__
+	for (CopyHow h = CP_CLONE; h < CP_RW; h++) {
+		int k = copy_kernel(in, out, (size_t)st.st_size, h);
+		if (k < 0) {
+			close(in);
+			close(out);
+			return -1;
+		}
+		if (k) {
+			*how = h;
+			break;
+		}
+	}
+#endif
 	uint8_t buf[8192];
-	for (;;) {
+	while (*how == CP_RW) {
 		ssize_t r = read(in, buf, sizeof(buf));
 		if (r == 0)
 			break;
-		if (r < 0) {
-			if (errno == EINTR)
-				continue;
-			break;
-		}
-		if (write_all(out, buf, (size_t)r) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 || write_all(out, buf, (size_t)r) != 0) {
 			close(in);
 			close(out);
 			return -1;
 		}
 	}
 	close(in);
-	close(out);
+	if (close(out) != 0)
+		return -1;
 	if (preserve_mode_mtime(dst, &st) == -1)
 		return -1;
 	return 0;
 }
 
-/* Markdown + preprocessing */
+/* io_uring (Linux, build mode, --io-uring). A worker with a ring gathers
+ * small jobs and takes a whole batch through each step together: open and
+ * statx every source, then read them all while the outputs of copies are
+ * opened, then write and close. Each step is one io_uring_enter(), so a few
+ * threads keep many files in flight on a cold cache. Anything a step fails
+ * for is left to the blocking path, which reports the error. */
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_IO_URING 1
+#  include <linux/io_uring.h>
+#  include <linux/stat.h> /* struct statx */
+# endif
+#endif
+
+#define URING_BATCH 32                /* jobs taken through a ring at once */
+#define URING_DEPTH (2 * URING_BATCH) /* two operations per job a step */
+
+#ifdef HAVE_IO_URING
+typedef struct {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned nsq; /* queued for the next ring_run() */
+} Ring;
 
 static void
-md_cb(const MD_CHAR *text, MD_SIZE size, void *userdata)
+ring_free(Ring *r)
 {
-	Buf *b = userdata;
-	(void)buf_putn(b, text, (size_t)size);
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map)
+		munmap(r->cq_map, r->cq_len);
+	if (r->sq_map)
+		munmap(r->sq_map, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
 }
 
-/* strip local href ending with .md (".md\"" -> "\"") */
-static void
-postprocess_links_strip_md(char *html)
+static void *
+ring_map(int fd, size_t len, off_t off)
 {
-	const char *needle = ".md\"";
-	char *p = html;
-	while ((p = strstr(p, needle))) {
-		memmove(p, p + 3, strlen(p + 3) + 1);
-	}
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+	return p == MAP_FAILED ? NULL : p;
 }
 
-/* locate snippet content inside file; returns pointer into file with temporary
- * NUL insertion */
-static char *
-extract_snippet(char *file, const char *name)
+/* -1 if the kernel has no io_uring or will not give us one */
+static int
+ring_init(Ring *r)
 {
-	if (!name || !*name)
-		return NULL;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	r->fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if (r->fd < 0) {
+		r->fd = -1;
+		return -1;
+	}
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(*r->cqes);
+	r->sqes_len = p.sq_entries * sizeof(*r->sqes);
+	r->sq_map = ring_map(r->fd, r->sq_len, IORING_OFF_SQ_RING);
+	r->cq_map = ring_map(r->fd, r->cq_len, IORING_OFF_CQ_RING);
+	r->sqes = ring_map(r->fd, r->sqes_len, IORING_OFF_SQES);
+	if (!r->sq_map || !r->cq_map || !r->sqes) {
+		ring_free(r);
+		return -1;
+	}
+	uint8_t *sq = r->sq_map, *cq = r->cq_map;
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
 
-	char pat[512];
-	snprintf(pat, sizeof(pat), "%s%s", SNIPPET_S, name);
+/* Queue op; its result lands in res[slot] at the next ring_run(). At most
+ * URING_DEPTH operations are queued at once. */
+static struct io_uring_sqe *
+ring_op(Ring *r, uint8_t op, int fd, unsigned slot)
+{
+	unsigned tail = *r->sq_tail + r->nsq++;
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe *e = &r->sqes[i];
+	memset(e, 0, sizeof(*e));
+	e->opcode = op;
+	e->fd = fd;
+	e->user_data = slot;
+	r->sq_array[i] = i;
+	return e;
+}
 
-	char *p = file;
-	for (;;) {
-		char *s = strstr(p, SNIPPET_S);
-		if (!s)
-			return NULL;
-		/* ensure it matches this snippet name at line start-ish */
-		if ((s == file || s[-1] == '\n') &&
-		    strncmp(s, pat, strlen(pat)) == 0) {
-			char *start = strchr(s, '\n');
-			if (!start)
-				return NULL;
-			start++;
-			char *end = strstr(start, SNIPPET_E);
-			if (!end)
-				return NULL;
-			/* end marker should be at line start */
-			char *ls = end;
-			while (ls > start && ls[-1] != '\n')
-				ls--;
-			if (ls != end) {
-				p = end + 1;
+/* Submit what is queued and wait for all of it. Slots of operations that
+ * never completed keep the value the caller put there. */
+static int
+ring_run(Ring *r, int *res)
+{
+	unsigned want = r->nsq, got = 0, left = r->nsq;
+	__atomic_store_n(r->sq_tail, *r->sq_tail + r->nsq, __ATOMIC_RELEASE);
+	r->nsq = 0;
+	while (got < want) {
+		long n = syscall(__NR_io_uring_enter, r->fd, left, want - got,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
 				continue;
-			}
-			*end = '\0';
-			return start;
+			return -1;
+		}
+		left -= (unsigned)n < left ? (unsigned)n : left;
+		unsigned head = *r->cq_head;
+		unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++, got++) {
+			struct io_uring_cqe *c = &r->cqes[head & *r->cq_mask];
+			res[c->user_data] = c->res;
 		}
-		p = s + 1;
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
 	}
+	return 0;
 }
 
-/* append entire file but skip snippet marker lines */
 static void
-append_file_stripping_markers(Buf *out, const char *file)
+ring_open(Ring *r, const char *path, int flags, unsigned slot)
 {
-	const char *p = file;
-	while (*p) {
-		const char *line = p;
-		const char *nl = strchr(p, '\n');
-		size_t n = nl ? (size_t)(nl - line) : strlen(line);
-
-		/* check line prefix */
-		if (!(n >= strlen(SNIPPET_S) &&
-			memcmp(line, SNIPPET_S, strlen(SNIPPET_S)) == 0) &&
-		    !(n >= strlen(SNIPPET_E) &&
-			memcmp(line, SNIPPET_E, strlen(SNIPPET_E)) == 0)) {
-			buf_putn(out, line, n);
-			if (nl)
-				buf_putn(out, "\n", 1);
-		} else {
-			if (nl)
-				buf_putn(out, "\n", 1);
-		}
-		if (!nl)
-			break;
-		p = nl + 1;
-	}
+	struct io_uring_sqe *e = ring_op(r, IORING_OP_OPENAT, AT_FDCWD, slot);
+	e->addr = (uintptr_t)path;
+	e->open_flags = (uint32_t)flags;
+	e->len = 0644;
 }
-
-/* trim spaces/tabs and optional \r at end, for line token checks */
 static void
-line_trim(const char *s, size_t n, const char **out_s, size_t *out_n)
+ring_statx(Ring *r, const char *path, struct statx *x, unsigned slot)
 {
-	while (n && (*s == ' ' || *s == '\t')) {
-		s++;
-		n--;
-	}
-	while (n && (s[n - 1] == ' ' || s[n - 1] == '\t' || s[n - 1] == '\r'))
-		n--;
-	*out_s = s;
-	*out_n = n;
+	struct io_uring_sqe *e = ring_op(r, IORING_OP_STATX, AT_FDCWD, slot);
+	e->addr = (uintptr_t)path;
+	e->len = STATX_BASIC_STATS;
+	e->off = (uintptr_t)x;
+}
+/* IORING_OP_READ or IORING_OP_WRITE of n bytes at offset 0 */
+static void
+ring_rw(Ring *r, uint8_t op, int fd, void *buf, size_t n, unsigned slot)
+{
+	struct io_uring_sqe *e = ring_op(r, op, fd, slot);
+	e->addr = (uintptr_t)buf;
+	e->len = (uint32_t)n;
+}
+static void
+ring_close(Ring *r, int fd, unsigned slot)
+{
+	(void)ring_op(r, IORING_OP_CLOSE, fd, slot);
 }
 
-/* parse $code line: "$code <path> [snippet]" (snippet optional; supports [name]
- * or bare token) */
 static void
-handle_code_line(Arena *a, const char *s, size_t n, Buf *out)
+stat_from_statx(struct stat *st, const struct statx *x)
 {
-	/* s/n already trimmed to line content (no leading ws) */
-	const char *p = s + (sizeof(CODE_CMD) - 1);
-	while ((size_t)(p - s) < n && (*p == ' ' || *p == '\t'))
-		p++;
+	memset(st, 0, sizeof(*st));
+	st->st_mode = x->stx_mode;
+	st->st_size = (off_t)x->stx_size;
+	st->st_atime = x->stx_atime.tv_sec;
+	st->st_mtime = x->stx_mtime.tv_sec;
+}
+#else
+typedef struct {
+	int fd;
+} Ring;
 
-	/* path token */
-	const char *path_s = p;
-	while ((size_t)(p - s) < n && *p != ' ' && *p != '\t')
-		p++;
-	size_t path_n = (size_t)(p - path_s);
-	if (path_n == 0)
-		return;
+static int
+ring_init(Ring *r)
+{
+	r->fd = -1;
+	return -1;
+}
+static void
+ring_free(Ring *r)
+{
+	(void)r;
+}
+#endif
 
-	char path[2048];
-	if (path_n >= sizeof(path))
-		path_n = sizeof(path) - 1;
-	memcpy(path, path_s, path_n);
-	path[path_n] = '\0';
+/* Precompressed .gz siblings (build mode) */
 
-	/* optional snippet token */
-	while ((size_t)(p - s) < n && (*p == ' ' || *p == '\t'))
-		p++;
-	char snip[256];
-	snip[0] = '\0';
-	if ((size_t)(p - s) < n) {
-		const char *sn_s = p;
-		size_t sn_n = n - (size_t)(p - s);
-		/* allow [name] */
-		if (sn_n >= 2 && sn_s[0] == '[') {
-			const char *rb = memchr(sn_s, ']', sn_n);
-			if (rb) {
-				sn_s++;
-				sn_n = (size_t)(rb - sn_s);
-			}
-		} else {
-			/* bare token: stop at whitespace */
-			const char *q = sn_s;
-			while ((size_t)(q - s) < n && *q != ' ' && *q != '\t')
-				q++;
-			sn_n = (size_t)(q - sn_s);
-		}
-		if (sn_n >= sizeof(snip))
-			sn_n = sizeof(snip) - 1;
-		memcpy(snip, sn_s, sn_n);
-		snip[sn_n] = '\0';
-	}
+static int
+is_text_output(const char *path)
+{
+	static const char *exts[] = {".html", ".css", ".xml", ".js", ".svg",
+		".json", ".txt", NULL};
+	for (int i = 0; exts[i]; i++)
+		if (has_ext(path, exts[i]))
+			return 1;
+	return 0;
+}
 
-	char *file = read_file(a, path, 1);
-	if (!file) {
-		buf_puts(out, "`[Code file not found: ");
-		buf_puts(out, path);
-		buf_puts(out, "]`");
-		return;
+static int
+needs_gz_sibling(const char *dst)
+{
+	struct stat dst_st, gz_st;
+	char gz[4096];
+	if (snprintf(gz, sizeof(gz), "%s" GZ_EXT, dst) >= (int)sizeof(gz))
+		return 0;
+	if (stat(dst, &dst_st) != 0)
+		return 0;
+	if (stat(gz, &gz_st) != 0 || !S_ISREG(gz_st.st_mode))
+		return 1;
+	return gz_st.st_mtime != dst_st.st_mtime;
+}
+
+/* write dst.gz from dst; it carries dst's mode and mtime so it can be
+ * checked for staleness the same way as any other output */
+static int
+write_gz_sibling(Arena *a, const char *dst)
+{
+	struct stat st;
+	char gz[4096];
+	if (snprintf(gz, sizeof(gz), "%s" GZ_EXT, dst) >= (int)sizeof(gz)) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
+	if (stat(dst, &st) != 0)
+		return -1;
 
-	buf_puts(out, "\n```\n");
-	if (snip[0]) {
-		char *snippet = extract_snippet(file, snip);
-		if (snippet)
-			buf_puts(out, snippet);
-		else
-			buf_puts(out, "SNIPPET NOT FOUND\n");
-	} else {
-		append_file_stripping_markers(out, file);
+	size_t n;
+	char *data = read_file(a, dst, &n);
+	if (!data)
+		return -1;
+	size_t zlen;
+	unsigned char *z = dfl_gzip(data, n, DFL_LEVEL_BEST, &zlen);
+	if (!z) {
+		errno = ENOMEM;
+		return -1;
 	}
-	buf_puts(out, "\n```\n");
-	arena_reset_temp(a);
+
+	int rc = -1;
+	int fd = open(gz, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1) {
+		rc = write_all(fd, z, zlen);
+		close(fd);
+	}
+	free(z);
+	if (rc == 0)
+		rc = preserve_mode_mtime(gz, &st);
+	return rc;
 }
 
-static char *
-preprocess(Arena *a, const char *src)
-{
-	Buf out = {0};
-	const char *p = src;
+/* Stats (--stats): time per stage, latency histograms, bytes and the
+ * slowest files of a build, and in serve mode the same plus request
+ * latencies. Every thread adds to its own block, with plain relaxed
+ * stores, so counting takes no lock and shares no cache line; readers sum
+ * the blocks. Link rewriting happens inside md4c, so it counts as render. */
 
-	while (*p) {
-		const char *line = p;
-		const char *nl = strchr(p, '\n');
-		size_t ln = nl ? (size_t)(nl - line) : strlen(line);
+typedef enum {
+	ST_WALK, /* reading directories and checking outputs */
+	ST_READ,
+	ST_PREPROCESS,
+	ST_RENDER, /* md4c, links and layout, writes excepted */
+	ST_WRITE,
+	ST_COPY,
+	ST_RING, /* io_uring batches */
+	ST_GZIP,
+	ST_N
+} Stage;
 
-		const char *ts;
-		size_t tn;
-		line_trim(line, ln, &ts, &tn);
+static const char *const stage_names[ST_N] = {"walk", "read", "preprocess",
+	"render", "write", "copy", "io_uring", "gzip"};
 
-		/* sidenote markers must occupy their own paragraph/line */
-		if (tn == strlen(SIDENOTE_S) &&
-		    memcmp(ts, SIDENOTE_S, tn) == 0) {
-			buf_puts(&out, SIDENOTE_R_S);
-			buf_putn(&out, "\n", 1);
-		} else if (tn == strlen(SIDENOTE_E) &&
-			   memcmp(ts, SIDENOTE_E, tn) == 0) {
-			buf_puts(&out, SIDENOTE_R_E);
-			buf_putn(&out, "\n", 1);
-		} else if (tn >= strlen(CODE_CMD) &&
-			   memcmp(ts, CODE_CMD, strlen(CODE_CMD)) == 0) {
-			handle_code_line(a, ts, tn, &out);
-			buf_putn(&out, "\n", 1);
-		} else {
-			buf_putn(&out, line, ln);
-			if (nl)
-				buf_putn(&out, "\n", 1);
-		}
+/* Served requests, by how they were answered */
+typedef enum {
+	RQ_RENDER,
+	RQ_CACHED,
+	RQ_STATIC,
+	RQ_ASSET, /* static, from the asset cache */
+	RQ_304,
+	RQ_N
+} ReqKind;
 
-		if (!nl)
-			break;
-		p = nl + 1;
-	}
-	/* Empty input still needs a valid C string for md_html/strlen. */
-	if (!out.p) {
-		out.p = strdup("");
+static const char *const req_names[RQ_N] = {"render", "cached", "static",
+	"static_cached", "not_modified"};
+
+#define HIST_N 24      /* bucket i: under 2^i us; the last is unbounded */
+#define STATS_SLOW 10  /* slowest files kept per thread */
+
+typedef struct {
+	uint64_t n, ns;
+	uint64_t hist[HIST_N];
+} Hist;
+
+typedef struct {
+	uint64_t ns;
+	char *path;
+} SlowFile;
+
+typedef struct Stats {
+	Hist stage[ST_N];
+	Hist req[RQ_N];
+	uint64_t bytes_in, bytes_out;
+	uint64_t skipped; /* outputs already up to date */
+	SlowFile slow[STATS_SLOW]; /* owner thread only */
+	struct Stats *next;
+} Stats;
+
+static int stats_on;
+static Stats *stats_all; /* every thread's block, never freed */
+static pthread_mutex_t stats_mu = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local Stats *stats_self;
+
+static uint64_t
+stats_now(void)
+{
+	if (!stats_on)
+		return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* this thread's block, NULL if stats are off */
+static Stats *
+stats_me(void)
+{
+	if (!stats_on)
+		return NULL;
+	if (!stats_self) {
+		Stats *s = calloc(1, sizeof(*s));
+		if (!s)
+			return NULL;
+		pthread_mutex_lock(&stats_mu);
+		s->next = stats_all;
+		stats_all = s;
+		pthread_mutex_unlock(&stats_mu);
+		stats_self = s;
 	}
-	return out.p; /* caller frees */
+	return stats_self;
 }
 
-static int
-write_output_wrapped(const char *dst, const char *html, const char *layout)
+/* only the owner writes, so a relaxed load and store is enough */
+static void
+ctr_add(uint64_t *p, uint64_t v)
 {
-	int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd == -1)
-		return -1;
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+	    __ATOMIC_RELAXED);
+}
+static uint64_t
+ctr_get(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
 
-	if (layout) {
-		const char *ip = strstr(layout, BODY_PH);
-		if (ip) {
-			if (write_all(fd, layout, (size_t)(ip - layout)) != 0)
-				goto fail;
-			if (write_all(fd, html, strlen(html)) != 0)
-				goto fail;
-			const char *tail = ip + (sizeof(BODY_PH) - 1);
-			if (write_all(fd, tail, strlen(tail)) != 0)
-				goto fail;
-			close(fd);
-			return 0;
+static void
+hist_add(Hist *h, uint64_t ns)
+{
+	unsigned b = 0;
+	for (uint64_t us = ns / 1000; us && b < HIST_N - 1; us >>= 1)
+		b++;
+	ctr_add(&h->n, 1);
+	ctr_add(&h->ns, ns);
+	ctr_add(&h->hist[b], 1);
+}
+
+static void
+stats_stage_ns(Stage st, uint64_t ns)
+{
+	Stats *s = stats_me();
+	if (s)
+		hist_add(&s->stage[st], ns);
+}
+/* stage st took the time since t0 (from stats_now()) */
+static void
+stats_stage(Stage st, uint64_t t0)
+{
+	if (stats_on)
+		stats_stage_ns(st, stats_now() - t0);
+}
+/* this thread's total in st so far, to take a nested stage out */
+static uint64_t
+stats_stage_total(Stage st)
+{
+	Stats *s = stats_me();
+	return s ? s->stage[st].ns : 0;
+}
+static void
+stats_req(ReqKind k, uint64_t t0)
+{
+	Stats *s = stats_me();
+	if (s)
+		hist_add(&s->req[k], stats_now() - t0);
+}
+static void
+stats_bytes(uint64_t in, uint64_t out)
+{
+	Stats *s = stats_me();
+	if (s) {
+		ctr_add(&s->bytes_in, in);
+		ctr_add(&s->bytes_out, out);
+	}
+}
+static void
+stats_skipped(void)
+{
+	Stats *s = stats_me();
+	if (s)
+		ctr_add(&s->skipped, 1);
+}
+/* path took ns in all; kept if among this thread's slowest */
+static void
+stats_file(const char *path, uint64_t ns)
+{
+	Stats *s = stats_me();
+	if (!s)
+		return;
+	SlowFile *min = &s->slow[0];
+	for (int i = 1; i < STATS_SLOW; i++)
+		if (s->slow[i].ns < min->ns)
+			min = &s->slow[i];
+	if (ns <= min->ns)
+		return;
+	char *p = strdup(path);
+	if (!p)
+		return;
+	free(min->path);
+	min->path = p;
+	min->ns = ns;
+}
+
+/* sum of every thread's block; slow is not summed */
+static void
+stats_sum(Stats *t)
+{
+	memset(t, 0, sizeof(*t));
+	pthread_mutex_lock(&stats_mu);
+	for (const Stats *s = stats_all; s; s = s->next) {
+		for (int i = 0; i < ST_N + RQ_N; i++) {
+			const Hist *h = i < ST_N ? &s->stage[i] : &s->req[i - ST_N];
+			Hist *th = i < ST_N ? &t->stage[i] : &t->req[i - ST_N];
+			th->n += ctr_get(&h->n);
+			th->ns += ctr_get(&h->ns);
+			for (int b = 0; b < HIST_N; b++)
+				th->hist[b] += ctr_get(&h->hist[b]);
 		}
-		/* If layout exists but no placeholder, just emit layout then
-		 * html */
-		if (write_all(fd, layout, strlen(layout)) != 0)
-			goto fail;
-		if (write_all(fd, html, strlen(html)) != 0)
-			goto fail;
-		close(fd);
-		return 0;
+		t->bytes_in += ctr_get(&s->bytes_in);
+		t->bytes_out += ctr_get(&s->bytes_out);
+		t->skipped += ctr_get(&s->skipped);
 	}
+	pthread_mutex_unlock(&stats_mu);
+}
 
-	if (write_all(fd, html, strlen(html)) != 0)
-		goto fail;
-	close(fd);
+/* upper bound, in us, of the bucket holding quantile q */
+static uint64_t
+hist_quantile(const Hist *h, double q)
+{
+	uint64_t want = (uint64_t)((double)h->n * q), seen = 0;
+	for (int b = 0; b < HIST_N; b++) {
+		seen += h->hist[b];
+		if (seen > want || b == HIST_N - 1)
+			return (uint64_t)1 << b;
+	}
 	return 0;
-
-fail:
-	close(fd);
-	return -1;
 }
 
 static int
-md_to_html_file(const char *md_path, const char *out_path,
-    const char *layout_path)
+slow_cmp(const void *a, const void *b)
 {
-	struct stat src_st;
-	int have_src_st = (stat(md_path, &src_st) == 0);
+	uint64_t x = ((const SlowFile *)a)->ns, y = ((const SlowFile *)b)->ns;
+	return (x < y) - (x > y);
+}
 
-	Arena a;
-	arena_init(&a, 8 * 1024 * 1024);
+/* Print the build's stats and start over. Called between passes, when no
+ * worker is running. */
+static void
+stats_report(void)
+{
+	Stats t;
+	stats_sum(&t);
+	uint64_t total = 0;
+	for (int i = 0; i < ST_N; i++)
+		total += t.stage[i].ns;
 
-	char *layout =
-	    layout_path ? read_file(&a, layout_path, 0) : NULL; /* perm */
-	char *mdsrc = read_file(&a, md_path,
-	    0); /* perm: preprocess walks this while temp arena is reused */
-	if (!mdsrc) {
-		arena_destroy(&a);
-		return -1;
+	printf("%-11s %8s %10s %6s %9s %9s %9s\n", "stage", "count",
+	    "total_ms", "share", "mean_us", "p50_us", "p99_us");
+	for (int i = 0; i < ST_N; i++) {
+		const Hist *h = &t.stage[i];
+		if (!h->n)
+			continue;
+		printf("%-11s %8llu %10.1f %5.1f%% %9.1f %9llu %9llu\n",
+		    stage_names[i], (unsigned long long)h->n,
+		    (double)h->ns / 1e6,
+		    total ? (double)h->ns * 100 / (double)total : 0.0,
+		    (double)h->ns / 1e3 / (double)h->n,
+		    (unsigned long long)hist_quantile(h, 0.5),
+		    (unsigned long long)hist_quantile(h, 0.99));
+	}
+	printf("histograms (under N us: count):\n");
+	for (int i = 0; i < ST_N; i++) {
+		const Hist *h = &t.stage[i];
+		if (!h->n)
+			continue;
+		printf("  %-11s", stage_names[i]);
+		for (int b = 0; b < HIST_N; b++) {
+			if (!h->hist[b])
+				continue;
+			if (b == HIST_N - 1)
+				printf(" more:%llu", (unsigned long long)h->hist[b]);
+			else
+				printf(" %llu:%llu", 1ULL << b,
+				    (unsigned long long)h->hist[b]);
+		}
+		printf("\n");
 	}
 
-	char *prep = preprocess(&a, mdsrc);
-	if (!prep) {
-		arena_destroy(&a);
-		return -1;
+	/* each thread's slowest, merged into one top list however many
+	 * threads there were; the blocks are reset as we go */
+	SlowFile all[STATS_SLOW] = {{0}};
+	pthread_mutex_lock(&stats_mu);
+	for (Stats *s = stats_all; s; s = s->next) {
+		for (int i = 0; i < STATS_SLOW; i++) {
+			SlowFile *min = &all[0];
+			for (int k = 1; k < STATS_SLOW; k++)
+				if (all[k].ns < min->ns)
+					min = &all[k];
+			if (s->slow[i].path && s->slow[i].ns > min->ns) {
+				free(min->path);
+				*min = s->slow[i];
+			} else {
+				free(s->slow[i].path);
+			}
+		}
+		Stats *next = s->next;
+		memset(s, 0, sizeof(*s));
+		s->next = next;
+	}
+	pthread_mutex_unlock(&stats_mu);
+	qsort(all, STATS_SLOW, sizeof(*all), slow_cmp);
+	if (all[0].path)
+		printf("slowest files:\n");
+	for (size_t i = 0; i < STATS_SLOW; i++) {
+		if (all[i].path)
+			printf("  %9.1f ms  %s\n", (double)all[i].ns / 1e6,
+			    all[i].path);
+		free(all[i].path);
 	}
-	arena_reset_temp(&a);
+	printf("bytes in %.1f MB, out %.1f MB; %llu up to date\n",
+	    (double)t.bytes_in / 1e6, (double)t.bytes_out / 1e6,
+	    (unsigned long long)t.skipped);
+}
 
-	Buf html = {0};
-	if (md_html(prep, strlen(prep), md_cb, &html, MD_DIALECT_GITHUB, 0) !=
-	    0) {
-		free(prep);
-		free(html.p);
-		arena_destroy(&a);
-		return -1;
+/* Prometheus text format: the stage and request histograms (in seconds)
+ * and the byte counters, summed over threads */
+static void
+stats_metrics(Buf *b)
+{
+	Stats t;
+	stats_sum(&t);
+	char line[256];
+	for (int k = 0; k < 2; k++) {
+		const char *name = k ? "huap_request_seconds"
+				     : "huap_stage_seconds";
+		const char *label = k ? "kind" : "stage";
+		snprintf(line, sizeof(line), "# TYPE %s histogram\n", name);
+		buf_puts(b, line);
+		for (int i = 0; i < (k ? RQ_N : ST_N); i++) {
+			const Hist *h = k ? &t.req[i] : &t.stage[i];
+			const char *v = k ? req_names[i] : stage_names[i];
+			uint64_t cum = 0;
+			for (int bk = 0; bk < HIST_N; bk++) {
+				cum += h->hist[bk];
+				if (bk == HIST_N - 1)
+					snprintf(line, sizeof(line),
+					    "%s_bucket{%s=\"%s\",le=\"+Inf\"} "
+					    "%llu\n",
+					    name, label, v,
+					    (unsigned long long)cum);
+				else
+					snprintf(line, sizeof(line),
+					    "%s_bucket{%s=\"%s\",le=\"%g\"} "
+					    "%llu\n",
+					    name, label, v,
+					    (double)(1ULL << bk) / 1e6,
+					    (unsigned long long)cum);
+				buf_puts(b, line);
+			}
+			snprintf(line, sizeof(line),
+			    "%s_sum{%s=\"%s\"} %.9f\n%s_count{%s=\"%s\"} %llu\n",
+			    name, label, v, (double)h->ns / 1e9, name, label, v,
+			    (unsigned long long)h->n);
+			buf_puts(b, line);
+		}
 	}
-	free(prep);
+	snprintf(line, sizeof(line),
+	    "# TYPE huap_bytes_in_total counter\nhuap_bytes_in_total %llu\n"
+	    "# TYPE huap_bytes_out_total counter\nhuap_bytes_out_total %llu\n",
+	    (unsigned long long)t.bytes_in, (unsigned long long)t.bytes_out);
+	buf_puts(b, line);
+}
 
-	if (html.p)
-		postprocess_links_strip_md(html.p);
-	int rc = write_output_wrapped(out_path, html.p ? html.p : "", layout);
-	if (rc == 0 && have_src_st) {
-		if (preserve_mode_mtime(out_path, &src_st) == -1)
-			rc = -1;
+/* Output sink: a fixed-size buffer that flushes to an fd, or appends to a
+ * Buf in serve mode. Pages stream through it, so memory per job does not
+ * grow with page size. */
+
+#define SINK_BUFSZ (64 * 1024)
+
+typedef struct {
+	int fd;   /* destination, or -1 to append to out */
+	Buf *out;
+	int err;
+	size_t len;
+	char buf[SINK_BUFSZ];
+} Sink;
+
+static void
+sink_open(Sink *s, int fd, Buf *out)
+{
+	s->fd = fd;
+	s->out = out;
+	s->err = 0;
+	s->len = 0;
+}
+
+static void
+sink_flush(Sink *s)
+{
+	if (!s->err && s->len) {
+		if (s->fd >= 0) {
+			uint64_t t0 = stats_now();
+			s->err = write_all(s->fd, s->buf, s->len) != 0;
+			stats_stage(ST_WRITE, t0);
+			stats_bytes(0, s->len);
+		} else
+			s->err = buf_putn(s->out, s->buf, s->len) != 0;
 	}
+	s->len = 0;
+}
 
-	free(html.p);
-	arena_destroy(&a);
-	return rc;
+static void
+sink_write(Sink *s, const void *p, size_t n)
+{
+	const char *c = p;
+	while (n) {
+		if (s->len == SINK_BUFSZ)
+			sink_flush(s);
+		size_t k = SINK_BUFSZ - s->len;
+		if (k > n)
+			k = n;
+		memcpy(s->buf + s->len, c, k);
+		s->len += k;
+		c += k;
+		n -= k;
+	}
 }
 
-/* Parallel build (thread pool) */
+/* Markdown + preprocessing */
+
+static void
+md_cb(const MD_CHAR *text, MD_SIZE size, void *userdata)
+{
+	sink_write(userdata, text, (size_t)size);
+}
+
+/* Local links to Markdown pages, rewritten by md4c while it renders the
+ * href: "page.md#sec" becomes "page#sec" in serve mode (extensionless
+ * routes) and "page.html#sec" in build mode. userdata is the new suffix. */
+static const MD_CHAR *
+rewrite_md_link(const MD_CHAR *href, MD_SIZE size, MD_OFFSET *beg,
+    MD_OFFSET *end, void *userdata)
+{
+	MD_SIZE n = 0;
+	if (size >= 2 && href[0] == '/' && href[1] == '/')
+		return NULL; /* protocol-relative */
+	while (n < size && href[n] != '?' && href[n] != '#') {
+		if (href[n] == ':')
+			return NULL; /* has a scheme */
+		n++;
+	}
+	if (n < 4 || memcmp(href + n - 3, ".md", 3) != 0 || href[n - 4] == '/')
+		return NULL;
+	*beg = n - 3;
+	*end = n;
+	return userdata;
+}
 
-typedef enum { JOB_COPY, JOB_MD } JobType;
+static const MD_HTML_HOOKS serve_links = {rewrite_md_link, "", NULL, NULL};
+static const MD_HTML_HOOKS build_links = {rewrite_md_link, ".html", NULL,
+    NULL};
 
-typedef struct Job {
-	JobType t;
-	char *src;
-	char *dst;
-	struct Job *next;
-} Job;
+/* $code include cache: each included file is read once per (path, inode,
+ * mtime, size), split into its marker-free form and a snippet index, and
+ * shared by every build worker or by the serve loop. */
 
 typedef struct {
-	Job *head, *tail;
-	int closed;
+	const char *name; /* points into Include.data */
+	size_t nlen;
+	size_t off, len; /* snippet body within data */
+} Snippet;
+
+typedef struct Include {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	uint64_t hash;  /* of the whole file */
+	char *data;     /* file contents */
+	size_t maplen;  /* data is mapped with this length, or 0 */
+	char *stripped; /* data without snippet marker lines */
+	size_t slen;
+	Snippet *snips; /* open-addressed by name, nslots is a power of 2 */
+	size_t nslots;
+	int refs;
+	struct Include *next;
+} Include;
+
+#define INC_BUCKETS 256
+
+static struct {
 	pthread_mutex_t mu;
-	pthread_cond_t cv;
-} JobQ;
+	Include *tab[INC_BUCKETS];
+} g_includes = {.mu = PTHREAD_MUTEX_INITIALIZER};
 
-static void
-jq_init(JobQ *q)
+static int
+line_has_prefix(const char *line, size_t n, const char *pfx)
 {
-	memset(q, 0, sizeof(*q));
-	pthread_mutex_init(&q->mu, NULL);
-	pthread_cond_init(&q->cv, NULL);
+	size_t pn = strlen(pfx);
+	return n >= pn && memcmp(line, pfx, pn) == 0;
 }
+
 static void
-jq_close(JobQ *q)
+inc_free(Include *inc)
 {
-	pthread_mutex_lock(&q->mu);
-	q->closed = 1;
-	pthread_cond_broadcast(&q->cv);
-	pthread_mutex_unlock(&q->mu);
+	free(inc->path);
+	if (inc->maplen)
+		munmap(inc->data, inc->maplen);
+	else
+		free(inc->data);
+	free(inc->stripped);
+	free(inc->snips);
+	free(inc);
 }
+
 static void
-jq_push(JobQ *q, Job *j)
+inc_release(Include *inc)
 {
-	j->next = NULL;
-	pthread_mutex_lock(&q->mu);
-	if (q->tail)
-		q->tail->next = j;
-	else
-		q->head = j;
-	q->tail = j;
-	pthread_cond_signal(&q->cv);
-	pthread_mutex_unlock(&q->mu);
+	pthread_mutex_lock(&g_includes.mu);
+	int last = --inc->refs == 0;
+	pthread_mutex_unlock(&g_includes.mu);
+	if (last)
+		inc_free(inc);
 }
-static Job *
-jq_pop(JobQ *q)
+
+static Snippet *
+inc_slot(const Include *inc, const char *name, size_t nlen)
 {
-	pthread_mutex_lock(&q->mu);
-	while (!q->head && !q->closed)
-		pthread_cond_wait(&q->cv, &q->mu);
-	Job *j = q->head;
-	if (j) {
-		q->head = j->next;
-		if (!q->head)
-			q->tail = NULL;
-	}
-	pthread_mutex_unlock(&q->mu);
-	return j;
+	size_t mask = inc->nslots - 1;
+	size_t i = (size_t)hash_mem(name, nlen) & mask;
+	while (inc->snips[i].name &&
+	    !(inc->snips[i].nlen == nlen &&
+		memcmp(inc->snips[i].name, name, nlen) == 0))
+		i = (i + 1) & mask;
+	return &inc->snips[i];
 }
 
-typedef struct {
-	JobQ *q;
-	const char *layout_path;
-} WorkerCtx;
+static const Snippet *
+inc_snippet(const Include *inc, const char *name)
+{
+	if (!inc->nslots)
+		return NULL;
+	const Snippet *sn = inc_slot(inc, name, strlen(name));
+	return sn->name ? sn : NULL;
+}
 
-static void *
-worker_main(void *arg)
+/* Build the stripped copy and the snippet index. A snippet runs from the
+ * line after "//snippet NAME" to the next line starting with "//endsnippet";
+ * the first definition of a name wins. */
+static int
+inc_index(Include *inc, size_t n)
 {
-	WorkerCtx *ctx = arg;
-	for (;;) {
-		Job *j = jq_pop(ctx->q);
-		if (!j) {
-			/* closed + empty */
-			break;
-		}
-		if (j->t == JOB_COPY) {
-			if (copy_file(j->src, j->dst) != 0) {
-				fprintf(stderr, "copy failed: %s -> %s (%s)\n",
-				    j->src, j->dst, strerror(errno));
+	const char *d = inc->data;
+	size_t nmarks = 0;
+	for (const char *p = d; (p = strstr(p, SNIPPET_S)); p++)
+		nmarks++;
+	inc->nslots = 0;
+	if (nmarks) {
+		inc->nslots = 4;
+		while (inc->nslots < nmarks * 2)
+			inc->nslots *= 2;
+		inc->snips = calloc(inc->nslots, sizeof(*inc->snips));
+		if (!inc->snips)
+			return -1;
+	}
+	inc->stripped = malloc(n + 1);
+	if (!inc->stripped)
+		return -1;
+
+	size_t o = 0, open_from = 0; /* snippets still waiting for their end */
+	Snippet **open = nmarks ? calloc(nmarks, sizeof(*open)) : NULL;
+	size_t nopen = 0;
+	if (nmarks && !open)
+		return -1;
+
+	const char *p = d, *end = d + n;
+	while (p < end) {
+		const char *nl = memchr(p, '\n', (size_t)(end - p));
+		size_t ln = nl ? (size_t)(nl - p) : (size_t)(end - p);
+		const char *next = nl ? nl + 1 : end;
+
+		if (line_has_prefix(p, ln, SNIPPET_S)) {
+			const char *nm = p + strlen(SNIPPET_S);
+			size_t nlen = 0;
+			while (nm + nlen < p + ln && nm[nlen] != ' ' &&
+			    nm[nlen] != '\t' && nm[nlen] != '\r')
+				nlen++;
+			Snippet *sn = nlen ? inc_slot(inc, nm, nlen) : NULL;
+			if (sn && !sn->name && nopen < nmarks) {
+				sn->name = nm;
+				sn->nlen = nlen;
+				sn->off = (size_t)(next - d);
+				sn->len = (size_t)-1;
+				open[nopen++] = sn;
 			}
+		} else if (line_has_prefix(p, ln, SNIPPET_E)) {
+			for (size_t i = open_from; i < nopen; i++)
+				open[i]->len = (size_t)(p - d) - open[i]->off;
+			open_from = nopen;
+		}
+
+		if (line_has_prefix(p, ln, SNIPPET_S) ||
+		    line_has_prefix(p, ln, SNIPPET_E)) {
+			if (nl)
+				inc->stripped[o++] = '\n';
 		} else {
-			if (md_to_html_file(j->src, j->dst, ctx->layout_path) !=
-			    0) {
-				fprintf(stderr,
-				    "render failed: %s -> %s (%s)\n", j->src,
-				    j->dst, strerror(errno));
-			}
+			memcpy(inc->stripped + o, p, (size_t)(next - p));
+			o += (size_t)(next - p);
 		}
-		free(j->src);
-		free(j->dst);
-		free(j);
+		p = next;
+	}
+	inc->stripped[o] = '\0';
+	inc->slen = o;
+
+	/* a snippet without its end marker is not found, as before */
+	for (size_t i = open_from; i < nopen; i++) {
+		open[i]->name = NULL;
+		open[i]->nlen = 0;
+	}
+	free(open);
+	return 0;
+}
+
+static Include *
+inc_load(const char *path, const struct stat *st)
+{
+	Include *inc = calloc(1, sizeof(*inc));
+	if (!inc)
+		return NULL;
+	size_t n = (size_t)st->st_size, off = 0;
+	inc->path = strdup(path);
+	int fd = open(path, O_RDONLY);
+	if (fd != -1 && map_inputs && n >= MMAP_MIN &&
+	    (inc->data = map_file(fd, n))) {
+		inc->maplen = n + 1;
+		off = n;
+	} else if (fd != -1) {
+		inc->data = malloc(n + 1);
+	}
+	while (fd != -1 && inc->data && off < n) {
+		ssize_t r = read(fd, inc->data + off, n - off);
+		if (r <= 0)
+			break;
+		off += (size_t)r;
+	}
+	if (fd != -1)
+		close(fd);
+	if (!inc->path || !inc->data || off < n) {
+		inc_free(inc);
+		return NULL;
+	}
+	if (!inc->maplen)
+		inc->data[n] = '\0';
+	inc->hash = hash_mem(inc->data, n);
+	/* old behaviour: the file ends at its first NUL byte */
+	n = strlen(inc->data);
+	if (inc_index(inc, n) != 0) {
+		inc_free(inc);
+		return NULL;
+	}
+	inc->dev = st->st_dev;
+	inc->ino = st->st_ino;
+	inc->mtime = st->st_mtime;
+	inc->size = st->st_size;
+	inc->refs = 1; /* the cache's reference */
+	return inc;
+}
+
+static int
+inc_current(const Include *inc, const struct stat *st)
+{
+	return inc->dev == st->st_dev && inc->ino == st->st_ino &&
+	    inc->mtime == st->st_mtime && inc->size == st->st_size;
+}
+
+/* Returns a referenced entry for path (release with inc_release()), or NULL
+ * if it cannot be read. */
+static Include *
+inc_get(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	Include **bucket = &g_includes.tab[hash_str(path) % INC_BUCKETS];
+	pthread_mutex_lock(&g_includes.mu);
+	for (Include *i = *bucket; i; i = i->next) {
+		if (strcmp(i->path, path) == 0 && inc_current(i, &st)) {
+			i->refs++;
+			pthread_mutex_unlock(&g_includes.mu);
+			return i;
+		}
+	}
+	pthread_mutex_unlock(&g_includes.mu);
+
+	/* read and index outside the lock */
+	Include *inc = inc_load(path, &st);
+	if (!inc)
+		return NULL;
+
+	Include *stale = NULL;
+	pthread_mutex_lock(&g_includes.mu);
+	for (Include **pp = bucket; *pp; pp = &(*pp)->next) {
+		if (strcmp((*pp)->path, path) != 0)
+			continue;
+		if (inc_current(*pp, &st)) {
+			/* another thread got there first */
+			Include *won = *pp;
+			won->refs++;
+			pthread_mutex_unlock(&g_includes.mu);
+			inc_free(inc);
+			return won;
+		}
+		stale = *pp;
+		*pp = stale->next;
+		break;
+	}
+	inc->next = *bucket;
+	*bucket = inc;
+	inc->refs++;
+	int drop = stale && --stale->refs == 0;
+	pthread_mutex_unlock(&g_includes.mu);
+	if (drop)
+		inc_free(stale);
+	return inc;
+}
+
+static void
+includes_free(void)
+{
+	pthread_mutex_lock(&g_includes.mu);
+	for (size_t b = 0; b < INC_BUCKETS; b++) {
+		while (g_includes.tab[b]) {
+			Include *i = g_includes.tab[b];
+			g_includes.tab[b] = i->next;
+			if (--i->refs == 0)
+				inc_free(i);
+		}
+	}
+	pthread_mutex_unlock(&g_includes.mu);
+}
+
+/* trim spaces/tabs and optional \r at end, for line token checks */
+static void
+line_trim(const char *s, size_t n, const char **out_s, size_t *out_n)
+{
+	while (n && (*s == ' ' || *s == '\t')) {
+		s++;
+		n--;
+	}
+	while (n && (s[n - 1] == ' ' || s[n - 1] == '\t' || s[n - 1] == '\r'))
+		n--;
+	*out_s = s;
+	*out_n = n;
+}
+
+/* parse $code line: "$code <path> [snippet]" (snippet optional; supports [name]
+ * or bare token) */
+static void
+handle_code_line(const char *s, size_t n, Buf *out, Deps *deps)
+{
+	/* s/n already trimmed to line content (no leading ws) */
+	const char *p = s + (sizeof(CODE_CMD) - 1);
+	while ((size_t)(p - s) < n && (*p == ' ' || *p == '\t'))
+		p++;
+
+	/* path token */
+	const char *path_s = p;
+	while ((size_t)(p - s) < n && *p != ' ' && *p != '\t')
+		p++;
+	size_t path_n = (size_t)(p - path_s);
+	if (path_n == 0)
+		return;
+
+	char path[2048];
+	if (path_n >= sizeof(path))
+		path_n = sizeof(path) - 1;
+	memcpy(path, path_s, path_n);
+	path[path_n] = '\0';
+
+	/* optional snippet token */
+	while ((size_t)(p - s) < n && (*p == ' ' || *p == '\t'))
+		p++;
+	char snip[256];
+	snip[0] = '\0';
+	if ((size_t)(p - s) < n) {
+		const char *sn_s = p;
+		size_t sn_n = n - (size_t)(p - s);
+		/* allow [name] */
+		if (sn_n >= 2 && sn_s[0] == '[') {
+			const char *rb = memchr(sn_s, ']', sn_n);
+			if (rb) {
+				sn_s++;
+				sn_n = (size_t)(rb - sn_s);
+			}
+		} else {
+			/* bare token: stop at whitespace */
+			const char *q = sn_s;
+			while ((size_t)(q - s) < n && *q != ' ' && *q != '\t')
+				q++;
+			sn_n = (size_t)(q - sn_s);
+		}
+		if (sn_n >= sizeof(snip))
+			sn_n = sizeof(snip) - 1;
+		memcpy(snip, sn_s, sn_n);
+		snip[sn_n] = '\0';
+	}
+
+	Include *inc = inc_get(path);
+	if (inc)
+		(void)deps_add_stat(deps, path, inc->size, inc->mtime,
+		    inc->hash);
+	else
+		(void)deps_add(deps, path);
+	if (!inc) {
+		buf_puts(out, "`[Code file not found: ");
+		buf_puts(out, path);
+		buf_puts(out, "]`");
+		return;
+	}
+
+	buf_puts(out, "\n```\n");
+	if (snip[0]) {
+		const Snippet *sn = inc_snippet(inc, snip);
+		if (sn)
+			buf_putn(out, inc->data + sn->off, sn->len);
+		else
+			buf_puts(out, "SNIPPET NOT FOUND\n");
+	} else {
+		buf_putn(out, inc->stripped, inc->slen);
+	}
+	buf_puts(out, "\n```\n");
+	inc_release(inc);
+}
+
+/* $posts DIR: a newest-first list of the YYYY-MM-DD-slug.md files in DIR,
+ * one paragraph per post, and with --feed the same list as DESTDIR/rss.xml.
+ * Dates and titles come from the file names, so a post never has to be
+ * opened to be listed. */
+
+typedef struct {
+	char *name; /* YYYY-MM-DD-slug.md */
+	int y, m, d;
+} Post;
+
+static const char *const month_names[] = {"Jan", "Feb", "Mar", "Apr", "May",
+	"Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static const char *const day_names[] = {"Sun", "Mon", "Tue", "Wed", "Thu",
+	"Fri", "Sat"};
+
+static struct {
+	const char *url; /* NULL: no feed */
+	const char *title;
+	const char *desc;
+} feed;
+
+static int
+post_parse(const char *name, Post *p)
+{
+	size_t n = strlen(name);
+	if (n < 15 || !has_ext(name, ".md") || name[4] != '-' ||
+	    name[7] != '-' || name[10] != '-')
+		return -1;
+	for (int i = 0; i < 10; i++)
+		if (i != 4 && i != 7 && !isdigit((unsigned char)name[i]))
+			return -1;
+	p->y = atoi(name);
+	p->m = atoi(name + 5);
+	p->d = atoi(name + 8);
+	if (p->m < 1 || p->m > 12 || p->d < 1 || p->d > 31)
+		return -1;
+	return 0;
+}
+
+static int
+post_cmp(const void *a, const void *b)
+{
+	return strcmp(((const Post *)b)->name, ((const Post *)a)->name);
+}
+
+static void
+posts_free(Post *v, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		free(v[i].name);
+	free(v);
+}
+
+/* the posts in dir, newest first; -1 if dir cannot be read */
+static ssize_t
+posts_scan(const char *dir, Post **out)
+{
+	DIR *d = opendir(dir);
+	if (!d)
+		return -1;
+	Post *v = NULL;
+	size_t n = 0, cap = 0;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		Post p;
+		if (post_parse(de->d_name, &p) != 0)
+			continue;
+		if (n == cap) {
+			size_t ncap = cap ? cap * 2 : 16;
+			Post *nv = realloc(v, ncap * sizeof(*nv));
+			if (!nv)
+				break;
+			v = nv;
+			cap = ncap;
+		}
+		if (!(p.name = strdup(de->d_name)))
+			break;
+		v[n++] = p;
+	}
+	closedir(d);
+	if (n > 1)
+		qsort(v, n, sizeof(*v), post_cmp);
+	*out = v;
+	return (ssize_t)n;
+}
+
+/* "2026-02-16-huap-sidenotes.md" -> "Huap Sidenotes" */
+static void
+post_title(const Post *p, char *dst, size_t cap)
+{
+	const char *s = p->name + 11, *e = p->name + strlen(p->name) - 3;
+	size_t o = 0;
+	int word = 1;
+	for (; s < e && o + 1 < cap; s++) {
+		char c = *s == '-' ? ' ' : *s;
+		dst[o++] = word ? (char)toupper((unsigned char)c) : c;
+		word = c == ' ';
+	}
+	dst[o] = '\0';
+}
+
+static void
+handle_posts_line(const char *s, size_t n, Buf *out, Deps *deps)
+{
+	char dir[1024];
+	size_t dn = n - (sizeof(POSTS_CMD) - 1);
+	const char *ds = s + (sizeof(POSTS_CMD) - 1);
+	while (dn && (*ds == ' ' || *ds == '\t')) {
+		ds++;
+		dn--;
+	}
+	while (dn && (ds[dn - 1] == ' ' || ds[dn - 1] == '\t' ||
+	    ds[dn - 1] == '/'))
+		dn--;
+	if (dn == 0 || dn >= sizeof(dir))
+		return;
+	memcpy(dir, ds, dn);
+	dir[dn] = '\0';
+
+	/* the listing changes only when a post is added, renamed or removed,
+	 * and each of those touches the directory */
+	(void)deps_add(deps, dir);
+	Post *v;
+	ssize_t np = posts_scan(dir, &v);
+	if (np < 0) {
+		buf_puts(out, "`[Posts directory not found: ");
+		buf_puts(out, dir);
+		buf_puts(out, "]`");
+		return;
+	}
+	for (ssize_t i = 0; i < np; i++) {
+		char line[1024], title[512];
+		post_title(&v[i], title, sizeof(title));
+		int ln = snprintf(line, sizeof(line), "%02d %s %04d - [%s](./%s/%s)\n\n",
+		    v[i].d, month_names[v[i].m - 1], v[i].y, title, dir,
+		    v[i].name);
+		if (ln > 0 && (size_t)ln < sizeof(line))
+			buf_putn(out, line, (size_t)ln);
+	}
+	posts_free(v, (size_t)np);
+}
+
+static void
+xml_escape(Buf *out, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '&':
+			buf_puts(out, "&amp;");
+			break;
+		case '<':
+			buf_puts(out, "&lt;");
+			break;
+		case '>':
+			buf_puts(out, "&gt;");
+			break;
+		case '"':
+			buf_puts(out, "&quot;");
+			break;
+		default:
+			buf_putn(out, s, 1);
+		}
+	}
+}
+
+/* RSS 2.0 for the posts in FEED_DIR; -1 if it cannot be read */
+static int
+feed_render(Buf *out)
+{
+	Post *v;
+	ssize_t np = posts_scan(FEED_DIR, &v);
+	if (np < 0)
+		return -1;
+	buf_puts(out, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+		      "<rss version=\"2.0\" "
+		      "xmlns:atom=\"http://www.w3.org/2005/Atom\">\n"
+		      "<channel>\n    <title>");
+	xml_escape(out, feed.title);
+	buf_puts(out, "</title>\n    <link>");
+	xml_escape(out, feed.url);
+	buf_puts(out, "</link>\n    <description>");
+	xml_escape(out, feed.desc);
+	buf_puts(out, "</description>\n    <atom:link href=\"");
+	xml_escape(out, feed.url);
+	buf_puts(out, "/" FEED_NAME "\" rel=\"self\" "
+		      "type=\"application/rss+xml\" />\n");
+	for (ssize_t i = 0; i < np; i++) {
+		const Post *p = &v[i];
+		char title[512], link[2048], date[64];
+		post_title(p, title, sizeof(title));
+		snprintf(link, sizeof(link), "%s/" FEED_DIR "/%.*s.html",
+		    feed.url, (int)strlen(p->name) - 3, p->name);
+		struct tm tm = {.tm_year = p->y - 1900, .tm_mon = p->m - 1,
+			.tm_mday = p->d};
+		time_t t = timegm(&tm);
+		if (!gmtime_r(&t, &tm))
+			continue;
+		/* RFC 822 names, whatever the locale */
+		snprintf(date, sizeof(date),
+		    "%s, %02d %s %04d 00:00:00 +0000", day_names[tm.tm_wday],
+		    tm.tm_mday, month_names[tm.tm_mon], tm.tm_year + 1900);
+		buf_puts(out, "    <item>\n        <title>");
+		xml_escape(out, title);
+		buf_puts(out, "</title>\n        <link>");
+		xml_escape(out, link);
+		buf_puts(out, "</link>\n        <pubDate>");
+		buf_puts(out, date);
+		buf_puts(out, "</pubDate>\n        <guid>");
+		xml_escape(out, link);
+		buf_puts(out, "</guid>\n        <description>");
+		xml_escape(out, title);
+		buf_puts(out, "</description>\n    </item>\n");
+	}
+	buf_puts(out, "</channel>\n</rss>\n");
+	posts_free(v, (size_t)np);
+	return 0;
+}
+
+/* Directive scanning: every directive line starts (after blanks) with '['
+ * or '$', so one pass over the buffer for those two bytes finds all
+ * candidates. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+static const char *
+scan_marks_scalar(const char *p, const char *end)
+{
+	while (p < end && *p != '[' && *p != '$')
+		p++;
+	return p;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static const char *
+scan_marks_sse2(const char *p, const char *end)
+{
+	const __m128i br = _mm_set1_epi8('['), dl = _mm_set1_epi8('$');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, br),
+		    _mm_cmpeq_epi8(v, dl)));
+		if (m)
+			return p + __builtin_ctz((unsigned)m);
+		p += 16;
+	}
+	return scan_marks_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_marks_avx2(const char *p, const char *end)
+{
+	const __m256i br = _mm256_set1_epi8('['), dl = _mm256_set1_epi8('$');
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+		    _mm256_cmpeq_epi8(v, br), _mm256_cmpeq_epi8(v, dl)));
+		if (m)
+			return p + __builtin_ctz(m);
+		p += 32;
+	}
+	return scan_marks_sse2(p, end);
+}
+#endif
+
+typedef const char *(*ScanFn)(const char *, const char *);
+
+static ScanFn
+scan_marks_impl(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_marks_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return scan_marks_sse2;
+#endif
+	return scan_marks_scalar;
+}
+
+/* next '[' or '$' in [p, end), or end */
+static const char *
+scan_marks(const char *p, const char *end)
+{
+	static ScanFn fn;
+	ScanFn f = __atomic_load_n(&fn, __ATOMIC_RELAXED);
+	if (!f) {
+		f = scan_marks_impl();
+		__atomic_store_n(&fn, f, __ATOMIC_RELAXED);
+	}
+	return f(p, end);
+}
+
+typedef enum {
+	DIR_NONE,
+	DIR_SIDENOTE_S,
+	DIR_SIDENOTE_E,
+	DIR_CODE,
+	DIR_POSTS
+} DirKind;
+
+/* Find the next directive line at or after p. On success ls..le bound the
+ * line (le excludes the newline) and ts/tn hold its trimmed content. */
+static DirKind
+next_directive(const char *p, const char *start, const char *end,
+    const char **ls, const char **le, const char **ts, size_t *tn)
+{
+	while ((p = scan_marks(p, end)) < end) {
+		const char *q = p;
+		while (q > start && (q[-1] == ' ' || q[-1] == '\t'))
+			q--;
+		if (q > start && q[-1] != '\n') {
+			p++;
+			continue;
+		}
+		const char *nl = memchr(p, '\n', (size_t)(end - p));
+		const char *e = nl ? nl : end;
+		line_trim(q, (size_t)(e - q), ts, tn);
+
+		/* sidenote markers must occupy their own paragraph/line */
+		DirKind k = DIR_NONE;
+		if (*tn == strlen(SIDENOTE_S) && memcmp(*ts, SIDENOTE_S, *tn) == 0)
+			k = DIR_SIDENOTE_S;
+		else if (*tn == strlen(SIDENOTE_E) &&
+		    memcmp(*ts, SIDENOTE_E, *tn) == 0)
+			k = DIR_SIDENOTE_E;
+		else if (*tn >= strlen(CODE_CMD) &&
+		    memcmp(*ts, CODE_CMD, strlen(CODE_CMD)) == 0)
+			k = DIR_CODE;
+		else if (*tn > strlen(POSTS_CMD) &&
+		    memcmp(*ts, POSTS_CMD, strlen(POSTS_CMD)) == 0)
+			k = DIR_POSTS;
+		if (k != DIR_NONE) {
+			*ls = q;
+			*le = e;
+			return k;
+		}
+		p++;
+	}
+	return DIR_NONE;
+}
+
+/* Expand directives in src[0, n). Returns src itself when there are none
+ * (the common case); otherwise a buffer in a, built from the untouched
+ * spans between directive lines and their expansions, or NULL if a cannot
+ * grow. deps (optional) collects every $code file and $posts directory the
+ * page pulls in. */
+static char *
+preprocess(Arena *a, const char *src, size_t n, Deps *deps, size_t *outlen)
+{
+	const char *end = src + n, *p = src, *ls, *le, *ts;
+	size_t tn;
+	DirKind k = next_directive(p, src, end, &ls, &le, &ts, &tn);
+	if (k == DIR_NONE) {
+		*outlen = n;
+		return (char *)src;
+	}
+
+	Buf out = {.a = a};
+	do {
+		buf_putn(&out, p, (size_t)(ls - p));
+		switch (k) {
+		case DIR_SIDENOTE_S:
+			buf_puts(&out, SIDENOTE_R_S);
+			break;
+		case DIR_SIDENOTE_E:
+			buf_puts(&out, SIDENOTE_R_E);
+			break;
+		case DIR_POSTS:
+			handle_posts_line(ts, tn, &out, deps);
+			break;
+		default:
+			handle_code_line(ts, tn, &out, deps);
+			break;
+		}
+		buf_putn(&out, "\n", 1);
+		p = le < end ? le + 1 : end;
+	} while ((k = next_directive(p, src, end, &ls, &le, &ts, &tn)) !=
+	    DIR_NONE);
+	buf_putn(&out, p, (size_t)(end - p));
+
+	if (!out.p)
+		return NULL;
+	*outlen = out.len;
+	return out.p;
+}
+
+/* Layout templates: layout.html is compiled once into a list of literal
+ * segments and placeholders, then shared read-only by every page. */
+
+typedef enum { SEG_TEXT, SEG_BODY, SEG_TITLE, SEG_PATH, SEG_DATE } SegKind;
+
+typedef struct {
+	SegKind k;
+	const char *p; /* SEG_TEXT only; points into Layout.src */
+	size_t n;
+} Seg;
+
+typedef struct Layout {
+	Arena a; /* owns src */
+	char *src;
+	uint64_t hash; /* of src, for the build manifest */
+	Seg *segs;
+	size_t nsegs;
+	unsigned refs; /* LayoutCache bookkeeping, under its mu */
+} Layout;
+
+static const struct {
+	const char *ph;
+	SegKind k;
+} layout_phs[] = {
+	{BODY_PH, SEG_BODY},
+	{TITLE_PH, SEG_TITLE},
+	{PATH_PH, SEG_PATH},
+	{DATE_PH, SEG_DATE},
+};
+
+static int
+layout_add_seg(Layout *l, size_t *cap, SegKind k, const char *p, size_t n)
+{
+	if (k == SEG_TEXT && n == 0)
+		return 0;
+	if (l->nsegs == *cap) {
+		size_t ncap = *cap ? *cap * 2 : 8;
+		Seg *ns = realloc(l->segs, ncap * sizeof(*ns));
+		if (!ns)
+			return -1;
+		l->segs = ns;
+		*cap = ncap;
+	}
+	l->segs[l->nsegs++] = (Seg){.k = k, .p = p, .n = n};
+	return 0;
+}
+
+static void
+layout_free(Layout *l)
+{
+	if (!l)
+		return;
+	free(l->segs);
+	arena_destroy(&l->a);
+	free(l);
+}
+
+/* Only the first {{Body}} receives the page; without one the page follows
+ * the whole layout. */
+static Layout *
+layout_compile(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return NULL;
+	Layout *l = calloc(1, sizeof(*l));
+	if (!l)
+		return NULL;
+	arena_init(&l->a, (size_t)st.st_size + 64);
+	size_t n;
+	l->src = read_file(&l->a, path, &n);
+	if (!l->src) {
+		layout_free(l);
+		return NULL;
+	}
+	l->hash = hash_mem(l->src, n);
+
+	size_t cap = 0;
+	int have_body = 0;
+	const char *lit = l->src, *p = l->src;
+	while ((p = strstr(p, "{{"))) {
+		size_t i, nph = sizeof(layout_phs) / sizeof(layout_phs[0]);
+		for (i = 0; i < nph; i++)
+			if (strncmp(p, layout_phs[i].ph,
+				strlen(layout_phs[i].ph)) == 0)
+				break;
+		if (i == nph || (layout_phs[i].k == SEG_BODY && have_body)) {
+			p += 2;
+			continue;
+		}
+		if (layout_add_seg(l, &cap, SEG_TEXT, lit, (size_t)(p - lit)) ||
+		    layout_add_seg(l, &cap, layout_phs[i].k, NULL, 0))
+			goto fail;
+		have_body |= layout_phs[i].k == SEG_BODY;
+		p += strlen(layout_phs[i].ph);
+		lit = p;
+	}
+	if (layout_add_seg(l, &cap, SEG_TEXT, lit, strlen(lit)))
+		goto fail;
+	if (!have_body && layout_add_seg(l, &cap, SEG_BODY, NULL, 0))
+		goto fail;
+	return l;
+
+fail:
+	layout_free(l);
+	return NULL;
+}
+
+/* Per-page placeholder values, already HTML-escaped */
+typedef struct {
+	char title[512];
+	char path[1024];
+	char date[16];
+} PageVars;
+
+static void
+html_escape_to(char *dst, size_t cap, const char *s, size_t n)
+{
+	size_t o = 0;
+	for (size_t i = 0; i < n && s[i]; i++) {
+		const char *rep = NULL;
+		switch (s[i]) {
+		case '&':
+			rep = "&amp;";
+			break;
+		case '<':
+			rep = "&lt;";
+			break;
+		case '>':
+			rep = "&gt;";
+			break;
+		case '"':
+			rep = "&quot;";
+			break;
+		}
+		size_t rn = rep ? strlen(rep) : 1;
+		if (o + rn >= cap)
+			break;
+		if (rep)
+			memcpy(dst + o, rep, rn);
+		else
+			dst[o] = s[i];
+		o += rn;
+	}
+	dst[o] = '\0';
+}
+
+/* first "# " heading outside code fences, minus inline markup */
+static int
+md_first_h1(const char *md, char *out, size_t cap)
+{
+	int fence = 0;
+	const char *p = md;
+	while (*p) {
+		const char *nl = strchr(p, '\n');
+		size_t n = nl ? (size_t)(nl - p) : strlen(p);
+		if (n >= 3 && (memcmp(p, "```", 3) == 0 ||
+				  memcmp(p, "~~~", 3) == 0)) {
+			fence = !fence;
+		} else if (!fence && n >= 2 && p[0] == '#' && p[1] == ' ') {
+			const char *s = p + 2;
+			size_t sn = n - 2, o = 0;
+			while (sn && (s[sn - 1] == '#' || s[sn - 1] == ' ' ||
+					 s[sn - 1] == '\t' || s[sn - 1] == '\r'))
+				sn--;
+			for (size_t i = 0; i < sn && o + 1 < cap; i++)
+				if (!strchr("*_`", s[i]))
+					out[o++] = s[i];
+			out[o] = '\0';
+			return o > 0;
+		}
+		if (!nl)
+			break;
+		p = nl + 1;
+	}
+	return 0;
+}
+
+/* the first H1, else the file name without .md; not escaped */
+static void
+page_title(const char *mdsrc, const char *src_path, char *raw, size_t cap)
+{
+	const char *base = strrchr(src_path, '/');
+	base = base ? base + 1 : src_path;
+	if (!mdsrc || !md_first_h1(mdsrc, raw, cap)) {
+		size_t n = strlen(base);
+		if (has_ext(base, ".md"))
+			n -= 3;
+		if (n >= cap)
+			n = cap - 1;
+		memcpy(raw, base, n);
+		raw[n] = '\0';
+	}
+}
+
+static void
+page_vars_init(PageVars *v, const char *mdsrc, const char *src_path,
+    const char *route, time_t mtime)
+{
+	char raw[512];
+	const char *base = strrchr(src_path, '/');
+	base = base ? base + 1 : src_path;
+
+	page_title(mdsrc, src_path, raw, sizeof(raw));
+	html_escape_to(v->title, sizeof(v->title), raw, strlen(raw));
+	html_escape_to(v->path, sizeof(v->path), route, strlen(route));
+
+	/* dated filenames (YYYY-MM-DD-slug.md) win over the mtime */
+	int dated = strlen(base) >= 10 && base[4] == '-' && base[7] == '-';
+	for (int i = 0; dated && i < 10; i++)
+		if (i != 4 && i != 7 && (base[i] < '0' || base[i] > '9'))
+			dated = 0;
+	if (dated) {
+		memcpy(v->date, base, 10);
+		v->date[10] = '\0';
+	} else {
+		struct tm tm;
+		if (!gmtime_r(&mtime, &tm) ||
+		    strftime(v->date, sizeof(v->date), "%Y-%m-%d", &tm) == 0)
+			v->date[0] = '\0';
+	}
+}
+
+/* Layouts by directory. A directory without its own layout.html inherits
+ * the nearest ancestor's, up to the root. Build mode fills this once, from
+ * whichever walking worker gets there first; serve mode revalidates against
+ * the file. */
+
+#define LC_BUCKETS 1024
+
+typedef struct LayoutDir {
+	char *dir;
+	size_t dlen;
+	Layout *own; /* dir/layout.html, or NULL */
+	off_t size;  /* of dir/layout.html, -1 if absent */
+	time_t mtime;
+	struct LayoutDir *next;
+} LayoutDir;
+
+typedef struct {
+	const char *root;
+	int revalidate;
+	LayoutDir *tab[LC_BUCKETS];
+	pthread_mutex_t mu;
+} LayoutCache;
+
+static void
+lc_init(LayoutCache *lc, const char *root, int revalidate)
+{
+	memset(lc, 0, sizeof(*lc));
+	lc->root = root;
+	lc->revalidate = revalidate;
+	pthread_mutex_init(&lc->mu, NULL);
+}
+
+static void
+lc_free(LayoutCache *lc)
+{
+	for (size_t i = 0; i < LC_BUCKETS; i++) {
+		while (lc->tab[i]) {
+			LayoutDir *d = lc->tab[i];
+			lc->tab[i] = d->next;
+			layout_free(d->own);
+			free(d->dir);
+			free(d);
+		}
+	}
+	pthread_mutex_destroy(&lc->mu);
+}
+
+/* caller holds lc->mu */
+static void
+lc_unref(Layout *l)
+{
+	if (l && --l->refs == 0)
+		layout_free(l);
+}
+
+/* caller holds lc->mu */
+static LayoutDir *
+lc_dir(LayoutCache *lc, const char *dir, size_t dlen)
+{
+	LayoutDir **bucket = &lc->tab[hash_mem(dir, dlen) % LC_BUCKETS];
+	LayoutDir *d;
+	for (d = *bucket; d; d = d->next)
+		if (d->dlen == dlen && memcmp(d->dir, dir, dlen) == 0)
+			break;
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%.*s/layout.html", (int)dlen, dir);
+	if (d && !lc->revalidate)
+		return d;
+
+	off_t size;
+	time_t mtime;
+	dep_stat(path, &size, &mtime);
+	if (d && d->size == size && d->mtime == mtime)
+		return d;
+
+	if (!d) {
+		d = calloc(1, sizeof(*d));
+		if (!d || !(d->dir = strndup(dir, dlen))) {
+			free(d);
+			return NULL;
+		}
+		d->dlen = dlen;
+		d->next = *bucket;
+		*bucket = d;
+	} else {
+		lc_unref(d->own); /* freed once no render holds it */
+	}
+	d->own = size >= 0 ? layout_compile(path) : NULL;
+	if (d->own)
+		d->own->refs = 1;
+	d->size = size;
+	d->mtime = mtime;
+	return d;
+}
+
+/* Layout for the page at src (NULL if none applies). deps, if given,
+ * receives every candidate layout.html so creating an override is seen.
+ * A revalidating cache may replace the layout meanwhile, so there the
+ * caller holds a reference until lc_release(). */
+static Layout *
+lc_for_page(LayoutCache *lc, const char *src, Deps *deps)
+{
+	Layout *l = NULL;
+	size_t rlen = strlen(lc->root);
+	const char *end = strrchr(src, '/');
+	size_t dlen = end ? (size_t)(end - src) : 0;
+
+	pthread_mutex_lock(&lc->mu);
+	for (;;) {
+		LayoutDir *d = lc_dir(lc, end ? src : ".", end ? dlen : 1);
+		if (deps && d) {
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/layout.html", d->dir);
+			(void)deps_add_stat(deps, path, d->size, d->mtime,
+			    d->own ? d->own->hash : 0);
+		}
+		if (d && d->own) {
+			l = d->own;
+			break;
+		}
+		/* stop at the root (or when src is not below it) */
+		if (!end || dlen <= rlen)
+			break;
+		while (dlen > 0 && src[dlen - 1] != '/')
+			dlen--;
+		if (dlen == 0)
+			break;
+		dlen--;
+	}
+	if (l && lc->revalidate)
+		l->refs++;
+	pthread_mutex_unlock(&lc->mu);
+	return l;
+}
+
+static void
+lc_release(LayoutCache *lc, Layout *l)
+{
+	if (!l || !lc->revalidate)
+		return;
+	pthread_mutex_lock(&lc->mu);
+	lc_unref(l);
+	pthread_mutex_unlock(&lc->mu);
+}
+
+/* Stream the page into s: layout text up to {{Body}}, the rendered
+ * Markdown, then the rest of the layout. */
+static int
+render_to_sink(Sink *s, const Layout *l, const PageVars *v, const char *md,
+    size_t mdlen, const MD_HTML_HOOKS *links)
+{
+	int rc = 0;
+	size_t nsegs = l ? l->nsegs : 1;
+	for (size_t i = 0; i < nsegs; i++) {
+		const Seg *sg = l ? &l->segs[i] : &(Seg){.k = SEG_BODY};
+		switch (sg->k) {
+		case SEG_TEXT:
+			sink_write(s, sg->p, sg->n);
+			break;
+		case SEG_BODY:
+			if (md_html_ex(md, (MD_SIZE)mdlen, md_cb, s,
+				MD_DIALECT_GITHUB, 0, links) != 0)
+				rc = -1;
+			break;
+		case SEG_TITLE:
+			sink_write(s, v->title, strlen(v->title));
+			break;
+		case SEG_PATH:
+			sink_write(s, v->path, strlen(v->path));
+			break;
+		case SEG_DATE:
+			sink_write(s, v->date, strlen(v->date));
+			break;
+		}
+	}
+	sink_flush(s);
+	return rc != 0 || s->err ? -1 : 0;
+}
+
+/* Search index (--search). While a page renders, md4c hands every text run
+ * to terms_text(), which counts the page's words; build_finish() merges the
+ * counts into DESTDIR/search.idx, an inverted index laid out to be mmap()ed
+ * and used in place, and writes the same postings as JSON shards under
+ * DESTDIR/search/ for sites served statically. Pages that were not
+ * re-rendered keep the postings of the previous index. Serve mode maps the
+ * file (--search-index) and answers /search?q= from it with BM25 scores,
+ * without reading any page. */
+
+#define SEARCH_NAME "search.idx"
+#define SEARCH_DIR "search" /* JSON shards */
+#define SEARCH_MAGIC "HUAPSX01"
+#define SEARCH_BOM 0x01020304u /* the file is in the writer's byte order */
+#define SEARCH_WORD_MIN 2
+#define SEARCH_WORD_MAX 32 /* longer runs are hashes and URLs */
+#define SEARCH_TITLE_BOOST 4 /* a title word counts this many times */
+#define SEARCH_NONE UINT32_MAX
+
+static int search_on;
+
+/* search.idx: an SxHdr, then ndocs SxDoc, nterms SxTerm sorted by word,
+ * npost (doc, tf) pairs of uint32_t grouped by term in doc order, and nstr
+ * bytes of NUL-terminated strings that the other parts address by offset.
+ * Every part starts 8-byte aligned. */
+typedef struct {
+	char magic[8];
+	uint32_t bom;
+	uint32_t ndocs, nterms, npost, nstr;
+	uint32_t pad;
+	double avgdl; /* mean words per page */
+} SxHdr;
+
+typedef struct {
+	uint32_t path; /* source, relative to the root */
+	uint32_t title;
+	uint32_t len; /* words */
+	uint32_t pad;
+	int64_t size, mtime; /* of the source, when indexed */
+} SxDoc;
+
+typedef struct {
+	uint32_t word, wlen;
+	uint32_t post, npost; /* pairs */
+} SxTerm;
+
+typedef void (*WordFn)(void *u, const char *w, size_t n);
+
+/* Runs of ASCII letters and digits, lowercased, and of non-ASCII bytes, so
+ * UTF-8 words stay whole (and keep their case). */
+static void
+search_words(const char *s, size_t n, WordFn fn, void *u)
+{
+	char w[SEARCH_WORD_MAX];
+	size_t wn = 0;
+	int over = 0;
+	for (size_t i = 0; i <= n; i++) {
+		unsigned char c = i < n ? (unsigned char)s[i] : ' ';
+		if (c >= 'A' && c <= 'Z')
+			c = (unsigned char)(c - 'A' + 'a');
+		if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+		    c >= 0x80) {
+			if (wn < sizeof(w))
+				w[wn++] = (char)c;
+			else
+				over = 1;
+			continue;
+		}
+		if (wn >= SEARCH_WORD_MIN && !over)
+			fn(u, w, wn);
+		wn = 0;
+		over = 0;
+	}
+}
+
+typedef struct {
+	const char *w;
+	uint32_t n, tf;
+} TermCount;
+
+/* the distinct words of one page, in a hash table in the job's arena */
+typedef struct {
+	Arena *a;
+	TermCount *v;
+	size_t cap, n; /* cap is a power of two */
+	uint32_t words; /* outside the title */
+	uint32_t boost; /* what one occurrence adds to tf */
+	int err;
+} Terms;
+
+static TermCount *
+terms_slot(TermCount *v, size_t cap, const char *w, size_t n)
+{
+	size_t mask = cap - 1;
+	for (size_t h = (size_t)hash_mem(w, n) & mask;; h = (h + 1) & mask)
+		if (!v[h].w || (v[h].n == n && memcmp(v[h].w, w, n) == 0))
+			return &v[h];
+}
+
+static void
+terms_add(void *u, const char *w, size_t n)
+{
+	Terms *t = u;
+	if (t->err)
+		return;
+	if (2 * (t->n + 1) > t->cap) {
+		size_t ncap = t->cap ? t->cap * 2 : 256;
+		TermCount *nv = arena_alloc(t->a, ncap * sizeof(*nv));
+		if (!nv) {
+			t->err = 1;
+			return;
+		}
+		memset(nv, 0, ncap * sizeof(*nv));
+		for (size_t i = 0; i < t->cap; i++)
+			if (t->v[i].w)
+				*terms_slot(nv, ncap, t->v[i].w, t->v[i].n) =
+				    t->v[i];
+		t->v = nv;
+		t->cap = ncap;
+	}
+	TermCount *e = terms_slot(t->v, t->cap, w, n);
+	if (!e->w) {
+		char *c = arena_alloc(t->a, n);
+		if (!c) {
+			t->err = 1;
+			return;
+		}
+		memcpy(c, w, n);
+		*e = (TermCount){c, (uint32_t)n, 0};
+		t->n++;
+	}
+	e->tf += t->boost;
+	if (t->boost == 1)
+		t->words++;
+}
+
+/* md4c text hook: prose and code count, raw HTML and entities do not */
+static void
+terms_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size, void *u)
+{
+	if (type == MD_TEXT_NORMAL || type == MD_TEXT_CODE ||
+	    type == MD_TEXT_LATEXMATH)
+		search_words(text, size, terms_add, u);
+}
+
+/* A rendered page's words, copied out of the arena in one block so it can
+ * wait for build_finish(). */
+typedef struct SearchDoc {
+	struct SearchDoc *next;
+	char *src, *title;
+	TermCount *t;
+	uint32_t len, nterms;
+	int64_t size, mtime;
+} SearchDoc;
+
+static SearchDoc *
+search_doc(const Terms *t, const char *src, const char *title,
+    const struct stat *st)
+{
+	size_t sl = strlen(src) + 1, tl = strlen(title) + 1;
+	size_t bytes = sizeof(SearchDoc) + t->n * sizeof(TermCount) + sl + tl;
+	for (size_t i = 0; i < t->cap; i++)
+		bytes += t->v[i].n;
+	SearchDoc *d = malloc(bytes);
+	if (!d)
+		return NULL;
+	*d = (SearchDoc){.len = t->words, .nterms = (uint32_t)t->n,
+		.size = st ? (int64_t)st->st_size : -1,
+		.mtime = st ? (int64_t)st->st_mtime : 0};
+	d->t = (TermCount *)(d + 1);
+	char *p = (char *)(d->t + t->n);
+	d->src = memcpy(p, src, sl);
+	d->title = memcpy(p + sl, title, tl);
+	p += sl + tl;
+	size_t k = 0;
+	for (size_t i = 0; i < t->cap; i++) {
+		if (!t->v[i].w)
+			continue;
+		d->t[k] = t->v[i];
+		d->t[k++].w = memcpy(p, t->v[i].w, t->v[i].n);
+		p += t->v[i].n;
+	}
+	return d;
+}
+
+/* A mapped search.idx. byrel, filled by sidx_paths() for build mode, finds
+ * a document by its path. */
+typedef struct {
+	char *map;
+	size_t len;
+	const SxHdr *h;
+	const SxDoc *docs;
+	const SxTerm *terms;
+	const uint32_t *post;
+	const char *str;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	uint32_t *byrel;
+	size_t mask;
+} SearchIdx;
+
+static void
+sidx_close(SearchIdx *x)
+{
+	if (x->map)
+		munmap(x->map, x->len);
+	free(x->byrel);
+	memset(x, 0, sizeof(*x));
+}
+
+static const char *
+sidx_str(const SearchIdx *x, uint32_t off)
+{
+	return x->str + off;
+}
+
+/* Map path. A missing, truncated or foreign file leaves x empty and returns
+ * -1; every offset is checked once here so lookups need not. */
+static int
+sidx_open(SearchIdx *x, const char *path)
+{
+	memset(x, 0, sizeof(*x));
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SxHdr)) {
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	x->map = p;
+	x->len = (size_t)st.st_size;
+	x->dev = st.st_dev;
+	x->ino = st.st_ino;
+	x->size = st.st_size;
+	x->mtime = st.st_mtime;
+
+	const SxHdr *h = p;
+	size_t off = sizeof(*h);
+	size_t need = off + (size_t)h->ndocs * sizeof(SxDoc) +
+	    (size_t)h->nterms * sizeof(SxTerm) + (size_t)h->npost * 8 + h->nstr;
+	if (memcmp(h->magic, SEARCH_MAGIC, 8) != 0 || h->bom != SEARCH_BOM ||
+	    need != x->len || h->nstr == 0)
+		goto bad;
+	x->h = h;
+	x->docs = (const SxDoc *)(x->map + off);
+	off += (size_t)h->ndocs * sizeof(SxDoc);
+	x->terms = (const SxTerm *)(x->map + off);
+	off += (size_t)h->nterms * sizeof(SxTerm);
+	x->post = (const uint32_t *)(x->map + off);
+	x->str = x->map + off + (size_t)h->npost * 8;
+	if (x->str[h->nstr - 1] != '\0')
+		goto bad;
+	for (uint32_t i = 0; i < h->ndocs; i++)
+		if (x->docs[i].path >= h->nstr || x->docs[i].title >= h->nstr)
+			goto bad;
+	for (uint32_t i = 0; i < h->nterms; i++) {
+		const SxTerm *t = &x->terms[i];
+		if (t->word >= h->nstr || t->wlen > h->nstr - t->word ||
+		    t->post > h->npost || t->npost > h->npost - t->post)
+			goto bad;
+	}
+	for (uint32_t i = 0; i < h->npost; i++)
+		if (x->post[2 * i] >= h->ndocs)
+			goto bad;
+	return 0;
+bad:
+	sidx_close(x);
+	return -1;
+}
+
+static int
+sidx_paths(SearchIdx *x)
+{
+	if (!x->h)
+		return 0;
+	size_t cap = 16;
+	while (cap < 2 * (size_t)x->h->ndocs)
+		cap *= 2;
+	x->byrel = malloc(cap * sizeof(*x->byrel));
+	if (!x->byrel)
+		return -1;
+	memset(x->byrel, 0xff, cap * sizeof(*x->byrel));
+	x->mask = cap - 1;
+	for (uint32_t i = 0; i < x->h->ndocs; i++) {
+		size_t h = hash_str(sidx_str(x, x->docs[i].path)) & x->mask;
+		while (x->byrel[h] != SEARCH_NONE)
+			h = (h + 1) & x->mask;
+		x->byrel[h] = i;
+	}
+	return 0;
+}
+
+/* the document for the source at rel, or SEARCH_NONE */
+static uint32_t
+sidx_doc(const SearchIdx *x, const char *rel)
+{
+	if (!x->byrel)
+		return SEARCH_NONE;
+	for (size_t h = hash_str(rel) & x->mask; x->byrel[h] != SEARCH_NONE;
+	     h = (h + 1) & x->mask)
+		if (strcmp(sidx_str(x, x->docs[x->byrel[h]].path), rel) == 0)
+			return x->byrel[h];
+	return SEARCH_NONE;
+}
+
+/* deps (optional) receives the page and every $code file it pulls in, and
+ * sd (optional) the page's words for the search index. Scratch memory comes
+ * from a, which the caller resets. md_render_src() is the part after the
+ * source is read; st is NULL if it could not be stat()ed. */
+static int
+md_render_src(Arena *a, Sink *s, const char *md_path, const char *mdsrc,
+    size_t mdlen, const struct stat *st, const char *out_path,
+    const Layout *layout, const char *route, Deps *deps, SearchDoc **sd)
+{
+	if (st)
+		(void)deps_add_stat(deps, md_path, st->st_size, st->st_mtime,
+		    hash_mem(mdsrc, mdlen));
+
+	PageVars v;
+	if (layout)
+		page_vars_init(&v, mdsrc, md_path, route,
+		    st ? st->st_mtime : 0);
+
+	uint64_t t0 = stats_now();
+	size_t plen;
+	char *prep = preprocess(a, mdsrc, strlen(mdsrc), deps, &plen);
+	if (!prep)
+		return -1;
+	stats_stage(ST_PREPROCESS, t0);
+
+	int rc = -1;
+	int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1) {
+		uint64_t w0 = stats_stage_total(ST_WRITE);
+		t0 = stats_now();
+		sink_open(s, fd, NULL);
+		Terms terms = {.a = a, .boost = 1};
+		MD_HTML_HOOKS links = build_links;
+		if (sd) {
+			links.text = terms_text;
+			links.text_userdata = &terms;
+		}
+		rc = render_to_sink(s, layout, &v, prep, plen, &links);
+		if (rc == 0 && sd) {
+			char title[512];
+			page_title(mdsrc, md_path, title, sizeof(title));
+			terms.boost = SEARCH_TITLE_BOOST;
+			search_words(title, strlen(title), terms_add, &terms);
+			if (!terms.err)
+				*sd = search_doc(&terms, md_path, title, st);
+		}
+		if (stats_on)
+			stats_stage_ns(ST_RENDER, stats_now() - t0 -
+				(stats_stage_total(ST_WRITE) - w0));
+		t0 = stats_now();
+		if (close(fd) != 0)
+			rc = -1;
+		if (rc == 0 && st && preserve_mode_mtime(out_path, st) == -1)
+			rc = -1;
+		stats_stage(ST_WRITE, t0);
+	}
+	return rc;
+}
+static int
+md_to_html_file(Arena *a, Sink *s, const char *md_path, const char *out_path,
+    const Layout *layout, const char *route, Deps *deps, SearchDoc **sd)
+{
+	uint64_t t0 = stats_now();
+	struct stat st;
+	int have_st = (stat(md_path, &st) == 0);
+
+	size_t mdlen;
+	char *mdsrc = read_file(a, md_path, &mdlen);
+	if (!mdsrc)
+		return -1;
+	stats_stage(ST_READ, t0);
+	stats_bytes(mdlen, 0);
+	return md_render_src(a, s, md_path, mdsrc, mdlen, have_st ? &st : NULL,
+	    out_path, layout, route, deps, sd);
+}
+
+/* Parallel build (thread pool) */
+
+typedef enum { JOB_COPY, JOB_MD, JOB_GZ, JOB_DIR } JobType;
+
+typedef struct Job {
+	JobType t;
+	char *src;
+	char *dst;
+	off_t weight;         /* source size, for scheduling */
+	const Layout *layout; /* JOB_MD; owned by the build's LayoutCache */
+	Deps deps;            /* inputs, for the manifest */
+	SearchDoc *sd;        /* JOB_MD with --search, once rendered */
+	CopyHow how;          /* JOB_COPY, once done */
+	int ok;
+	off_t out_size; /* of dst once written */
+	time_t out_mtime;
+	struct Job *all; /* every job of the pass but JOB_DIR ones */
+} Job;
+
+/* Every worker owns a deque. It pushes and pops at the bottom, newest
+ * first, so a directory's files are handled while they are hot; an idle
+ * worker steals the oldest job from someone else's top, which is where the
+ * subdirectories of a walk sit. Jobs for big sources bypass the deques for
+ * a shared heap, largest first, so one huge page starts early instead of
+ * becoming the tail of the build. */
+
+#define JQ_HEAVY (256 * 1024) /* source bytes that make a job heavy */
+
+typedef struct {
+	pthread_mutex_t mu;
+	Job **v; /* ring of cap slots */
+	size_t top, n, cap;
+} Deque;
+
+typedef struct {
+	Deque *dq;
+	int ndq;
+	size_t rr;    /* next deque for pushes from outside the pool */
+	size_t avail; /* queued jobs (atomic) */
+	size_t pending; /* pushed but not yet finished (atomic) */
+	pthread_mutex_t mu; /* the rest */
+	Job **heavy; /* max-heap by weight */
+	size_t nheavy, capheavy;
+	int sleepers;
+	int closed;
+	pthread_cond_t cv;
+	pthread_cond_t idle;
+} JobQ;
+
+/* index of the calling worker's deque, -1 outside the pool */
+static _Thread_local int jq_self = -1;
+
+static int
+dq_grow(Deque *d)
+{
+	size_t ncap = d->cap ? d->cap * 2 : 64;
+	Job **nv = malloc(ncap * sizeof(*nv));
+	if (!nv)
+		return -1;
+	for (size_t i = 0; i < d->n; i++)
+		nv[i] = d->v[(d->top + i) % d->cap];
+	free(d->v);
+	d->v = nv;
+	d->top = 0;
+	d->cap = ncap;
+	return 0;
+}
+
+static void
+jq_init(JobQ *q, int ndq)
+{
+	memset(q, 0, sizeof(*q));
+	q->dq = calloc((size_t)ndq, sizeof(*q->dq));
+	if (!q->dq) {
+		perror("calloc");
+		exit(1);
+	}
+	q->ndq = ndq;
+	for (int i = 0; i < ndq; i++)
+		pthread_mutex_init(&q->dq[i].mu, NULL);
+	pthread_mutex_init(&q->mu, NULL);
+	pthread_cond_init(&q->cv, NULL);
+	pthread_cond_init(&q->idle, NULL);
+}
+static void
+jq_free(JobQ *q)
+{
+	for (int i = 0; i < q->ndq; i++) {
+		free(q->dq[i].v);
+		pthread_mutex_destroy(&q->dq[i].mu);
+	}
+	free(q->dq);
+	free(q->heavy);
+	pthread_mutex_destroy(&q->mu);
+	pthread_cond_destroy(&q->cv);
+	pthread_cond_destroy(&q->idle);
+}
+static void
+jq_close(JobQ *q)
+{
+	pthread_mutex_lock(&q->mu);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cv);
+	pthread_mutex_unlock(&q->mu);
+}
+/* caller holds q->mu */
+static int
+jq_heavy_push(JobQ *q, Job *j)
+{
+	if (q->nheavy == q->capheavy) {
+		size_t ncap = q->capheavy ? q->capheavy * 2 : 16;
+		Job **nh = realloc(q->heavy, ncap * sizeof(*nh));
+		if (!nh)
+			return -1;
+		q->heavy = nh;
+		q->capheavy = ncap;
+	}
+	size_t i = q->nheavy;
+	__atomic_store_n(&q->nheavy, i + 1, __ATOMIC_RELAXED);
+	while (i > 0 && q->heavy[(i - 1) / 2]->weight < j->weight) {
+		q->heavy[i] = q->heavy[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	q->heavy[i] = j;
+	return 0;
+}
+/* caller holds q->mu */
+static Job *
+jq_heavy_pop(JobQ *q)
+{
+	if (!q->nheavy)
+		return NULL;
+	size_t n = q->nheavy - 1;
+	__atomic_store_n(&q->nheavy, n, __ATOMIC_RELAXED);
+	Job *top = q->heavy[0], *last = q->heavy[n];
+	size_t i = 0, c;
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n &&
+		    q->heavy[c + 1]->weight > q->heavy[c]->weight)
+			c++;
+		if (q->heavy[c]->weight <= last->weight)
+			break;
+		q->heavy[i] = q->heavy[c];
+		i = c;
+	}
+	q->heavy[i] = last;
+	return top;
+}
+static void
+jq_push(JobQ *q, Job *j)
+{
+	__atomic_add_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+	int queued = 0;
+	if (j->weight >= JQ_HEAVY) {
+		pthread_mutex_lock(&q->mu);
+		queued = jq_heavy_push(q, j) == 0;
+		pthread_mutex_unlock(&q->mu);
+	}
+	if (!queued) {
+		int self = jq_self >= 0
+		    ? jq_self
+		    : (int)(__atomic_fetch_add(&q->rr, 1, __ATOMIC_RELAXED) %
+			  (size_t)q->ndq);
+		Deque *d = &q->dq[self];
+		pthread_mutex_lock(&d->mu);
+		if (d->n == d->cap && dq_grow(d) != 0) {
+			perror("malloc");
+			exit(1);
+		}
+		d->v[(d->top + d->n++) % d->cap] = j;
+		pthread_mutex_unlock(&d->mu);
+	}
+	__atomic_add_fetch(&q->avail, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&q->mu);
+		pthread_cond_signal(&q->cv);
+		pthread_mutex_unlock(&q->mu);
+	}
+}
+/* heavy jobs first, then our own newest, then the oldest of another's */
+static Job *
+jq_take(JobQ *q, int self)
+{
+	Job *j = NULL;
+	if (__atomic_load_n(&q->nheavy, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&q->mu);
+		j = jq_heavy_pop(q);
+		pthread_mutex_unlock(&q->mu);
+	}
+	for (int i = 0; !j && i < q->ndq; i++) {
+		Deque *d = &q->dq[(self + i) % q->ndq];
+		pthread_mutex_lock(&d->mu);
+		if (d->n && i == 0) {
+			j = d->v[(d->top + --d->n) % d->cap];
+		} else if (d->n) {
+			j = d->v[d->top];
+			d->top = (d->top + 1) % d->cap;
+			d->n--;
+		}
+		pthread_mutex_unlock(&d->mu);
+	}
+	if (j)
+		__atomic_sub_fetch(&q->avail, 1, __ATOMIC_SEQ_CST);
+	return j;
+}
+/* NULL once the queue is closed and empty */
+static Job *
+jq_pop(JobQ *q, int self)
+{
+	for (;;) {
+		Job *j = jq_take(q, self);
+		if (j)
+			return j;
+		pthread_mutex_lock(&q->mu);
+		__atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&q->avail, __ATOMIC_SEQ_CST) &&
+		    !q->closed)
+			pthread_cond_wait(&q->cv, &q->mu);
+		__atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+		int done = q->closed &&
+		    !__atomic_load_n(&q->avail, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&q->mu);
+		if (done)
+			return NULL;
+	}
+}
+static void
+jq_done(JobQ *q)
+{
+	if (__atomic_sub_fetch(&q->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&q->mu);
+		pthread_cond_broadcast(&q->idle);
+		pthread_mutex_unlock(&q->mu);
+	}
+}
+/* wait until every pushed job has finished */
+static void
+jq_wait(JobQ *q)
+{
+	pthread_mutex_lock(&q->mu);
+	while (__atomic_load_n(&q->pending, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&q->idle, &q->mu);
+	pthread_mutex_unlock(&q->mu);
+}
+
+typedef struct Build Build;
+static void build_dir(Build *b, const char *dir);
+
+typedef struct {
+	JobQ *q;
+	Build *b; /* for JOB_DIR */
+	int id;   /* our deque */
+	const char *dstroot;
+	int gzip;  /* also write .gz siblings for text outputs */
+	int uring; /* batch small jobs through an io_uring */
+} WorkerCtx;
+
+/* the gzip sibling and output metadata of a job that ran */
+static void
+job_finish(WorkerCtx *ctx, Arena *a, Job *j, int ok)
+{
+	struct stat st;
+	if (ok && ctx->gzip && is_text_output(j->dst)) {
+		uint64_t t0 = stats_now();
+		if (write_gz_sibling(a, j->dst) != 0) {
+			fprintf(stderr, "gzip failed: %s (%s)\n", j->dst,
+			    strerror(errno));
+		}
+		stats_stage(ST_GZIP, t0);
+	}
+	if (ok && stat(j->dst, &st) == 0) {
+		j->out_size = st.st_size;
+		j->out_mtime = st.st_mtime;
+		j->ok = 1;
+	}
+}
+
+/* run j with blocking I/O */
+static void
+job_run(WorkerCtx *ctx, Arena *a, Sink *sink, Job *j)
+{
+	int ok = 1;
+	uint64_t t0 = stats_now();
+	if (j->t == JOB_COPY) {
+		if (copy_file(j->src, j->dst, &j->how) != 0) {
+			fprintf(stderr, "copy failed: %s -> %s (%s)\n", j->src,
+			    j->dst, strerror(errno));
+			ok = 0;
+		}
+		stats_stage(ST_COPY, t0);
+	} else if (j->t == JOB_MD) {
+		const char *route = j->dst + strlen(ctx->dstroot);
+		if (md_to_html_file(a, sink, j->src, j->dst, j->layout, route,
+			&j->deps, search_on ? &j->sd : NULL) != 0) {
+			fprintf(stderr, "render failed: %s -> %s (%s)\n", j->src,
+			    j->dst, strerror(errno));
+			ok = 0;
+		}
+	}
+	job_finish(ctx, a, j, ok);
+	if (j->t == JOB_COPY && j->ok)
+		stats_bytes((uint64_t)j->out_size, (uint64_t)j->out_size);
+	if (stats_on)
+		stats_file(j->src, stats_now() - t0);
+}
+
+#ifdef HAVE_IO_URING
+/* a job the ring takes: a copy or page small enough to read whole */
+static int
+job_batchable(const Job *j)
+{
+	return (j->t == JOB_COPY || j->t == JOB_MD) && j->weight < JQ_HEAVY;
+}
+
+typedef struct {
+	Job *j;
+	int in, out; /* -1 when not open */
+	int ok;
+	struct statx x;
+	char *buf; /* the source, NUL-terminated */
+	size_t len;
+} BatchEnt;
+
+/* Take the n jobs of batch through the ring; see "io_uring" above. Returns
+ * -1 if the ring broke, which leaves every job to the blocking path. */
+static int
+ring_batch(Ring *r, WorkerCtx *ctx, Arena *a, Sink *sink, Job **batch,
+    size_t n)
+{
+	BatchEnt e[URING_BATCH];
+	int res[URING_DEPTH];
+	int rc = 0;
+	uint64_t t0 = stats_now();
+
+	/* open and statx the sources */
+	for (size_t i = 0; i < n; i++) {
+		e[i] = (BatchEnt){.j = batch[i], .in = -1, .out = -1, .ok = 1};
+		res[2 * i] = res[2 * i + 1] = -ECANCELED;
+		ring_open(r, batch[i]->src, O_RDONLY, 2 * i);
+		ring_statx(r, batch[i]->src, &e[i].x, 2 * i + 1);
+	}
+	if (ring_run(r, res) != 0)
+		rc = -1;
+	for (size_t i = 0; i < n; i++) {
+		e[i].in = res[2 * i] >= 0 ? res[2 * i] : -1;
+		e[i].ok = rc == 0 && e[i].in >= 0 && res[2 * i + 1] == 0 &&
+		    e[i].x.stx_size < (uint64_t)MMAP_MIN;
+	}
+
+	/* read them; open the outputs of copies */
+	for (size_t i = 0; rc == 0 && i < n; i++) {
+		res[2 * i] = res[2 * i + 1] = -ECANCELED;
+		if (!e[i].ok)
+			continue;
+		e[i].len = (size_t)e[i].x.stx_size;
+		e[i].buf = arena_alloc(a, e[i].len + 1);
+		if (!e[i].buf) {
+			e[i].ok = 0;
+			continue;
+		}
+		if (e[i].len)
+			ring_rw(r, IORING_OP_READ, e[i].in, e[i].buf, e[i].len,
+			    2 * i);
+		else
+			res[2 * i] = 0;
+		if (e[i].j->t == JOB_COPY)
+			ring_open(r, e[i].j->dst,
+			    O_WRONLY | O_CREAT | O_TRUNC, 2 * i + 1);
+	}
+	if (rc == 0 && ring_run(r, res) != 0)
+		rc = -1;
+	for (size_t i = 0; rc == 0 && i < n; i++) {
+		if (!e[i].ok)
+			continue;
+		if (e[i].j->t == JOB_COPY)
+			e[i].out = res[2 * i + 1] >= 0 ? res[2 * i + 1] : -1;
+		e[i].ok = res[2 * i] == (int)e[i].len &&
+		    (e[i].j->t != JOB_COPY || e[i].out >= 0);
+		if (e[i].ok)
+			e[i].buf[e[i].len] = '\0';
+	}
+
+	/* write the copies; close the sources */
+	for (size_t i = 0; rc == 0 && i < n; i++) {
+		res[2 * i] = res[2 * i + 1] = -ECANCELED;
+		if (e[i].ok && e[i].j->t == JOB_COPY && e[i].len)
+			ring_rw(r, IORING_OP_WRITE, e[i].out, e[i].buf,
+			    e[i].len, 2 * i);
+		else
+			res[2 * i] = (int)e[i].len;
+		if (e[i].in >= 0)
+			ring_close(r, e[i].in, 2 * i + 1);
+		e[i].in = -1;
+	}
+	if (rc == 0 && ring_run(r, res) != 0)
+		rc = -1;
+	for (size_t i = 0; rc == 0 && i < n; i++)
+		if (res[2 * i] != (int)e[i].len)
+			e[i].ok = 0;
+
+	/* mode and mtime go by fd, then the outputs are closed */
+	for (size_t i = 0; rc == 0 && i < n; i++) {
+		res[i] = -ECANCELED;
+		if (e[i].out < 0)
+			continue;
+		if (e[i].ok) {
+			struct timespec ts[2] = {
+				{.tv_sec = (time_t)e[i].x.stx_atime.tv_sec},
+				{.tv_sec = (time_t)e[i].x.stx_mtime.tv_sec}};
+			e[i].ok = fchmod(e[i].out, e[i].x.stx_mode & 0777) == 0 &&
+			    futimens(e[i].out, ts) == 0;
+		}
+		ring_close(r, e[i].out, i);
+	}
+	if (rc == 0 && ring_run(r, res) != 0)
+		rc = -1;
+	for (size_t i = 0; rc == 0 && i < n; i++)
+		if (e[i].out >= 0 && res[i] != 0)
+			e[i].ok = 0;
+	if (rc != 0) {
+		/* the ring is gone; give back what it still held */
+		for (size_t i = 0; i < n; i++) {
+			if (e[i].in >= 0)
+				close(e[i].in);
+			if (e[i].out >= 0)
+				close(e[i].out);
+		}
+		return -1;
+	}
+
+	stats_stage(ST_RING, t0);
+
+	for (size_t i = 0; i < n; i++) {
+		Job *j = e[i].j;
+		if (!e[i].ok) {
+			job_run(ctx, a, sink, j);
+		} else if (j->t == JOB_COPY) {
+			j->how = CP_URING;
+			job_finish(ctx, a, j, 1);
+			stats_bytes(e[i].len, e[i].len);
+		} else {
+			struct stat st;
+			stat_from_statx(&st, &e[i].x);
+			const char *route = j->dst + strlen(ctx->dstroot);
+			stats_bytes(e[i].len, 0);
+			t0 = stats_now();
+			int ok = md_render_src(a, sink, j->src, e[i].buf,
+			    e[i].len, &st, j->dst, j->layout, route,
+			    &j->deps, search_on ? &j->sd : NULL) == 0;
+			if (!ok)
+				fprintf(stderr,
+				    "render failed: %s -> %s (%s)\n", j->src,
+				    j->dst, strerror(errno));
+			job_finish(ctx, a, j, ok);
+			if (stats_on)
+				stats_file(j->src, stats_now() - t0);
+		}
+	}
+	return 0;
+}
+#endif
+
+static void *
+worker_main(void *arg)
+{
+	WorkerCtx *ctx = arg;
+	jq_self = ctx->id;
+	Sink *sink = malloc(sizeof(*sink)); /* reused by every page */
+	if (!sink) {
+		perror("malloc");
+		exit(1);
+	}
+	Arena a; /* scratch for each job, reset after it */
+	arena_init(&a, ARENA_BLOCK);
+	Ring ring;
+	int have_ring = ctx->uring && ring_init(&ring) == 0;
+#ifdef HAVE_IO_URING
+	Job *batch[URING_BATCH]; /* waiting for the ring */
+#endif
+	size_t nbatch = 0;
+	for (;;) {
+		/* a batch goes through the ring once nothing else is queued */
+		Job *j = nbatch ? jq_take(ctx->q, ctx->id)
+				: jq_pop(ctx->q, ctx->id);
+		if (!j && !nbatch) {
+			/* closed + empty */
+			break;
+		}
+		if (j && j->t == JOB_DIR) {
+			build_dir(ctx->b, j->src);
+			free(j->src);
+			free(j);
+			jq_done(ctx->q);
+			continue;
+		}
+#ifdef HAVE_IO_URING
+		if (j && have_ring && job_batchable(j)) {
+			batch[nbatch++] = j;
+			if (nbatch < URING_BATCH)
+				continue;
+			j = NULL;
+		}
+		if (nbatch && !j) {
+			if (ring_batch(&ring, ctx, &a, sink, batch, nbatch) !=
+			    0) {
+				ring_free(&ring);
+				have_ring = 0;
+				for (size_t i = 0; i < nbatch; i++)
+					job_run(ctx, &a, sink, batch[i]);
+			}
+			arena_reset(&a);
+			for (size_t i = 0; i < nbatch; i++)
+				jq_done(ctx->q);
+			nbatch = 0;
+			continue;
+		}
+#endif
+		job_run(ctx, &a, sink, j);
+		arena_reset(&a);
+		jq_done(ctx->q);
+	}
+	if (have_ring)
+		ring_free(&ring);
+	arena_destroy(&a);
+	free(sink);
+	return NULL;
+}
+
+/* Build manifest: DESTDIR/.huap-manifest records, for every output, the
+ * inputs it was made from (the source, candidate layout.html files, $code
+ * files) with their size, mtime and content hash. The next build re-makes
+ * only outputs whose inputs differ; an input whose mtime moved but whose
+ * contents hash the same is not a change. Copied files are not hashed. */
+
+#define MANIFEST_NAME ".huap-manifest"
+#define MF_MAGIC "huapmf01"
+#define MF_HDR 16 /* magic, entry count, input count */
+#define MF_STAT_BUCKETS 4096
+#define MF_STAT_LOCKS 64 /* stripes over the buckets */
+
+typedef struct {
+	const char *path; /* points into Manifest.a */
+	off_t size;       /* -1 if the file did not exist */
+	time_t mtime;
+	uint64_t hash;
+} MfInput;
+
+typedef struct MfEntry {
+	const char *src;
+	JobType t; /* JOB_MD or JOB_COPY */
+	off_t out_size;
+	time_t out_mtime;
+	MfInput *in;
+	uint32_t nin;
+	int seen; /* looked at by the current pass */
+	struct MfEntry *hnext;
+} MfEntry;
+
+/* current metadata of every path looked at during this build */
+typedef struct StatEnt {
+	char *path;
+	off_t size;
+	time_t mtime;
+	uint64_t hash;
+	int hashed; /* flags are read and set atomically */
+	int queued; /* already handled as a source by this pass */
+	struct StatEnt *next;
+} StatEnt;
+
+typedef struct {
+	Arena a; /* raw file; strings are used in place */
+	MfEntry *ents;
+	size_t n;
+	MfInput *inputs;
+	MfEntry **tab;
+	size_t mask;
+	time_t saved; /* manifest mtime; inputs as new may have changed unseen */
+	StatEnt *stats[MF_STAT_BUCKETS];
+	pthread_mutex_t stat_mu[MF_STAT_LOCKS];
+} Manifest;
+
+static void
+mf_put32(Buf *b, uint32_t v)
+{
+	uint8_t p[4];
+	for (int i = 0; i < 4; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+	buf_putn(b, p, sizeof(p));
+}
+static void
+mf_put64(Buf *b, uint64_t v)
+{
+	uint8_t p[8];
+	for (int i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+	buf_putn(b, p, sizeof(p));
+}
+/* length, bytes and the NUL, so loaded strings need no copy */
+static void
+mf_putstr(Buf *b, const char *s)
+{
+	size_t n = strlen(s);
+	mf_put32(b, (uint32_t)n);
+	buf_putn(b, s, n + 1);
+}
+static void
+mf_put_input(Buf *b, const char *path, off_t size, time_t mtime,
+    uint64_t hash)
+{
+	mf_putstr(b, path);
+	mf_put64(b, (uint64_t)(int64_t)size);
+	mf_put64(b, (uint64_t)(int64_t)mtime);
+	mf_put64(b, hash);
+}
+static void
+mf_put_entry(Buf *b, const char *src, JobType t, off_t out_size,
+    time_t out_mtime, uint32_t nin)
+{
+	mf_putstr(b, src);
+	mf_put32(b, (uint32_t)t);
+	mf_put64(b, (uint64_t)(int64_t)out_size);
+	mf_put64(b, (uint64_t)(int64_t)out_mtime);
+	mf_put32(b, nin);
+}
+
+typedef struct {
+	const uint8_t *p, *end;
+	int err;
+} MfReader;
+
+static uint64_t
+mf_get(MfReader *r, int nbytes)
+{
+	uint64_t v = 0;
+	if (r->end - r->p < nbytes) {
+		r->err = 1;
+		return 0;
+	}
+	for (int i = 0; i < nbytes; i++)
+		v |= (uint64_t)r->p[i] << (8 * i);
+	r->p += nbytes;
+	return v;
+}
+static const char *
+mf_getstr(MfReader *r)
+{
+	size_t n = (size_t)mf_get(r, 4);
+	if (r->err || (size_t)(r->end - r->p) <= n || r->p[n] != '\0') {
+		r->err = 1;
+		return "";
+	}
+	const char *s = (const char *)r->p;
+	r->p += n + 1;
+	return s;
+}
+
+static int
+mf_parse(Manifest *m, const uint8_t *p, size_t len)
+{
+	MfReader r = {p + MF_HDR, p + len, 0};
+	if (len < MF_HDR || memcmp(p, MF_MAGIC, 8) != 0)
+		return -1;
+	MfReader h = {p + 8, p + MF_HDR, 0};
+	size_t n = (size_t)mf_get(&h, 4), nin = (size_t)mf_get(&h, 4);
+	/* every entry and input takes well over one byte */
+	if (n > len || nin > len)
+		return -1;
+	size_t nb = 16;
+	while (nb < n * 2)
+		nb *= 2;
+	m->ents = calloc(n ? n : 1, sizeof(*m->ents));
+	m->inputs = calloc(nin ? nin : 1, sizeof(*m->inputs));
+	m->tab = calloc(nb, sizeof(*m->tab));
+	if (!m->ents || !m->inputs || !m->tab)
+		return -1;
+	m->mask = nb - 1;
+
+	size_t used = 0;
+	for (size_t i = 0; i < n; i++) {
+		MfEntry *e = &m->ents[i];
+		e->src = mf_getstr(&r);
+		uint32_t t = (uint32_t)mf_get(&r, 4);
+		e->t = t == JOB_COPY ? JOB_COPY : JOB_MD;
+		e->out_size = (off_t)(int64_t)mf_get(&r, 8);
+		e->out_mtime = (time_t)(int64_t)mf_get(&r, 8);
+		e->nin = (uint32_t)mf_get(&r, 4);
+		if (r.err || (t != JOB_COPY && t != JOB_MD) ||
+		    e->nin > nin - used)
+			return -1;
+		e->in = &m->inputs[used];
+		used += e->nin;
+		for (uint32_t k = 0; k < e->nin; k++) {
+			e->in[k].path = mf_getstr(&r);
+			e->in[k].size = (off_t)(int64_t)mf_get(&r, 8);
+			e->in[k].mtime = (time_t)(int64_t)mf_get(&r, 8);
+			e->in[k].hash = mf_get(&r, 8);
+		}
+		if (r.err)
+			return -1;
+		MfEntry **b = &m->tab[hash_str(e->src) & m->mask];
+		e->hnext = *b;
+		*b = e;
+	}
+	m->n = n;
+	return 0;
+}
+
+static void
+mf_free(Manifest *m)
+{
+	for (size_t i = 0; i < MF_STAT_BUCKETS; i++) {
+		while (m->stats[i]) {
+			StatEnt *s = m->stats[i];
+			m->stats[i] = s->next;
+			free(s->path);
+			free(s);
+		}
+	}
+	free(m->ents);
+	free(m->inputs);
+	free(m->tab);
+	arena_destroy(&m->a);
+	for (size_t i = 0; i < MF_STAT_LOCKS; i++)
+		pthread_mutex_destroy(&m->stat_mu[i]);
+	memset(m, 0, sizeof(*m));
+}
+
+/* A missing or unreadable manifest leaves m empty: everything is rebuilt. */
+static void
+mf_load(Manifest *m, const char *dstroot)
+{
+	memset(m, 0, sizeof(*m));
+	for (size_t i = 0; i < MF_STAT_LOCKS; i++)
+		pthread_mutex_init(&m->stat_mu[i], NULL);
+	char *path = xjoin2(dstroot, MANIFEST_NAME);
+	struct stat st;
+	if (!path || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		free(path);
+		arena_init(&m->a, 64);
+		return;
+	}
+	arena_init(&m->a, (size_t)st.st_size + 64);
+	m->saved = st.st_mtime;
+	size_t len;
+	const char *raw = read_file(&m->a, path, &len);
+	if (!raw || mf_parse(m, (const uint8_t *)raw, len) != 0) {
+		fprintf(stderr, "ignoring unreadable manifest %s\n", path);
+		free(m->ents);
+		free(m->inputs);
+		free(m->tab);
+		m->ents = NULL;
+		m->inputs = NULL;
+		m->tab = NULL;
+		m->n = 0;
+	}
+	free(path);
+}
+
+static MfEntry *
+mf_find(const Manifest *m, const char *src)
+{
+	if (!m->n)
+		return NULL;
+	for (MfEntry *e = m->tab[hash_str(src) & m->mask]; e; e = e->hnext)
+		if (strcmp(e->src, src) == 0)
+			return e;
+	return NULL;
+}
+
+static StatEnt *
+mf_stat_find(StatEnt *s, const char *path)
+{
+	for (; s; s = s->next)
+		if (strcmp(s->path, path) == 0)
+			return s;
+	return NULL;
+}
+
+/* current metadata for path, stat()ed once per build; st seeds it from a
+ * stat the caller already has. Safe from any thread. */
+static StatEnt *
+mf_stat(Manifest *m, const char *path, const struct stat *st)
+{
+	size_t h = hash_str(path) % MF_STAT_BUCKETS;
+	StatEnt **b = &m->stats[h];
+	pthread_mutex_t *mu = &m->stat_mu[h % MF_STAT_LOCKS];
+	pthread_mutex_lock(mu);
+	StatEnt *s = mf_stat_find(*b, path);
+	pthread_mutex_unlock(mu);
+	if (s)
+		return s;
+
+	/* stat outside the lock; a racing thread's entry wins */
+	s = calloc(1, sizeof(*s));
+	if (!s || !(s->path = strdup(path))) {
+		free(s);
+		return NULL;
+	}
+	if (st) {
+		s->size = st->st_size;
+		s->mtime = st->st_mtime;
+	} else {
+		dep_stat(path, &s->size, &s->mtime);
+	}
+	pthread_mutex_lock(mu);
+	StatEnt *won = mf_stat_find(*b, path);
+	if (!won) {
+		s->next = *b;
+		*b = s;
+	}
+	pthread_mutex_unlock(mu);
+	if (won) {
+		free(s->path);
+		free(s);
+		return won;
+	}
+	return s;
+}
+
+static uint64_t
+mf_stat_hash(StatEnt *s)
+{
+	if (__atomic_load_n(&s->hashed, __ATOMIC_ACQUIRE))
+		return s->hash;
+	/* two threads may both hash the file; they store the same value */
+	uint64_t h = 0;
+	int fd = open(s->path, O_RDONLY);
+	if (fd != -1) {
+		uint8_t buf[64 * 1024];
+		ssize_t r;
+		h = HASH_INIT;
+		while ((r = read(fd, buf, sizeof(buf))) > 0)
+			h = hash_update(h, buf, (size_t)r);
+		close(fd);
+		if (r != 0)
+			h = 0;
+	}
+	__atomic_store_n(&s->hash, h, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->hashed, 1, __ATOMIC_RELEASE);
+	return h;
+}
+
+/* NULL if e's output at dst is current, else the reason it is not */
+static const char *
+mf_dirty(Manifest *m, const MfEntry *e, const char *dst, char *why,
+    size_t cap)
+{
+	struct stat st;
+	if (stat(dst, &st) != 0 || !S_ISREG(st.st_mode))
+		return "output missing";
+	if (st.st_size != e->out_size || st.st_mtime != e->out_mtime)
+		return "output modified";
+	for (uint32_t i = 0; i < e->nin; i++) {
+		const MfInput *in = &e->in[i];
+		StatEnt *cur = mf_stat(m, in->path, NULL);
+		if (!cur)
+			return "out of memory";
+		/* a write in the second the manifest was saved need not move
+		 * the mtime, so such an input is compared by contents */
+		int same_stat = cur->size == in->size && cur->mtime == in->mtime;
+		if (same_stat && cur->mtime < m->saved)
+			continue;
+		const char *what = "changed";
+		if (cur->size < 0)
+			what = "removed";
+		else if (in->size < 0)
+			what = "added";
+		else if (in->hash && cur->size == in->size &&
+		    mf_stat_hash(cur) == in->hash) {
+			/* the output carries its source's mtime, and {{Date}}
+			 * with it: a touched source is rendered again */
+			if (same_stat || strcmp(in->path, e->src) != 0)
+				continue;
+			what = "touched";
+		}
+		snprintf(why, cap, "%s %s", in->path, what);
+		return why;
+	}
+	return NULL;
+}
+
+/* copy an entry this pass did not look at */
+static void
+mf_put_old(Buf *b, const MfEntry *e)
+{
+	mf_put_entry(b, e->src, e->t, e->out_size, e->out_mtime, e->nin);
+	for (uint32_t i = 0; i < e->nin; i++)
+		mf_put_input(b, e->in[i].path, e->in[i].size, e->in[i].mtime,
+		    e->in[i].hash);
+}
+
+/* re-record a current entry with the metadata seen by mf_dirty() */
+static void
+mf_put_current(Manifest *m, Buf *b, const MfEntry *e)
+{
+	mf_put_entry(b, e->src, e->t, e->out_size, e->out_mtime, e->nin);
+	for (uint32_t i = 0; i < e->nin; i++) {
+		const MfInput *in = &e->in[i];
+		StatEnt *cur = mf_stat(m, in->path, NULL);
+		if (cur)
+			mf_put_input(b, in->path, cur->size, cur->mtime,
+			    __atomic_load_n(&cur->hashed, __ATOMIC_ACQUIRE)
+				? cur->hash
+				: in->hash);
+		else
+			mf_put_input(b, in->path, in->size, in->mtime,
+			    in->hash);
+	}
+}
+
+/* b starts with MF_HDR bytes of room; written atomically via rename() */
+static int
+mf_save(Buf *b, uint32_t n, uint32_t nin, const char *dstroot)
+{
+	if (!b->p || b->len < MF_HDR)
+		return -1;
+	memcpy(b->p, MF_MAGIC, 8);
+	for (int i = 0; i < 4; i++) {
+		b->p[8 + i] = (char)(uint8_t)(n >> (8 * i));
+		b->p[12 + i] = (char)(uint8_t)(nin >> (8 * i));
+	}
+	char *path = xjoin2(dstroot, MANIFEST_NAME);
+	char *tmp = xjoin2(dstroot, MANIFEST_NAME ".tmp");
+	int rc = -1;
+	int fd = tmp ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	if (fd != -1) {
+		rc = write_all(fd, b->p, b->len);
+		if (close(fd) != 0)
+			rc = -1;
+		if (rc == 0 && path && rename(tmp, path) != 0)
+			rc = -1;
+		if (rc != 0)
+			(void)unlink(tmp);
+	}
+	free(path);
+	free(tmp);
+	return rc;
+}
+
+/* Build traversal: directories are jobs too, so the workers walk subtrees
+ * in parallel and queue each dirty file as they find it. */
+
+typedef struct Watch Watch;
+static void watch_dir(Watch *w, const char *dir);
+
+/* A build: the worker pool and manifest, reused by every pass in watch
+ * mode. A pass queues whatever is dirty, then build_finish() waits for the
+ * workers and writes the manifest. */
+struct Build {
+	const char *srcroot;
+	const char *dstroot;
+	int explain;
+	int gzip;
+	dev_t dst_dev; /* DESTDIR is skipped if it lies inside the source */
+	ino_t dst_ino;
+	JobQ q;
+	WorkerCtx *wctx; /* one per worker */
+	pthread_t *ths;
+	int nthreads;
+	Manifest mf;
+	Watch *watch; /* directories are added to it as they are walked */
+
+	/* current pass; what follows lc is guarded by mu */
+	LayoutCache lc;
+	pthread_mutex_t mu;
+	Buf next; /* the manifest this pass leaves behind */
+	uint32_t nents, ninputs;
+	size_t nfiles, nmade;
+	size_t ncopied[CP_N]; /* assets, by the way they were copied */
+	uint64_t copied[CP_N]; /* bytes */
+	Job *all, **all_tail;
+	SearchIdx sidx; /* --search: the index the last pass left */
+	char **wrote;   /* outputs this pass rewrote, relative to dstroot */
+	size_t nwrote, capwrote;
+	int wrote_lost; /* one could not be recorded */
+};
+
+static void
+build_open(Build *b, const char *srcroot, const char *dstroot, int nthreads,
+    int gzip, int explain, int uring)
+{
+	memset(b, 0, sizeof(*b));
+	if (mkdir(dstroot, 0755) == -1 && errno != EEXIST) {
+		perror("mkdir dest");
+		exit(1);
+	}
+	struct stat st;
+	if (stat(dstroot, &st) == 0) {
+		b->dst_dev = st.st_dev;
+		b->dst_ino = st.st_ino;
+	}
+	b->srcroot = srcroot;
+	b->dstroot = dstroot;
+	b->explain = explain;
+	b->gzip = gzip;
+	pthread_mutex_init(&b->mu, NULL);
+
+	Ring probe;
+	if (uring && ring_init(&probe) != 0) {
+		fprintf(stderr, "io_uring unavailable, using blocking I/O\n");
+		uring = 0;
+	} else if (uring) {
+		ring_free(&probe);
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	jq_init(&b->q, nthreads);
+	b->nthreads = nthreads;
+	b->ths = calloc((size_t)nthreads, sizeof(*b->ths));
+	b->wctx = calloc((size_t)nthreads, sizeof(*b->wctx));
+	if (!b->ths || !b->wctx) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		b->wctx[i] = (WorkerCtx){.q = &b->q,
+		    .b = b,
+		    .id = i,
+		    .dstroot = dstroot,
+		    .gzip = gzip,
+		    .uring = uring};
+		if (pthread_create(&b->ths[i], NULL, worker_main,
+			&b->wctx[i]) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	mf_load(&b->mf, dstroot);
+}
+
+static void
+build_close(Build *b)
+{
+	jq_close(&b->q);
+	for (int i = 0; i < b->nthreads; i++)
+		pthread_join(b->ths[i], NULL);
+	free(b->ths);
+	free(b->wctx);
+	jq_free(&b->q);
+	pthread_mutex_destroy(&b->mu);
+	mf_free(&b->mf);
+	sidx_close(&b->sidx);
+	free(b->wrote);
+	includes_free();
+}
+
+/* path under dstroot was written in this pass. The bundle packs such a
+ * file again even when its size and mtime are what it had before: a page
+ * re-rendered for a new layout keeps both. build_finish() only, once the
+ * workers are done. */
+static void
+build_wrote(Build *b, const char *path)
+{
+	size_t n = strlen(b->dstroot);
+	const char *rel = strncmp(path, b->dstroot, n) == 0 ? path + n : path;
+	while (*rel == '/')
+		rel++;
+	if (b->nwrote == b->capwrote) {
+		size_t ncap = b->capwrote ? b->capwrote * 2 : 64;
+		char **nv = realloc(b->wrote, ncap * sizeof(*nv));
+		if (!nv) {
+			b->wrote_lost = 1;
+			return;
+		}
+		b->wrote = nv;
+		b->capwrote = ncap;
+	}
+	if (!(b->wrote[b->nwrote] = strdup(rel)))
+		b->wrote_lost = 1;
+	else
+		b->nwrote++;
+}
+
+static void
+build_begin(Build *b)
+{
+	/* layout.html files are compiled once per pass, on first use */
+	lc_init(&b->lc, b->srcroot, 0);
+	b->next = (Buf){0};
+	buf_putn(&b->next, MF_MAGIC "\0\0\0\0\0\0\0\0", MF_HDR);
+	b->nents = b->ninputs = 0;
+	b->nfiles = b->nmade = 0;
+	memset(b->ncopied, 0, sizeof(b->ncopied));
+	memset(b->copied, 0, sizeof(b->copied));
+	b->all = NULL;
+	b->all_tail = &b->all;
+	b->nwrote = 0;
+	b->wrote_lost = 0;
+	if (search_on) {
+		char *path = xjoin2(b->dstroot, SEARCH_NAME);
+		if (path && sidx_open(&b->sidx, path) == 0 &&
+		    sidx_paths(&b->sidx) != 0)
+			sidx_close(&b->sidx);
+		free(path);
+	}
+}
+
+/* Queue src (a regular file, st from lstat) if its output is not current.
+ * Called by the walking workers and, in watch mode, the main thread. */
+static void
+build_file(Build *b, const char *src, const struct stat *st)
+{
+	StatEnt *se = mf_stat(&b->mf, src, st);
+	if (se && __atomic_exchange_n(&se->queued, 1, __ATOMIC_RELAXED))
+		return;
+
+	const char *rel = src + strlen(b->srcroot);
+	if (*rel == '/')
+		rel++;
+	const char *name = strrchr(src, '/');
+	name = name ? name + 1 : src;
+	if (feed.url && strcmp(rel, FEED_NAME) == 0)
+		return; /* generated by feed_write() */
+
+	char *dst = xjoin2(b->dstroot, rel);
+	if (!dst) {
+		perror("malloc");
+		return;
+	}
+
+	/* ensure parent exists (cheap safety net) */
+	{
+		char *slash = strrchr(dst, '/');
+		if (slash) {
+			*slash = '\0';
+			if (mkdir_p(dst, 0755) == -1 && errno != EEXIST)
+				perror("mkdir_p");
+			*slash = '/';
+		}
+	}
+
+	JobType t = has_ext(name, ".md") ? JOB_MD : JOB_COPY;
+	if (t == JOB_MD) {
+		char *dst2 = md_to_html_ext(dst);
+		free(dst);
+		if (!dst2)
+			return;
+		dst = dst2;
+	}
+
+	pthread_mutex_lock(&b->mu);
+	b->nfiles++;
+	pthread_mutex_unlock(&b->mu);
+	MfEntry *old = mf_find(&b->mf, src);
+	char whybuf[4200];
+	const char *why = "new";
+	if (old) {
+		old->seen = 1;
+		if (old->t == t)
+			why = mf_dirty(&b->mf, old, dst, whybuf,
+			    sizeof(whybuf));
+	}
+	if (!why && t == JOB_MD && search_on) {
+		uint32_t d = sidx_doc(&b->sidx, rel);
+		if (d == SEARCH_NONE || b->sidx.docs[d].size != st->st_size ||
+		    b->sidx.docs[d].mtime != st->st_mtime)
+			why = "not in search index";
+	}
+	if (!why) {
+		pthread_mutex_lock(&b->mu);
+		mf_put_current(&b->mf, &b->next, old);
+		b->nents++;
+		b->ninputs += old->nin;
+		pthread_mutex_unlock(&b->mu);
+		/* output is current; only (re)compress if asked to */
+		if (!b->gzip || !is_text_output(dst) ||
+		    !needs_gz_sibling(dst)) {
+			stats_skipped();
+			free(dst);
+			return;
+		}
+		t = JOB_GZ;
+		why = "gzip sibling out of date";
+	}
+	if (b->explain)
+		printf("%s: %s\n", rel, why);
+
+	Job *j = calloc(1, sizeof(*j));
+	if (!j) {
+		perror("calloc");
+		free(dst);
+		return;
+	}
+
+	j->src = strdup(src);
+	if (!j->src) {
+		free(j);
+		free(dst);
+		return;
+	}
+	j->dst = dst;
+	j->t = t;
+	j->weight = st->st_size;
+	if (t == JOB_MD)
+		j->layout = lc_for_page(&b->lc, src, &j->deps);
+	else if (t == JOB_COPY)
+		(void)deps_add_stat(&j->deps, src, st->st_size, st->st_mtime,
+		    0);
+	pthread_mutex_lock(&b->mu);
+	*b->all_tail = j;
+	b->all_tail = &j->all;
+	pthread_mutex_unlock(&b->mu);
+
+	jq_push(&b->q, j);
+}
+
+/* walk root (srcroot or a directory below it) */
+typedef struct {
+	char *path;
+	struct stat st;
+} DirEnt;
+
+static int
+dirent_cmp(const void *a, const void *b)
+{
+	off_t x = ((const DirEnt *)a)->st.st_size;
+	off_t y = ((const DirEnt *)b)->st.st_size;
+	return (x > y) - (x < y);
+}
+
+/* queue a walk of dir */
+static void
+build_push_dir(Build *b, char *dir)
+{
+	Job *j = calloc(1, sizeof(*j));
+	if (!j) {
+		perror("calloc");
+		free(dir);
+		return;
+	}
+	j->t = JOB_DIR;
+	j->src = dir;
+	jq_push(&b->q, j);
+}
+
+/* One level of the walk: make dir's output directory, queue a walk of each
+ * subdirectory, then hand the regular files to build_file() smallest first,
+ * so that this worker, which pops newest first, starts on the biggest.
+ * Dot entries, symlinks and DESTDIR are skipped. */
+static void
+build_dir(Build *b, const char *dir)
+{
+	uint64_t t0 = stats_now();
+	/* the root itself has no output; a new subdirectory does */
+	if (strcmp(dir, b->srcroot) != 0) {
+		const char *rel = dir + strlen(b->srcroot);
+		if (*rel == '/')
+			rel++;
+		char *dst = xjoin2(b->dstroot, rel);
+		if (!dst)
+			perror("malloc");
+		else if (mkdir(dst, 0755) == -1 && errno != EEXIST)
+			perror("mkdir");
+		free(dst);
+	}
+	if (b->watch) {
+		pthread_mutex_lock(&b->mu);
+		watch_dir(b->watch, dir);
+		pthread_mutex_unlock(&b->mu);
+	}
+
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	DirEnt *files = NULL;
+	size_t n = 0, cap = 0;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		struct stat st;
+		if (de->d_name[0] == '.' ||
+		    fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) !=
+			0)
+			continue;
+		if (S_ISDIR(st.st_mode) &&
+		    (st.st_dev != b->dst_dev || st.st_ino != b->dst_ino)) {
+			char *sub = xjoin2(dir, de->d_name);
+			if (sub)
+				build_push_dir(b, sub);
+		} else if (S_ISREG(st.st_mode)) {
+			if (n == cap) {
+				size_t ncap = cap ? cap * 2 : 32;
+				DirEnt *nf = realloc(files, ncap * sizeof(*nf));
+				if (!nf)
+					break;
+				files = nf;
+				cap = ncap;
+			}
+			files[n].path = xjoin2(dir, de->d_name);
+			files[n].st = st;
+			if (files[n].path)
+				n++;
+		}
+	}
+	closedir(d);
+
+	qsort(files, n, sizeof(*files), dirent_cmp);
+	for (size_t i = 0; i < n; i++) {
+		build_file(b, files[i].path, &files[i].st);
+		free(files[i].path);
+	}
+	free(files);
+	stats_stage(ST_WALK, t0);
+}
+
+/* walk the tree at root on the workers and wait for it and every job it
+ * queues */
+static void
+build_walk(Build *b, const char *root)
+{
+	char *dir = strdup(root);
+	if (!dir) {
+		perror("strdup");
+		return;
+	}
+	build_push_dir(b, dir);
+	jq_wait(&b->q);
+}
+
+/* one line: how many assets each way copied, and their bytes */
+static void
+build_copy_summary(const Build *b)
+{
+	size_t n = 0;
+	uint64_t bytes = 0;
+	for (int h = 0; h < CP_N; h++) {
+		n += b->ncopied[h];
+		bytes += b->copied[h];
+	}
+	if (n == 0)
+		return;
+	printf("copied %zu files, %.1f MB:", n, (double)bytes / 1e6);
+	for (int h = 0; h < CP_N; h++) {
+		if (b->ncopied[h])
+			printf(" %s %zu (%.1f MB)", copy_how_names[h],
+			    b->ncopied[h], (double)b->copied[h] / 1e6);
+	}
+	printf("\n");
+}
+
+/* DESTDIR/rss.xml, rewritten only when its bytes change so the file keeps
+ * its mtime (and feed readers their cache) across builds with no new post */
+static void
+feed_write(Build *b)
+{
+	Buf x = {0};
+	char *path = xjoin2(b->dstroot, FEED_NAME);
+	if (!path || feed_render(&x) != 0 || !x.p) {
+		fprintf(stderr, "cannot generate %s/%s\n", b->dstroot, FEED_NAME);
+		goto out;
+	}
+	int w = write_replace(path, x.p, x.len);
+	if (w < 0) {
+		fprintf(stderr, "cannot write %s (%s)\n", path,
+		    strerror(errno));
+		goto out;
+	}
+	if (w && b->explain)
+		printf("%s: posts changed\n", FEED_NAME);
+	if (w)
+		build_wrote(b, path);
+	if (b->gzip && (w || needs_gz_sibling(path))) {
+		if (!w)
+			build_wrote(b, path);
+		Arena a;
+		arena_init(&a, ARENA_BLOCK);
+		if (write_gz_sibling(&a, path) != 0)
+			fprintf(stderr, "cannot write %s" GZ_EXT " (%s)\n",
+			    path, strerror(errno));
+		arena_destroy(&a);
+	}
+out:
+	free(x.p);
+	free(path);
+}
+
+/* search.idx and search/ for this pass: the pages rendered in it (snew)
+ * plus, from the previous index, every page that is still in the manifest
+ * and was not rendered again. Documents are ordered by path and postings by
+ * document, so an unchanged site gives the same bytes and the files keep
+ * their mtimes. */
+
+typedef struct {
+	const char *path; /* relative to the source root */
+	const char *title;
+	uint32_t len;
+	int64_t size, mtime;
+	uint32_t old; /* in b->sidx, or SEARCH_NONE */
+	const SearchDoc *sd;
+} SxBDoc;
+
+typedef struct {
+	const char *w;
+	uint32_t n;
+	uint64_t *post; /* doc << 32 | tf */
+	size_t np, cap;
+} SxBTerm;
+
+typedef struct {
+	SxBTerm *v;
+	size_t cap, n;
+	int err;
+} SxBTerms;
+
+static SxBTerm *
+sxb_slot(SxBTerm *v, size_t cap, const char *w, size_t n)
+{
+	size_t mask = cap - 1;
+	for (size_t h = (size_t)hash_mem(w, n) & mask;; h = (h + 1) & mask)
+		if (!v[h].w || (v[h].n == n && memcmp(v[h].w, w, n) == 0))
+			return &v[h];
+}
+
+static void
+sxb_add(SxBTerms *t, const char *w, size_t n, uint32_t doc, uint32_t tf)
+{
+	if (t->err)
+		return;
+	if (2 * (t->n + 1) > t->cap) {
+		size_t ncap = t->cap ? t->cap * 2 : 4096;
+		SxBTerm *nv = calloc(ncap, sizeof(*nv));
+		if (!nv) {
+			t->err = 1;
+			return;
+		}
+		for (size_t i = 0; i < t->cap; i++)
+			if (t->v[i].w)
+				*sxb_slot(nv, ncap, t->v[i].w, t->v[i].n) =
+				    t->v[i];
+		free(t->v);
+		t->v = nv;
+		t->cap = ncap;
+	}
+	SxBTerm *e = sxb_slot(t->v, t->cap, w, n);
+	if (!e->w) {
+		*e = (SxBTerm){.w = w, .n = (uint32_t)n};
+		t->n++;
+	}
+	if (e->np == e->cap) {
+		size_t ncap = e->cap ? e->cap * 2 : 4;
+		uint64_t *np = realloc(e->post, ncap * sizeof(*np));
+		if (!np) {
+			t->err = 1;
+			return;
+		}
+		e->post = np;
+		e->cap = ncap;
+	}
+	e->post[e->np++] = (uint64_t)doc << 32 | tf;
+}
+
+static int
+sxb_doc_cmp(const void *a, const void *b)
+{
+	return strcmp(((const SxBDoc *)a)->path, ((const SxBDoc *)b)->path);
+}
+static int
+sxb_term_cmp(const void *a, const void *b)
+{
+	const SxBTerm *x = *(SxBTerm *const *)a, *y = *(SxBTerm *const *)b;
+	int c = memcmp(x->w, y->w, x->n < y->n ? x->n : y->n);
+	return c ? c : (x->n > y->n) - (x->n < y->n);
+}
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* JSON string literal */
+static void
+json_str(Buf *b, const char *s, size_t n)
+{
+	buf_putn(b, "\"", 1);
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = (unsigned char)s[i];
+		if (c == '"' || c == '\\') {
+			char e[2] = {'\\', (char)c};
+			buf_putn(b, e, 2);
+		} else if (c < 0x20) {
+			char e[8];
+			snprintf(e, sizeof(e), "\\u%04x", c);
+			buf_puts(b, e);
+		} else {
+			buf_putn(b, s + i, 1);
+		}
+	}
+	buf_putn(b, "\"", 1);
+}
+
+/* The static form: search/docs.json holds {"avgdl":N,"docs":[[URL, TITLE,
+ * WORDS], ...]} and search/XX.json, for the words whose first byte is 0xXX,
+ * {"word":[DOC,TF,DOC,TF,...], ...} with DOC indexing docs. A client fetches
+ * docs.json and one shard per query word. */
+static void
+search_json(Build *b, const SxBDoc *docs, size_t ndocs, SxBTerm **terms,
+    size_t nterms, double avgdl)
+{
+	char *dir = xjoin2(b->dstroot, SEARCH_DIR), path[4096];
+	if (!dir || (mkdir(dir, 0755) == -1 && errno != EEXIST)) {
+		fprintf(stderr, "cannot create %s/%s\n", b->dstroot,
+		    SEARCH_DIR);
+		free(dir);
+		return;
+	}
+	char num[64];
+	Buf j = {0};
+	snprintf(num, sizeof(num), "{\"avgdl\":%.2f,\"docs\":[", avgdl);
+	buf_puts(&j, num);
+	for (size_t i = 0; i < ndocs; i++) {
+		char *url = md_to_html_ext(docs[i].path);
+		buf_puts(&j, i ? ",\n[" : "\n[");
+		json_str(&j, url ? url : "", url ? strlen(url) : 0);
+		buf_putn(&j, ",", 1);
+		json_str(&j, docs[i].title, strlen(docs[i].title));
+		snprintf(num, sizeof(num), ",%u]", docs[i].len);
+		buf_puts(&j, num);
+		free(url);
+	}
+	buf_puts(&j, "]}\n");
+	snprintf(path, sizeof(path), "%s/docs.json", dir);
+	int w = j.p ? write_replace(path, j.p, j.len) : -1;
+	if (w < 0)
+		fprintf(stderr, "cannot write %s\n", path);
+	else if (w)
+		build_wrote(b, path);
+
+	uint8_t made[256] = {0};
+	for (size_t i = 0; i < nterms;) {
+		unsigned char c = (unsigned char)terms[i]->w[0];
+		j.len = 0;
+		buf_putn(&j, "{", 1);
+		for (size_t k = i; i < nterms &&
+		     (unsigned char)terms[i]->w[0] == c; i++) {
+			const SxBTerm *t = terms[i];
+			buf_puts(&j, i > k ? ",\n" : "\n");
+			json_str(&j, t->w, t->n);
+			buf_puts(&j, ":[");
+			for (size_t p = 0; p < t->np; p++) {
+				snprintf(num, sizeof(num), "%s%u,%u",
+				    p ? "," : "", (uint32_t)(t->post[p] >> 32),
+				    (uint32_t)t->post[p]);
+				buf_puts(&j, num);
+			}
+			buf_putn(&j, "]", 1);
+		}
+		buf_puts(&j, "}\n");
+		snprintf(path, sizeof(path), "%s/%02x.json", dir, c);
+		w = j.p ? write_replace(path, j.p, j.len) : -1;
+		if (w < 0)
+			fprintf(stderr, "cannot write %s\n", path);
+		else if (w)
+			build_wrote(b, path);
+		made[c] = 1;
+	}
+	free(j.p);
+
+	/* shards for first bytes no word has any more */
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	while (d && (de = readdir(d))) {
+		unsigned c;
+		char tail[8];
+		if (strlen(de->d_name) == 7 &&
+		    sscanf(de->d_name, "%2x%7s", &c, tail) == 2 &&
+		    strcmp(tail, ".json") == 0 && !made[c & 0xff]) {
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			(void)unlink(path);
+		}
+	}
+	if (d)
+		closedir(d);
+	free(dir);
+}
+
+static void
+search_write(Build *b, SearchDoc *snew)
+{
+	const SearchIdx *x = &b->sidx;
+	uint32_t nold = x->h ? x->h->ndocs : 0;
+	size_t nnew = 0, ndocs = 0;
+	for (SearchDoc *d = snew; d; d = d->next)
+		nnew++;
+	SxBDoc *docs = malloc((nold + nnew + 1) * sizeof(*docs));
+	uint32_t *remap = malloc((nold + 1) * sizeof(*remap));
+	SxBTerms tt = {0};
+	SxBTerm **terms = NULL;
+	Buf out = {0}, str = {0};
+	char *path = xjoin2(b->dstroot, SEARCH_NAME);
+	if (!docs || !remap || !path)
+		goto fail;
+
+	/* remap[old] is SEARCH_NONE for pages rendered again */
+	for (uint32_t i = 0; i < nold; i++)
+		remap[i] = 0;
+	size_t rlen = strlen(b->srcroot);
+	for (SearchDoc *d = snew; d; d = d->next) {
+		const char *rel = d->src;
+		if (strncmp(rel, b->srcroot, rlen) == 0 && rel[rlen] == '/')
+			rel += rlen + 1;
+		uint32_t old = sidx_doc(x, rel);
+		if (old != SEARCH_NONE)
+			remap[old] = SEARCH_NONE;
+		docs[ndocs++] = (SxBDoc){rel, d->title, d->len, d->size,
+			d->mtime, SEARCH_NONE, d};
+	}
+	for (uint32_t i = 0; i < nold; i++) {
+		const SxDoc *o = &x->docs[i];
+		char src[4096];
+		snprintf(src, sizeof(src), "%s/%s", b->srcroot,
+		    sidx_str(x, o->path));
+		if (remap[i] == SEARCH_NONE || !mf_find(&b->mf, src))
+			continue;
+		docs[ndocs++] = (SxBDoc){sidx_str(x, o->path),
+			sidx_str(x, o->title), o->len, o->size, o->mtime, i,
+			NULL};
+	}
+	for (uint32_t i = 0; i < nold; i++)
+		remap[i] = SEARCH_NONE;
+	if (ndocs > 1)
+		qsort(docs, ndocs, sizeof(*docs), sxb_doc_cmp);
+
+	/* postings */
+	uint64_t words = 0;
+	for (uint32_t i = 0; i < ndocs; i++) {
+		words += docs[i].len;
+		if (docs[i].old != SEARCH_NONE) {
+			remap[docs[i].old] = i;
+			continue;
+		}
+		const SearchDoc *d = docs[i].sd;
+		for (uint32_t k = 0; k < d->nterms; k++)
+			sxb_add(&tt, d->t[k].w, d->t[k].n, i, d->t[k].tf);
+	}
+	for (uint32_t i = 0; x->h && i < x->h->nterms; i++) {
+		const SxTerm *t = &x->terms[i];
+		for (uint32_t k = 0; k < t->npost; k++) {
+			const uint32_t *p = &x->post[2 * ((size_t)t->post + k)];
+			if (remap[p[0]] != SEARCH_NONE)
+				sxb_add(&tt, sidx_str(x, t->word), t->wlen,
+				    remap[p[0]], p[1]);
+		}
+	}
+	if (tt.err || !(terms = malloc((tt.n + 1) * sizeof(*terms))))
+		goto fail;
+	size_t nterms = 0, npost = 0;
+	for (size_t i = 0; i < tt.cap; i++) {
+		if (!tt.v[i].w)
+			continue;
+		qsort(tt.v[i].post, tt.v[i].np, sizeof(uint64_t), u64_cmp);
+		npost += tt.v[i].np;
+		terms[nterms++] = &tt.v[i];
+	}
+	if (nterms > 1)
+		qsort(terms, nterms, sizeof(*terms), sxb_term_cmp);
+
+	/* the file */
+	double avgdl = ndocs ? (double)words / (double)ndocs : 0;
+	SxHdr h = {.bom = SEARCH_BOM, .ndocs = (uint32_t)ndocs,
+		.nterms = (uint32_t)nterms, .npost = (uint32_t)npost,
+		.avgdl = avgdl};
+	memcpy(h.magic, SEARCH_MAGIC, 8);
+	buf_putn(&str, "", 1);
+	buf_putn(&out, &h, sizeof(h)); /* again once nstr is known */
+	for (size_t i = 0; i < ndocs; i++) {
+		SxDoc d = {.path = (uint32_t)str.len, .len = docs[i].len,
+			.size = docs[i].size, .mtime = docs[i].mtime};
+		buf_putn(&str, docs[i].path, strlen(docs[i].path) + 1);
+		d.title = (uint32_t)str.len;
+		buf_putn(&str, docs[i].title, strlen(docs[i].title) + 1);
+		buf_putn(&out, &d, sizeof(d));
+	}
+	uint32_t at = 0;
+	for (size_t i = 0; i < nterms; i++) {
+		SxTerm t = {(uint32_t)str.len, terms[i]->n, at,
+			(uint32_t)terms[i]->np};
+		buf_putn(&str, terms[i]->w, terms[i]->n);
+		buf_putn(&str, "", 1);
+		buf_putn(&out, &t, sizeof(t));
+		at += t.npost;
+	}
+	for (size_t i = 0; i < nterms; i++) {
+		for (size_t k = 0; k < terms[i]->np; k++) {
+			uint32_t p[2] = {(uint32_t)(terms[i]->post[k] >> 32),
+				(uint32_t)terms[i]->post[k]};
+			buf_putn(&out, p, sizeof(p));
+		}
+	}
+	if (!str.p)
+		goto fail;
+	buf_putn(&out, str.p, str.len);
+	if (!out.p)
+		goto fail;
+	h.nstr = (uint32_t)str.len;
+	memcpy(out.p, &h, sizeof(h));
+	int w = write_replace(path, out.p, out.len);
+	if (w < 0)
+		goto fail;
+	if (w && b->explain)
+		printf("%s: %zu pages, %zu words\n", SEARCH_NAME, ndocs,
+		    nterms);
+	search_json(b, docs, ndocs, terms, nterms, avgdl);
+	goto out;
+fail:
+	fprintf(stderr, "cannot write %s/%s (%s)\n", b->dstroot, SEARCH_NAME,
+	    strerror(errno));
+out:
+	for (size_t i = 0; i < tt.cap; i++)
+		free(tt.v[i].post);
+	free(tt.v);
+	free(terms);
+	free(out.p);
+	free(str.p);
+	free(docs);
+	free(remap);
+	free(path);
+	while (snew) {
+		SearchDoc *d = snew;
+		snew = d->next;
+		free(d);
+	}
+	sidx_close(&b->sidx);
+}
+
+/* Site bundle (--bundle FILE). build_finish() packs DESTDIR into one file
+ * that serve mode maps and answers from without touching the file system:
+ * a header page, every body at a page boundary (and its -z .gz sibling as a
+ * second body), then entries sorted by path and a string table with each
+ * response's header block, ready to send. Bodies of outputs unchanged since
+ * the last pass are copied from the old bundle rather than read again, and
+ * a pass that changed nothing leaves the file alone. */
+
+#define BUNDLE_MAGIC "HUAPBN01"
+#define BUNDLE_BOM 0x01020304u
+#define BUNDLE_PAGE 4096
+
+static const char *bundle_path;
+
+typedef struct {
+	char magic[8];
+	uint32_t bom;
+	uint32_t n;
+	uint64_t ents; /* n BnEnt */
+	uint64_t str;  /* nstr bytes of strings, to the end of the file */
+	uint64_t nstr;
+} BnHdr;
+
+typedef struct {
+	uint32_t path; /* relative to DESTDIR */
+	uint32_t hdr, hlen;   /* status line and headers of the 200 */
+	uint32_t zhdr, zhlen; /* the same for the gzip body, 0 if none */
+	uint32_t pad;
+	uint64_t body, len;
+	uint64_t gz, gzlen;
+	uint64_t tag; /* of the body */
+	int64_t mtime, gzmtime;
+} BnEnt;
+
+/* A mapped bundle; refs counts the connections still sending from it. */
+typedef struct {
+	char *map;
+	size_t len;
+	const BnHdr *h;
+	const BnEnt *ents;
+	const char *str;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	unsigned long refs;
+} Bundle;
+
+static void
+bnd_close(Bundle *bd)
+{
+	if (bd->map)
+		munmap(bd->map, bd->len);
+	memset(bd, 0, sizeof(*bd));
+}
+
+static const char *
+bnd_str(const Bundle *bd, uint32_t off)
+{
+	return bd->str + off;
+}
+
+/* Map path, checked once like sidx_open() so lookups need not be. */
+static int
+bnd_open(Bundle *bd, const char *path)
+{
+	memset(bd, 0, sizeof(*bd));
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < BUNDLE_PAGE) {
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	bd->map = p;
+	bd->len = (size_t)st.st_size;
+	bd->dev = st.st_dev;
+	bd->ino = st.st_ino;
+	bd->size = st.st_size;
+	bd->mtime = st.st_mtime;
+
+	const BnHdr *h = p;
+	if (memcmp(h->magic, BUNDLE_MAGIC, 8) != 0 || h->bom != BUNDLE_BOM ||
+	    h->ents % 8 != 0 || h->ents > bd->len ||
+	    (bd->len - h->ents) / sizeof(BnEnt) < h->n ||
+	    h->str != h->ents + (uint64_t)h->n * sizeof(BnEnt) ||
+	    h->nstr == 0 || h->nstr != bd->len - h->str)
+		goto bad;
+	bd->h = h;
+	bd->ents = (const BnEnt *)(bd->map + h->ents);
+	bd->str = bd->map + h->str;
+	if (bd->str[h->nstr - 1] != '\0')
+		goto bad;
+	for (uint32_t i = 0; i < h->n; i++) {
+		const BnEnt *e = &bd->ents[i];
+		if (e->path >= h->nstr || e->hdr >= h->nstr ||
+		    e->hlen > h->nstr - e->hdr || e->zhdr >= h->nstr ||
+		    e->zhlen > h->nstr - e->zhdr || e->body > h->ents ||
+		    e->len > h->ents - e->body || e->gz > h->ents ||
+		    e->gzlen > h->ents - e->gz)
+			goto bad;
+		if (i && strcmp(bnd_str(bd, bd->ents[i - 1].path),
+			     bnd_str(bd, e->path)) >= 0)
+			goto bad;
+	}
+	return 0;
+bad:
+	bnd_close(bd);
+	return -1;
+}
+
+static const BnEnt *
+bnd_find(const Bundle *bd, const char *rel)
+{
+	size_t lo = 0, hi = bd->h ? bd->h->n : 0;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(bnd_str(bd, bd->ents[mid].path), rel);
+		if (c == 0)
+			return &bd->ents[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* Content-Type by extension, for the bundle, the asset cache and, through
+ * mime_list(), mg_http_serve_dir(), so a file is labelled the same however
+ * it is served. Every type mongoose knows is here too, with the same
+ * fallback, so its built-in table never decides alone. */
+static const char *const mime_types[][2] = {
+	{".html", "text/html; charset=utf-8"},
+	{".htm", "text/html; charset=utf-8"},
+	{".shtml", "text/html; charset=utf-8"},
+	{".css", "text/css; charset=utf-8"},
+	{".js", "text/javascript; charset=utf-8"},
+	{".mjs", "text/javascript; charset=utf-8"},
+	{".json", "application/json"},
+	{".xml", "application/xml"},
+	{".txt", "text/plain; charset=utf-8"},
+	{".csv", "text/csv"},
+	{".svg", "image/svg+xml"},
+	{".png", "image/png"},
+	{".jpg", "image/jpeg"},
+	{".jpeg", "image/jpeg"},
+	{".gif", "image/gif"},
+	{".webp", "image/webp"},
+	{".ico", "image/x-icon"},
+	{".woff", "font/woff"},
+	{".woff2", "font/woff2"},
+	{".ttf", "font/ttf"},
+	{".pdf", "application/pdf"},
+	{".doc", "application/msword"},
+	{".wasm", "application/wasm"},
+	{".zip", "application/zip"},
+	{".gz", "application/gzip"},
+	{".tgz", "application/tar-gz"},
+	{".exe", "application/octet-stream"},
+	{".mp3", "audio/mpeg"},
+	{".wav", "audio/wav"},
+	{".mp4", "video/mp4"},
+	{".mpeg", "video/mpeg"},
+	{".mov", "video/quicktime"},
+	{".avi", "video/x-msvideo"},
+	{".3gp", "video/3gpp"},
+};
+#define MIME_DEFAULT "text/plain; charset=utf-8" /* as mongoose's */
+
+static const char *
+mime_type(const char *path)
+{
+	for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++)
+		if (has_ext(path, mime_types[i][0]))
+			return mime_types[i][1];
+	return MIME_DEFAULT;
+}
+
+/* mime_types as mg_http_serve_opts.mime_types, "ext=type,...". No "*="
+ * entry: that would shadow mongoose's own table for anything not listed. */
+static const char *
+mime_list(void)
+{
+	static char list[2048];
+	if (!list[0]) {
+		size_t n = 0;
+		for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]);
+		     i++)
+			n += (size_t)snprintf(list + n, sizeof(list) - n, "%s%s=%s",
+			    i ? "," : "", mime_types[i][0] + 1, mime_types[i][1]);
+	}
+	return list;
+}
+
+/* ETag, Last-Modified and Cache-Control lines; the gzip body is a
+ * different representation, so it gets its own tag. Serve mode's
+ * val_headers() writes the same lines. */
+static void
+http_validators(uint64_t tag, time_t mtime, int gz, char *out, size_t cap)
+{
+	struct tm tm;
+	char date[64];
+	if (!gmtime_r(&mtime, &tm) ||
+	    !strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+		*out = '\0';
+		return;
+	}
+	snprintf(out, cap,
+	    "ETag: \"%016llx%s\"\r\n"
+	    "Last-Modified: %s\r\n"
+	    "Cache-Control: no-cache\r\n",
+	    (unsigned long long)tag, gz ? "-gz" : "", date);
+}
+
+/* one output file found by bnd_walk() */
+typedef struct {
+	char *rel;
+	struct stat st;
+	struct stat zst; /* of rel.gz; st_size is -1 if there is none */
+	int merged;      /* this is the .gz of another file */
+	int wrote;       /* the pass rewrote it: nothing old is current */
+} BnFile;
+
+typedef struct {
+	BnFile *v;
+	size_t n, cap;
+	dev_t skip_dev; /* the bundle itself, when it is inside DESTDIR */
+	ino_t skip_ino;
+} BnFiles;
+
+static int
+bnd_file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const BnFile *)a)->rel, ((const BnFile *)b)->rel);
+}
+
+static int
+str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Every regular file under root/rel but dot files, leftover .tmp files and
+ * search.idx, which only serve mode reads. */
+static void
+bnd_walk(BnFiles *fs, const char *root, const char *rel)
+{
+	char *dir = *rel ? xjoin2(root, rel) : strdup(root);
+	DIR *d = dir ? opendir(dir) : NULL;
+	free(dir);
+	if (!d)
+		return;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		struct stat st;
+		if (de->d_name[0] == '.' || has_ext(de->d_name, ".tmp") ||
+		    (!*rel && strcmp(de->d_name, SEARCH_NAME) == 0) ||
+		    fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) !=
+			0)
+			continue;
+		char *sub = *rel ? xjoin2(rel, de->d_name) : strdup(de->d_name);
+		if (!sub)
+			break;
+		if (S_ISDIR(st.st_mode)) {
+			bnd_walk(fs, root, sub);
+		} else if (S_ISREG(st.st_mode) &&
+		    (st.st_dev != fs->skip_dev || st.st_ino != fs->skip_ino)) {
+			if (fs->n == fs->cap) {
+				size_t ncap = fs->cap ? fs->cap * 2 : 256;
+				BnFile *nv = realloc(fs->v, ncap * sizeof(*nv));
+				if (!nv) {
+					free(sub);
+					break;
+				}
+				fs->v = nv;
+				fs->cap = ncap;
+			}
+			fs->v[fs->n] = (BnFile){.rel = sub, .st = st};
+			fs->v[fs->n++].zst.st_size = -1;
+			continue;
+		}
+		free(sub);
+	}
+	closedir(d);
+}
+
+/* write n bytes at *off, then move *off to the next page */
+static int
+bnd_put(int fd, uint64_t *off, const void *p, size_t n)
+{
+	if (n && (lseek(fd, (off_t)*off, SEEK_SET) == -1 ||
+		     write_all(fd, p, n) != 0))
+		return -1;
+	*off = ALIGN_UP(*off + n, (uint64_t)BUNDLE_PAGE);
+	return 0;
+}
+
+/* whether the old bundle still holds f's body (gz: its gzip body). Size
+ * and mtime only vouch for files the pass did not write. */
+static int
+bnd_current(const BnEnt *oe, const BnFile *f, int gz)
+{
+	if (!oe || f->wrote)
+		return 0;
+	if (gz)
+		return oe->zhlen && oe->gzlen == (uint64_t)f->zst.st_size &&
+		    oe->gzmtime == (int64_t)f->zst.st_mtime;
+	return oe->len == (uint64_t)f->st.st_size &&
+	    oe->mtime == (int64_t)f->st.st_mtime &&
+	    !oe->zhlen == (f->zst.st_size < 0);
+}
+
+/* one body of f: from the old bundle if it is current there, else read */
+static int
+bnd_body(Build *b, Arena *a, const Bundle *old, const BnEnt *oe, int gz,
+    const BnFile *f, int fd, uint64_t *off, BnEnt *e, int *fresh)
+{
+	const struct stat *st = gz ? &f->zst : &f->st;
+	const char *p = NULL;
+	size_t n = 0;
+	if (bnd_current(oe, f, gz)) {
+		p = old->map + (gz ? oe->gz : oe->body);
+		n = (size_t)st->st_size;
+		if (!gz)
+			e->tag = oe->tag;
+	} else {
+		char *path = xjoin2(b->dstroot, f->rel);
+		char gzp[4096];
+		if (!path)
+			return -1;
+		if (snprintf(gzp, sizeof(gzp), "%s" GZ_EXT, path) >=
+		    (int)sizeof(gzp)) {
+			free(path);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		arena_reset(a);
+		p = read_file(a, gz ? gzp : path, &n);
+		free(path);
+		if (!p)
+			return -1;
+		if (!gz)
+			e->tag = hash_mem(p, n);
+		*fresh = 1;
+	}
+	if (gz) {
+		e->gz = *off;
+		e->gzlen = n;
+		e->gzmtime = (int64_t)st->st_mtime;
+	} else {
+		e->body = *off;
+		e->len = n;
+		e->mtime = (int64_t)st->st_mtime;
+	}
+	return bnd_put(fd, off, p, n);
+}
+
+/* the 200 header block of one body */
+static void
+bnd_headers(Buf *str, const BnEnt *e, const char *rel, int gz)
+{
+	char vh[256], hdr[512];
+	http_validators(e->tag, (time_t)e->mtime, gz, vh, sizeof(vh));
+	snprintf(hdr, sizeof(hdr),
+	    "HTTP/1.1 200 OK\r\n"
+	    "Content-Type: %s\r\n"
+	    "Vary: Accept-Encoding\r\n"
+	    "%s%s"
+	    "Content-Length: %llu\r\n\r\n",
+	    mime_type(rel), gz ? "Content-Encoding: gzip\r\n" : "", vh,
+	    (unsigned long long)(gz ? e->gzlen : e->len));
+	buf_putn(str, hdr, strlen(hdr) + 1);
+}
+
+static void
+bundle_write(Build *b)
+{
+	BnFiles fs = {0};
+	struct stat bst;
+	if (stat(bundle_path, &bst) == 0) {
+		fs.skip_dev = bst.st_dev;
+		fs.skip_ino = bst.st_ino;
+	}
+	bnd_walk(&fs, b->dstroot, "");
+	if (fs.n > 1)
+		qsort(fs.v, fs.n, sizeof(*fs.v), bnd_file_cmp);
+
+	/* FILE.gz from -z becomes the gzip body of FILE */
+	for (size_t i = 0; i < fs.n; i++) {
+		BnFile *f = &fs.v[i], key;
+		size_t rl = strlen(f->rel);
+		if (!has_ext(f->rel, GZ_EXT) ||
+		    !(key.rel = strndup(f->rel, rl - strlen(GZ_EXT))))
+			continue;
+		BnFile *base = bsearch(&key, fs.v, fs.n, sizeof(*fs.v),
+		    bnd_file_cmp);
+		free(key.rel);
+		if (base) {
+			base->zst = f->st;
+			f->merged = 1;
+		}
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < fs.n; i++) {
+		if (fs.v[i].merged)
+			free(fs.v[i].rel);
+		else
+			fs.v[n++] = fs.v[i];
+	}
+	fs.n = n;
+
+	if (b->nwrote > 1)
+		qsort(b->wrote, b->nwrote, sizeof(*b->wrote), str_cmp);
+	for (size_t i = 0; i < fs.n; i++)
+		fs.v[i].wrote = b->wrote_lost ||
+		    bsearch(&fs.v[i].rel, b->wrote, b->nwrote,
+			sizeof(*b->wrote), str_cmp) != NULL;
+
+	/* nothing new: keep the file and its mtime */
+	Bundle old;
+	bnd_open(&old, bundle_path);
+	int same = old.h && old.h->n == fs.n;
+	for (size_t i = 0; same && i < fs.n; i++) {
+		const BnEnt *oe = bnd_find(&old, fs.v[i].rel);
+		same = bnd_current(oe, &fs.v[i], 0) &&
+		    (fs.v[i].zst.st_size < 0 || bnd_current(oe, &fs.v[i], 1));
+	}
+
+	char tmp[4096];
+	Arena a;
+	arena_init(&a, 4096);
+	BnEnt *ents = calloc(fs.n + 1, sizeof(*ents));
+	Buf str = {0};
+	size_t nfresh = 0;
+	int fd = -1, made = 0, rc = -1;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", bundle_path) >=
+	    (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+	if (same) {
+		rc = 0;
+		goto out;
+	}
+	if (!ents || (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		goto out;
+	made = 1;
+
+	uint64_t off = BUNDLE_PAGE;
+	buf_putn(&str, "", 1);
+	for (size_t i = 0; i < fs.n; i++) {
+		const BnFile *f = &fs.v[i];
+		const BnEnt *oe = bnd_find(&old, f->rel);
+		BnEnt *e = &ents[i];
+		int fresh = 0;
+		if (bnd_body(b, &a, &old, oe, 0, f, fd, &off, e, &fresh) != 0 ||
+		    (f->zst.st_size >= 0 &&
+			bnd_body(b, &a, &old, oe, 1, f, fd, &off, e, &fresh) !=
+			    0))
+			goto out;
+		if (fresh || !oe)
+			nfresh++;
+		e->path = (uint32_t)str.len;
+		buf_putn(&str, f->rel, strlen(f->rel) + 1);
+		e->hdr = (uint32_t)str.len;
+		bnd_headers(&str, e, f->rel, 0);
+		e->hlen = (uint32_t)(str.len - e->hdr - 1);
+		if (f->zst.st_size >= 0) {
+			e->zhdr = (uint32_t)str.len;
+			bnd_headers(&str, e, f->rel, 1);
+			e->zhlen = (uint32_t)(str.len - e->zhdr - 1);
+		}
+	}
+	if (!str.p)
+		goto out;
+
+	BnHdr h = {.bom = BUNDLE_BOM, .n = (uint32_t)fs.n, .ents = off,
+		.str = off + fs.n * sizeof(*ents), .nstr = str.len};
+	memcpy(h.magic, BUNDLE_MAGIC, 8);
+	if (lseek(fd, (off_t)off, SEEK_SET) == -1 ||
+	    write_all(fd, ents, fs.n * sizeof(*ents)) != 0 ||
+	    write_all(fd, str.p, str.len) != 0 ||
+	    lseek(fd, 0, SEEK_SET) == -1 || write_all(fd, &h, sizeof(h)) != 0)
+		goto out;
+	rc = close(fd);
+	fd = -1;
+	if (rc == 0)
+		rc = rename(tmp, bundle_path);
+	if (rc == 0 && b->explain)
+		printf("%s: %zu files, %zu packed again\n", bundle_path, fs.n,
+		    nfresh);
+out:
+	if (fd != -1)
+		close(fd);
+	if (rc != 0) {
+		fprintf(stderr, "cannot write %s (%s)\n", bundle_path,
+		    strerror(errno));
+	}
+	if (rc != 0 && made)
+		(void)unlink(tmp);
+	bnd_close(&old);
+	arena_destroy(&a);
+	free(str.p);
+	free(ents);
+	for (size_t i = 0; i < fs.n; i++)
+		free(fs.v[i].rel);
+	free(fs.v);
+}
+
+/* Wait for the pass's jobs and write the manifest. Entries the pass never
+ * looked at are dropped after a full walk (their source is gone) and kept
+ * otherwise. */
+static void
+build_finish(Build *b, int full)
+{
+	SearchDoc *snew = NULL;
+	jq_wait(&b->q);
+
+	/* failed jobs are left out, so the next build retries them */
+	while (b->all) {
+		Job *j = b->all;
+		b->all = j->all;
+		if (j->t != JOB_GZ && j->ok) {
+			mf_put_entry(&b->next, j->src, j->t, j->out_size,
+			    j->out_mtime, (uint32_t)j->deps.n);
+			for (size_t i = 0; i < j->deps.n; i++) {
+				const Dep *d = &j->deps.v[i];
+				mf_put_input(&b->next, d->path, d->size,
+				    d->mtime, d->hash);
+			}
+			b->nents++;
+			b->ninputs += (uint32_t)j->deps.n;
+		}
+		if (j->t != JOB_GZ)
+			b->nmade++;
+		if (j->ok)
+			build_wrote(b, j->dst);
+		if (j->t == JOB_COPY && j->ok) {
+			b->ncopied[j->how]++;
+			b->copied[j->how] += (uint64_t)j->out_size;
+		}
+		if (j->sd && j->ok) {
+			j->sd->next = snew;
+			snew = j->sd;
+		} else {
+			free(j->sd);
+		}
+		deps_free(&j->deps);
+		free(j->src);
+		free(j->dst);
+		free(j);
+	}
+	for (size_t i = 0; !full && i < b->mf.n; i++) {
+		const MfEntry *e = &b->mf.ents[i];
+		if (!e->seen) {
+			mf_put_old(&b->next, e);
+			b->nents++;
+			b->ninputs += e->nin;
+		}
+	}
+	if (feed.url)
+		feed_write(b);
+	if (mf_save(&b->next, b->nents, b->ninputs, b->dstroot) != 0)
+		fprintf(stderr, "cannot write %s/%s (%s)\n", b->dstroot,
+		    MANIFEST_NAME, strerror(errno));
+	if (b->explain)
+		printf("%zu of %zu outputs rebuilt\n", b->nmade, b->nfiles);
+	build_copy_summary(b);
+	if (stats_on)
+		stats_report();
+
+	free(b->next.p);
+	lc_free(&b->lc);
+	/* the next pass starts from what was just written */
+	mf_free(&b->mf);
+	mf_load(&b->mf, b->dstroot);
+	/* after the reload, so the manifest tells which pages are left */
+	if (search_on)
+		search_write(b, snew);
+	/* last, so it carries search/ and rss.xml */
+	if (bundle_path)
+		bundle_write(b);
+	for (size_t i = 0; i < b->nwrote; i++)
+		free(b->wrote[i]);
+	b->nwrote = 0;
+}
+
+/* explain: print why each output is (re)made */
+static void
+build_tree_parallel(const char *srcroot, const char *dstroot, int nthreads,
+    int gzip, int explain, int uring)
+{
+	Build b;
+	build_open(&b, srcroot, dstroot, nthreads, gzip, explain, uring);
+	build_begin(&b);
+	build_walk(&b, srcroot);
+	build_finish(&b, 1);
+	build_close(&b);
+}
+
+/* Watch mode: one full build, then every batch of file system events is
+ * turned into a pass over just the touched paths and the outputs that
+ * recorded them as inputs. */
+
+#define WATCH_SETTLE_MS 20 /* quiet time that ends a batch of events */
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/* "./a/b" and "a/b" name the same input */
+static int
+same_path(const char *a, const char *b)
+{
+	while (a[0] == '.' && a[1] == '/')
+		a += 2;
+	while (b[0] == '.' && b[1] == '/')
+		b += 2;
+	return strcmp(a, b) == 0;
+}
+
+/* path names an entry of dir: adding, removing or renaming it changes a
+ * $posts listing that recorded dir */
+static int
+in_dir(const char *dir, const char *path)
+{
+	while (dir[0] == '.' && dir[1] == '/')
+		dir += 2;
+	while (path[0] == '.' && path[1] == '/')
+		path += 2;
+	size_t n = strlen(dir);
+	return n && strncmp(dir, path, n) == 0 && path[n] == '/' &&
+	    !strchr(path + n + 1, '/');
+}
+
+/* pass over the changed paths and everything built from them */
+static void
+build_changed(Build *b, const Deps *changed)
+{
+	for (size_t i = 0; i < changed->n; i++) {
+		const char *p = changed->v[i].path;
+		struct stat st;
+		int have = lstat(p, &st) == 0;
+		if (have && S_ISDIR(st.st_mode)) {
+			build_walk(b, p);
+		} else if (have && S_ISREG(st.st_mode)) {
+			build_file(b, p, &st);
+		} else {
+			/* removed: forget its output */
+			MfEntry *e = mf_find(&b->mf, p);
+			if (e)
+				e->seen = 1;
+		}
+		for (size_t k = 0; k < b->mf.n; k++) {
+			MfEntry *e = &b->mf.ents[k];
+			if (e->seen)
+				continue;
+			for (uint32_t n = 0; n < e->nin; n++) {
+				if (!same_path(e->in[n].path, p) &&
+				    !in_dir(e->in[n].path, p))
+					continue;
+				if (lstat(e->src, &st) == 0 &&
+				    S_ISREG(st.st_mode))
+					build_file(b, e->src, &st);
+				else
+					e->seen = 1;
+				break;
+			}
+		}
+	}
+}
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK                                                          \
+	(IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |           \
+	    IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct Watch {
+	int fd;
+	int stopfd; /* readable once the watcher should return, or -1 */
+	char **dirs; /* indexed by watch descriptor */
+	size_t ndirs;
+	int overflow; /* events were lost: walk everything */
+};
+
+static void
+watch_dir(Watch *w, const char *dir)
+{
+	int wd = inotify_add_watch(w->fd, dir, WATCH_MASK);
+	if (wd < 0) {
+		fprintf(stderr, "cannot watch %s (%s)\n", dir,
+		    strerror(errno));
+		return;
+	}
+	if ((size_t)wd >= w->ndirs) {
+		size_t n = w->ndirs ? w->ndirs : 64;
+		while (n <= (size_t)wd)
+			n *= 2;
+		char **nd = realloc(w->dirs, n * sizeof(*nd));
+		if (!nd) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(nd + w->ndirs, 0, (n - w->ndirs) * sizeof(*nd));
+		w->dirs = nd;
+		w->ndirs = n;
+	}
+	free(w->dirs[wd]);
+	w->dirs[wd] = strdup(dir);
+}
+
+static void
+watch_free(Watch *w)
+{
+	for (size_t i = 0; i < w->ndirs; i++)
+		free(w->dirs[i]);
+	free(w->dirs);
+	close(w->fd);
+}
+
+/* watch root and every directory below it, dot directories excepted */
+static void
+watch_walk(Watch *w, const char *root)
+{
+	char *paths[] = {(char *)root, NULL};
+	FTS *fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if (!fts)
+		return;
+	FTSENT *ent;
+	while ((ent = fts_read(fts))) {
+		if (ent->fts_info != FTS_D)
+			continue;
+		if (ent->fts_level > 0 && ent->fts_name[0] == '.') {
+			fts_set(fts, ent, FTS_SKIP);
+			continue;
+		}
+		watch_dir(w, ent->fts_path);
+	}
+	(void)fts_close(fts);
+}
+
+/* Block until something changes, then gather events until they settle.
+ * Returns 1 when stopfd fires, -1 if the watch is unusable. */
+static int
+watch_collect(Watch *w, Deps *changed)
+{
+	char buf[64 * 1024]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	int timeout = -1;
+	for (;;) {
+		struct pollfd pfd[2] = {
+			{.fd = w->fd, .events = POLLIN},
+			{.fd = w->stopfd, .events = POLLIN},
+		};
+		int r = poll(pfd, w->stopfd >= 0 ? 2 : 1, timeout);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (w->stopfd >= 0 && pfd[1].revents)
+			return 1;
+		if (r == 0)
+			return 0;
+		ssize_t n = read(w->fd, buf, sizeof(buf));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (char *p = buf; p < buf + n;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(*ev) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				w->overflow = 1;
+				continue;
+			}
+			if (ev->wd < 0 || (size_t)ev->wd >= w->ndirs ||
+			    !w->dirs[ev->wd])
+				continue;
+			if (ev->mask & (IN_IGNORED | IN_MOVE_SELF)) {
+				/* gone or renamed; the new name, if any,
+				 * arrives as a create in its parent */
+				if (ev->mask & IN_MOVE_SELF)
+					inotify_rm_watch(w->fd, ev->wd);
+				free(w->dirs[ev->wd]);
+				w->dirs[ev->wd] = NULL;
+				continue;
+			}
+			if (!ev->len || ev->name[0] == '.')
+				continue;
+			/* plain files are picked up once written */
+			if ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR))
+				continue;
+			char *path = xjoin2(w->dirs[ev->wd], ev->name);
+			if (path) {
+				(void)deps_add_stat(changed, path, 0, 0, 0);
+				free(path);
+			}
+		}
+		timeout = WATCH_SETTLE_MS;
+	}
+}
+
+static void
+watch_tree(const char *srcroot, const char *dstroot, int nthreads, int gzip,
+    int explain, int uring)
+{
+	Watch w = {.stopfd = -1};
+	w.fd = inotify_init1(IN_CLOEXEC);
+	if (w.fd < 0) {
+		perror("inotify_init1");
+		exit(1);
+	}
+
+	Build b;
+	build_open(&b, srcroot, dstroot, nthreads, gzip, explain, uring);
+	b.watch = &w;
+	double t0 = now_ms();
+	build_begin(&b);
+	build_walk(&b, srcroot);
+	build_finish(&b, 1);
+	printf("built %zu of %zu outputs in %.1f ms; watching %s\n", b.nmade,
+	    b.nfiles, now_ms() - t0, srcroot);
+	fflush(stdout);
+
+	for (;;) {
+		Deps changed = {0};
+		if (watch_collect(&w, &changed) != 0) {
+			perror("inotify");
+			break;
+		}
+		t0 = now_ms();
+		build_begin(&b);
+		if (w.overflow) {
+			w.overflow = 0;
+			build_walk(&b, srcroot);
+			build_finish(&b, 1);
+		} else {
+			build_changed(&b, &changed);
+			build_finish(&b, 0);
+		}
+		if (b.nmade) {
+			printf("rebuilt %zu outputs in %.1f ms\n", b.nmade,
+			    now_ms() - t0);
+			fflush(stdout);
+		}
+		deps_free(&changed);
+	}
+
+	build_close(&b);
+	watch_free(&w);
+}
+#else
+/* No inotify: rerun the (manifest-driven, incremental) build once a
+ * second. */
+static void
+watch_dir(Watch *w, const char *dir)
+{
+	(void)w;
+	(void)dir;
+}
+
+static void
+watch_tree(const char *srcroot, const char *dstroot, int nthreads, int gzip,
+    int explain, int uring)
+{
+	Build b;
+	build_open(&b, srcroot, dstroot, nthreads, gzip, explain, uring);
+	printf("watching %s (polling)\n", srcroot);
+	fflush(stdout);
+	for (;;) {
+		double t0 = now_ms();
+		build_begin(&b);
+		build_walk(&b, srcroot);
+		build_finish(&b, 1);
+		if (b.nmade) {
+			printf("rebuilt %zu outputs in %.1f ms\n", b.nmade,
+			    now_ms() - t0);
+			fflush(stdout);
+		}
+		sleep(1);
+	}
+}
+#endif
+
+/* Serve mode (mongoose) */
+
+#define METRICS_PATH "/__huap/metrics" /* --stats */
+
+static volatile sig_atomic_t g_stop = 0;
+static void
+on_sig(int sig)
+{
+	(void)sig;
+	g_stop = 1;
+}
+
+/* /search?q=WORDS[&n=N]: the pages holding every word of the query (the
+ * last one also as a prefix, for search as you type), best BM25 score
+ * first, as JSON. The index is mapped once, and again whenever the file is
+ * replaced by a build. */
+
+#define SEARCH_PATH "/search"
+#define SEARCH_QWORDS 8 /* query words used */
+#define SEARCH_PREFIX_MAX 64 /* completions of the last word */
+#define SEARCH_RESULTS 10 /* default n */
+#define SEARCH_RESULTS_MAX 50
+
+static const char *search_index; /* --search-index */
+
+typedef struct {
+	struct {
+		char w[SEARCH_WORD_MAX];
+		size_t n;
+	} v[SEARCH_QWORDS];
+	size_t n;
+} QWords;
+
+static void
+qwords_add(void *u, const char *w, size_t n)
+{
+	QWords *q = u;
+	for (size_t i = 0; i < q->n; i++)
+		if (q->v[i].n == n && memcmp(q->v[i].w, w, n) == 0)
+			return;
+	if (q->n < SEARCH_QWORDS) {
+		memcpy(q->v[q->n].w, w, n);
+		q->v[q->n++].n = n;
+	}
+}
+
+/* first term not below w[0, n) */
+static uint32_t
+sidx_lower(const SearchIdx *x, const char *w, size_t n)
+{
+	uint32_t lo = 0, hi = x->h->nterms;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const SxTerm *t = &x->terms[mid];
+		int c = memcmp(sidx_str(x, t->word), w,
+		    t->wlen < n ? t->wlen : n);
+		if (c < 0 || (c == 0 && t->wlen < n))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* "posts/a.md" -> "/posts/a", "docs/index.md" -> "/docs/" */
+static void
+search_route(const char *rel, char *dst, size_t cap)
+{
+	size_t n = strlen(rel);
+	if (has_ext(rel, ".md"))
+		n -= 3;
+	const char *base = strrchr(rel, '/');
+	base = base ? base + 1 : rel;
+	if ((size_t)(base - rel) + 5 == n && memcmp(base, "index", 5) == 0)
+		n -= 5;
+	snprintf(dst, cap, "/%.*s", (int)n, rel);
+}
+
+static void
+sidx_query(const SearchIdx *x, const char *q, int limit, Buf *out)
+{
+	QWords qw = {0};
+	search_words(q, strlen(q), qwords_add, &qw);
+	uint32_t ndocs = x->h ? x->h->ndocs : 0;
+	double *score = qw.n && ndocs ? calloc(ndocs, sizeof(*score)) : NULL;
+	uint8_t *seen = score ? calloc(ndocs, 1) : NULL;
+	struct {
+		uint32_t doc;
+		double score;
+	} top[SEARCH_RESULTS_MAX];
+	size_t ntop = 0, total = 0;
+
+	if (score && seen) {
+		const double k1 = 1.2, bl = 0.75;
+		double avgdl = x->h->avgdl > 0 ? x->h->avgdl : 1;
+		for (size_t i = 0; i < qw.n; i++) {
+			const char *w = qw.v[i].w;
+			size_t n = qw.v[i].n;
+			int last = i + 1 == qw.n;
+			uint32_t t = sidx_lower(x, w, n);
+			for (int m = 0;
+			     t < x->h->nterms && m < SEARCH_PREFIX_MAX;
+			     t++, m++) {
+				const SxTerm *e = &x->terms[t];
+				int exact = e->wlen == n;
+				if (e->wlen < n ||
+				    memcmp(sidx_str(x, e->word), w, n) != 0 ||
+				    (!exact && !last))
+					break;
+				double idf = log(1 + (ndocs - e->npost + 0.5) /
+						     (e->npost + 0.5));
+				if (!exact)
+					idf /= 2; /* a completion counts less */
+				for (uint32_t k = 0; k < e->npost; k++) {
+					const uint32_t *p =
+					    &x->post[2 * ((size_t)e->post + k)];
+					double tf = p[1],
+					       dl = x->docs[p[0]].len;
+					double norm =
+					    1 - bl + bl * dl / avgdl;
+					score[p[0]] += idf * tf * (k1 + 1) /
+					    (tf + k1 * norm);
+					seen[p[0]] |= (uint8_t)(1u << i);
+				}
+			}
+		}
+		uint8_t all = (uint8_t)((1u << qw.n) - 1);
+		for (uint32_t d = 0; d < ndocs; d++) {
+			if (seen[d] != all)
+				continue;
+			total++;
+			size_t k = ntop < (size_t)limit ? ntop++ : ntop;
+			while (k > 0 && top[k - 1].score < score[d]) {
+				if (k < (size_t)limit)
+					top[k] = top[k - 1];
+				k--;
+			}
+			if (k < (size_t)limit) {
+				top[k].doc = d;
+				top[k].score = score[d];
+			}
+		}
+	}
+	free(score);
+	free(seen);
+
+	char num[64], route[1024];
+	buf_puts(out, "{\"q\":");
+	json_str(out, q, strlen(q));
+	snprintf(num, sizeof(num), ",\"total\":%zu,\"results\":[", total);
+	buf_puts(out, num);
+	for (size_t i = 0; i < ntop; i++) {
+		const SxDoc *d = &x->docs[top[i].doc];
+		search_route(sidx_str(x, d->path), route, sizeof(route));
+		buf_puts(out, i ? ",\n{\"url\":" : "\n{\"url\":");
+		json_str(out, route, strlen(route));
+		buf_puts(out, ",\"title\":");
+		const char *title = sidx_str(x, d->title);
+		json_str(out, title, strlen(title));
+		snprintf(num, sizeof(num), ",\"score\":%.3f}", top[i].score);
+		buf_puts(out, num);
+	}
+	buf_puts(out, "]}\n");
+}
+
+/* search_index, mapped again when a build has replaced it */
+static const SearchIdx *
+search_idx(void)
+{
+	static SearchIdx x;
+	static struct stat tried;
+	struct stat st;
+	if (stat(search_index, &st) != 0) {
+		sidx_close(&x);
+		memset(&tried, 0, sizeof(tried));
+		return &x;
+	}
+	if (st.st_dev == tried.st_dev && st.st_ino == tried.st_ino &&
+	    st.st_size == tried.st_size && st.st_mtime == tried.st_mtime)
+		return &x;
+	tried = st;
+	sidx_close(&x);
+	if (sidx_open(&x, search_index) != 0)
+		fprintf(stderr, "ignoring unreadable search index %s\n",
+		    search_index);
+	return &x;
+}
+
+/* Render cache: bounded LRU of fully wrapped pages, keyed by source path and
+ * validated against the size/mtime of every input the page was built from. */
+
+#define RCACHE_DEFAULT_MB 64
+
+typedef struct CacheEnt {
+	char *key;
+	uint64_t hash;
+	char *body;
+	size_t len;
+	unsigned char *gz; /* gzip of body, once a render made one */
+	size_t gzlen;
+	size_t cost;
+	Deps deps;
+	struct CacheEnt *hnext; /* bucket chain */
+	struct CacheEnt *prev, *next; /* LRU list, most recent at head */
+} CacheEnt;
+
+typedef struct {
+	CacheEnt **tab;
+	size_t nbuckets;
+	CacheEnt *head, *tail;
+	size_t bytes;
+	size_t budget;
+	unsigned long hits, misses, evictions;
+} RenderCache;
+
+static void
+rc_init(RenderCache *rc, size_t budget)
+{
+	memset(rc, 0, sizeof(*rc));
+	rc->budget = budget;
+	rc->nbuckets = 1024;
+	rc->tab = calloc(rc->nbuckets, sizeof(*rc->tab));
+	if (!rc->tab)
+		rc->budget = 0;
+}
+static void
+rc_unlink_lru(RenderCache *rc, CacheEnt *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		rc->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		rc->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+static void
+rc_push_front(RenderCache *rc, CacheEnt *e)
+{
+	e->prev = NULL;
+	e->next = rc->head;
+	if (rc->head)
+		rc->head->prev = e;
+	rc->head = e;
+	if (!rc->tail)
+		rc->tail = e;
+}
+static void
+rc_remove(RenderCache *rc, CacheEnt *e)
+{
+	CacheEnt **pp = &rc->tab[e->hash % rc->nbuckets];
+	while (*pp && *pp != e)
+		pp = &(*pp)->hnext;
+	if (*pp)
+		*pp = e->hnext;
+	rc_unlink_lru(rc, e);
+	rc->bytes -= e->cost;
+	deps_free(&e->deps);
+	free(e->key);
+	free(e->body);
+	free(e->gz);
+	free(e);
+}
+/* returns a valid entry (moved to front) or NULL; stale entries are dropped */
+static CacheEnt *
+rc_get(RenderCache *rc, const char *key)
+{
+	if (!rc->budget)
+		return NULL;
+	uint64_t h = hash_str(key);
+	CacheEnt *e = rc->tab[h % rc->nbuckets];
+	while (e && !(e->hash == h && strcmp(e->key, key) == 0))
+		e = e->hnext;
+	if (!e) {
+		rc->misses++;
+		return NULL;
+	}
+	if (deps_changed(&e->deps)) {
+		rc_remove(rc, e);
+		rc->misses++;
+		return NULL;
+	}
+	rc_unlink_lru(rc, e);
+	rc_push_front(rc, e);
+	rc->hits++;
+	return e;
+}
+/* takes ownership of body and deps on success; returns NULL if not cached */
+static CacheEnt *
+rc_put(RenderCache *rc, const char *key, Buf *body, Deps *deps)
+{
+	if (!rc->budget)
+		return NULL;
+	size_t cost = sizeof(CacheEnt) + strlen(key) + 1 + body->cap;
+	for (size_t i = 0; i < deps->n; i++)
+		cost += sizeof(Dep) + strlen(deps->v[i].path) + 1;
+	if (cost > rc->budget)
+		return NULL;
+
+	uint64_t h = hash_str(key);
+	for (CacheEnt *o = rc->tab[h % rc->nbuckets]; o; o = o->hnext) {
+		if (o->hash == h && strcmp(o->key, key) == 0) {
+			rc_remove(rc, o);
+			break;
+		}
+	}
+	while (rc->tail && rc->bytes + cost > rc->budget) {
+		rc_remove(rc, rc->tail);
+		rc->evictions++;
+	}
+
+	CacheEnt *e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	e->key = strdup(key);
+	if (!e->key) {
+		free(e);
+		return NULL;
+	}
+	e->hash = h;
+	e->body = body->p;
+	e->len = body->len;
+	e->cost = cost;
+	e->deps = *deps;
+	memset(body, 0, sizeof(*body));
+	memset(deps, 0, sizeof(*deps));
+
+	e->hnext = rc->tab[h % rc->nbuckets];
+	rc->tab[h % rc->nbuckets] = e;
+	rc_push_front(rc, e);
+	rc->bytes += cost;
+	return e;
+}
+/* keep gz, a render worker's gzip of e's body, alongside it (taking
+ * ownership); e stays most recent */
+static void
+rc_attach_gz(RenderCache *rc, CacheEnt *e, unsigned char *gz, size_t gzlen)
+{
+	free(e->gz);
+	rc->bytes -= e->gzlen;
+	e->cost -= e->gzlen;
+	e->gz = gz;
+	e->gzlen = gzlen;
+	e->cost += e->gzlen;
+	rc->bytes += e->gzlen;
+	while (rc->tail && rc->tail != e && rc->bytes > rc->budget) {
+		rc_remove(rc, rc->tail);
+		rc->evictions++;
+	}
+}
+static void
+rc_report(const RenderCache *rc)
+{
+	fprintf(stderr,
+	    "render cache: %lu hits, %lu misses, %lu evictions, %zu/%zu "
+	    "bytes\n",
+	    rc->hits, rc->misses, rc->evictions, rc->bytes, rc->budget);
+}
+static void
+rc_free(RenderCache *rc)
+{
+	while (rc->head)
+		rc_remove(rc, rc->head);
+	free(rc->tab);
+}
+
+/* Asset cache: bounded LRU of small static files, each kept as ready-made
+ * responses (header block and body in one buffer, and the same for a .gz
+ * sibling), keyed by file path. An entry is trusted for ASSET_CHECK_MS
+ * after it was last checked, then stat()ed again; with -l the watcher also
+ * drops it as soon as the file changes. */
+
+#define ACACHE_DEFAULT_MB 16
+#define ASSET_MAX (256 * 1024) /* bigger files are left to mongoose */
+#define ASSET_CHECK_MS 1000
+
+typedef struct Asset {
+	char *key;
+	uint64_t hash;
+	char *resp; /* hlen bytes of headers, then len of body */
+	size_t hlen, len;
+	char *zresp; /* the same for key.gz; NULL if there is none */
+	size_t zhlen, zlen;
+	uint64_t tag;
+	time_t mtime;
+	off_t size, zsize; /* zsize is -1 without a .gz */
+	time_t zmtime;
+	ino_t ino;
+	double checked; /* now_ms() of the last stat */
+	size_t cost;
+	struct Asset *hnext;
+	struct Asset *prev, *next;
+} Asset;
+
+typedef struct {
+	Asset **tab;
+	size_t nbuckets;
+	Asset *head, *tail;
+	size_t bytes;
+	size_t budget;
+	unsigned long hits, misses, evictions;
+} AssetCache;
+
+static void
+ac_init(AssetCache *ac, size_t budget)
+{
+	memset(ac, 0, sizeof(*ac));
+	ac->budget = budget;
+	ac->nbuckets = 256;
+	ac->tab = calloc(ac->nbuckets, sizeof(*ac->tab));
+	if (!ac->tab)
+		ac->budget = 0;
+}
+
+static void
+ac_unlink_lru(AssetCache *ac, Asset *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		ac->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		ac->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+ac_push_front(AssetCache *ac, Asset *e)
+{
+	e->prev = NULL;
+	e->next = ac->head;
+	if (ac->head)
+		ac->head->prev = e;
+	ac->head = e;
+	if (!ac->tail)
+		ac->tail = e;
+}
+
+static void
+ac_remove(AssetCache *ac, Asset *e)
+{
+	Asset **pp = &ac->tab[e->hash % ac->nbuckets];
+	while (*pp && *pp != e)
+		pp = &(*pp)->hnext;
+	if (*pp)
+		*pp = e->hnext;
+	ac_unlink_lru(ac, e);
+	ac->bytes -= e->cost;
+	free(e->key);
+	free(e->resp);
+	free(e->zresp);
+	free(e);
+}
+
+/* headers and body of the file at path in one buffer; hlen and len get
+ * their sizes. *tag is set to the hash of the body, except for a gzip body,
+ * which is tagged after the plain one like a rendered page's. */
+static char *
+ac_resp(const char *path, const char *type, int gz, time_t mtime,
+    uint64_t *tag, size_t *hlen, size_t *len)
+{
+	Arena a;
+	arena_init(&a, 4096);
+	size_t n;
+	char *body = read_file(&a, path, &n);
+	char *resp = NULL;
+	if (body && n <= ASSET_MAX) {
+		char vh[256], hdr[512];
+		if (!gz)
+			*tag = hash_mem(body, n);
+		http_validators(*tag, mtime, gz, vh, sizeof(vh));
+		snprintf(hdr, sizeof(hdr),
+		    "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: %s\r\n"
+		    "Vary: Accept-Encoding\r\n"
+		    "%s%s"
+		    "Content-Length: %lu\r\n\r\n",
+		    type, gz ? "Content-Encoding: gzip\r\n" : "", vh,
+		    (unsigned long)n);
+		*hlen = strlen(hdr);
+		*len = n;
+		if ((resp = malloc(*hlen + n + 1))) {
+			memcpy(resp, hdr, *hlen);
+			memcpy(resp + *hlen, body, n);
+		}
+	}
+	arena_destroy(&a);
+	return resp;
+}
+
+/* Read key (st from stat()) and key.gz into a new entry, evicting from the
+ * tail to make room. NULL if it is too big or cannot be read. */
+static Asset *
+ac_put(AssetCache *ac, const char *key, const struct stat *st)
+{
+	size_t cost = sizeof(Asset) + strlen(key) + 1 + (size_t)st->st_size;
+	if (!ac->budget || st->st_size > ASSET_MAX || cost > ac->budget)
+		return NULL;
+	Asset *e = calloc(1, sizeof(*e));
+	char gzp[4096];
+	struct stat zst;
+	if (!e || !(e->key = strdup(key)))
+		goto fail;
+	e->mtime = st->st_mtime;
+	e->size = st->st_size;
+	e->ino = st->st_ino;
+	e->zsize = -1;
+	const char *type = mime_type(key);
+	e->resp = ac_resp(key, type, 0, e->mtime, &e->tag, &e->hlen, &e->len);
+	if (!e->resp || e->len != (size_t)st->st_size)
+		goto fail;
+	if (snprintf(gzp, sizeof(gzp), "%s" GZ_EXT, key) < (int)sizeof(gzp) &&
+	    stat(gzp, &zst) == 0 && S_ISREG(zst.st_mode) &&
+	    zst.st_size <= ASSET_MAX &&
+	    (e->zresp = ac_resp(gzp, type, 1, e->mtime, &e->tag, &e->zhlen,
+		 &e->zlen))) {
+		e->zsize = zst.st_size;
+		e->zmtime = zst.st_mtime;
+	}
+	e->cost = cost + e->hlen + e->zhlen + e->zlen;
+	if (e->cost > ac->budget)
+		goto fail;
+	e->hash = hash_str(key);
+	e->checked = now_ms();
+	while (ac->tail && ac->bytes + e->cost > ac->budget) {
+		ac_remove(ac, ac->tail);
+		ac->evictions++;
+	}
+	e->hnext = ac->tab[e->hash % ac->nbuckets];
+	ac->tab[e->hash % ac->nbuckets] = e;
+	ac_push_front(ac, e);
+	ac->bytes += e->cost;
+	return e;
+fail:
+	if (e) {
+		free(e->key);
+		free(e->resp);
+		free(e->zresp);
+	}
+	free(e);
+	return NULL;
+}
+
+/* the entry for key, stat()ed again if it has not been for a while; NULL
+ * (and the entry dropped) if the file or its .gz changed */
+static Asset *
+ac_get(AssetCache *ac, const char *key)
+{
+	if (!ac->budget)
+		return NULL;
+	uint64_t h = hash_str(key);
+	Asset *e = ac->tab[h % ac->nbuckets];
+	while (e && !(e->hash == h && strcmp(e->key, key) == 0))
+		e = e->hnext;
+	if (!e) {
+		ac->misses++;
+		return NULL;
+	}
+	double now = now_ms();
+	if (now - e->checked >= ASSET_CHECK_MS) {
+		struct stat st, zst;
+		char gzp[4096];
+		snprintf(gzp, sizeof(gzp), "%s" GZ_EXT, key);
+		int zok = stat(gzp, &zst) == 0 && S_ISREG(zst.st_mode);
+		if (stat(key, &st) != 0 || st.st_size != e->size ||
+		    st.st_mtime != e->mtime || st.st_ino != e->ino ||
+		    (zok ? zst.st_size != e->zsize || zst.st_mtime != e->zmtime
+			 : e->zsize != -1)) {
+			ac_remove(ac, e);
+			ac->misses++;
+			return NULL;
+		}
+		e->checked = now;
+	}
+	ac_unlink_lru(ac, e);
+	ac_push_front(ac, e);
+	ac->hits++;
+	return e;
+}
+
+/* -l: path changed; "*" means anything may have */
+static void
+ac_changed(AssetCache *ac, const char *path)
+{
+	for (Asset *e = ac->head, *next; e; e = next) {
+		char gzp[4096];
+		next = e->next;
+		snprintf(gzp, sizeof(gzp), "%s" GZ_EXT, e->key);
+		if (strcmp(path, "*") == 0 || same_path(e->key, path) ||
+		    same_path(gzp, path))
+			ac_remove(ac, e);
+	}
+}
+
+static void
+ac_report(const AssetCache *ac)
+{
+	fprintf(stderr,
+	    "asset cache: %lu hits, %lu misses, %lu evictions, %zu/%zu "
+	    "bytes\n",
+	    ac->hits, ac->misses, ac->evictions, ac->bytes, ac->budget);
+}
+
+static void
+ac_free(AssetCache *ac)
+{
+	while (ac->head)
+		ac_remove(ac, ac->head);
+	free(ac->tab);
+}
+
+/* Validators: ETag and Last-Modified of each page, derived from the inputs
+ * recorded at its last render and kept even when the render cache drops
+ * the page, so a conditional request costs one stat per input. */
+
+#define VAL_BUCKETS 1024
+
+typedef struct Validator {
+	char *key; /* .md path */
+	Deps deps;
+	uint64_t tag;
+	time_t mtime; /* newest input */
+	struct Validator *next;
+} Validator;
+
+typedef struct {
+	Validator *tab[VAL_BUCKETS];
+} Validators;
+
+static void
+val_drop(Validator *v)
+{
+	free(v->key);
+	deps_free(&v->deps);
+	free(v);
+}
+
+/* the entry for key, or NULL if there is none or an input changed */
+static Validator *
+val_get(Validators *vs, const char *key)
+{
+	for (Validator **pp = &vs->tab[hash_str(key) % VAL_BUCKETS]; *pp;
+	    pp = &(*pp)->next) {
+		Validator *v = *pp;
+		if (strcmp(v->key, key) != 0)
+			continue;
+		if (!deps_changed(&v->deps))
+			return v;
+		*pp = v->next;
+		val_drop(v);
+		return NULL;
+	}
+	return NULL;
+}
+
+/* seed distinguishes bodies that differ for the same inputs (-l) */
+static Validator *
+val_put(Validators *vs, const char *key, const Deps *deps, uint64_t seed)
+{
+	Validator **bucket = &vs->tab[hash_str(key) % VAL_BUCKETS];
+	for (Validator **pp = bucket; *pp; pp = &(*pp)->next) {
+		if (strcmp((*pp)->key, key) == 0) {
+			Validator *old = *pp;
+			*pp = old->next;
+			val_drop(old);
+			break;
+		}
+	}
+	Validator *v = calloc(1, sizeof(*v));
+	if (!v || !(v->key = strdup(key))) {
+		free(v);
+		return NULL;
+	}
+	uint64_t h = hash_update(HASH_INIT, &seed, sizeof(seed));
+	for (size_t i = 0; i < deps->n; i++) {
+		const Dep *d = &deps->v[i];
+		if (deps_add_stat(&v->deps, d->path, d->size, d->mtime, 0)) {
+			val_drop(v);
+			return NULL;
+		}
+		int64_t meta[2] = {(int64_t)d->size, (int64_t)d->mtime};
+		h = hash_update(h, d->path, strlen(d->path) + 1);
+		h = hash_update(h, meta, sizeof(meta));
+		if (d->size >= 0 && d->mtime > v->mtime)
+			v->mtime = d->mtime;
+	}
+	v->tag = h;
+	v->next = *bucket;
+	*bucket = v;
+	return v;
+}
+
+static void
+val_free(Validators *vs)
+{
+	for (size_t i = 0; i < VAL_BUCKETS; i++) {
+		while (vs->tab[i]) {
+			Validator *v = vs->tab[i];
+			vs->tab[i] = v->next;
+			val_drop(v);
+		}
+	}
+}
+
+/* IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT" */
+static int
+http_date_parse(struct mg_str s, time_t *out)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char buf[64], mon[4];
+	int d, y, hh, mm, ss;
+	if (s.len >= sizeof(buf))
+		return -1;
+	memcpy(buf, s.buf, s.len);
+	buf[s.len] = '\0';
+	if (sscanf(buf, "%*3s, %d %3s %d %d:%d:%d GMT", &d, mon, &y, &hh, &mm,
+		&ss) != 6)
+		return -1;
+	const char *m = strstr(months, mon);
+	if (!m || (m - months) % 3 != 0)
+		return -1;
+	/* days since the epoch, proleptic Gregorian */
+	int mo = (int)(m - months) / 3 + 1;
+	long yy = y - (mo <= 2);
+	long era = (yy >= 0 ? yy : yy - 399) / 400;
+	long yoe = yy - era * 400;
+	long doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	long days = era * 146097 + doe - 719468;
+	*out = (time_t)days * 86400 + hh * 3600 + mm * 60 + ss;
+	return 0;
+}
+
+/* If-None-Match holds "*" or a comma-separated list of entity tags, each
+ * maybe weak ("W/"); the comparison is weak, so that prefix is ignored */
+static int
+etag_listed(struct mg_str list, const char *tag, size_t tlen)
+{
+	const char *p = list.buf, *end = list.buf + list.len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		const char *s = p;
+		if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+			p += 2;
+		const char *t = p;
+		if (p < end && *p == '"') {
+			const char *q = memchr(p + 1, '"', (size_t)(end - p - 1));
+			p = q ? q + 1 : end;
+		} else {
+			while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+				p++;
+		}
+		if (t == s && p - t == 1 && *t == '*')
+			return 1;
+		if ((size_t)(p - t) == tlen && memcmp(t, tag, tlen) == 0)
+			return 1;
+		while (p < end && *p != ',')
+			p++;
+	}
+	return 0;
+}
+
+/* If-None-Match wins over If-Modified-Since, as RFC 9110 asks. gz picks
+ * the variant whose tag counts, as http_validators() writes it. */
+static int
+not_modified(struct mg_http_message *hm, const Validator *v, int gz)
+{
+	struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+	if (inm) {
+		char tag[32];
+		int n = snprintf(tag, sizeof(tag), "\"%016llx%s\"",
+		    (unsigned long long)v->tag, gz ? "-gz" : "");
+		return etag_listed(*inm, tag, (size_t)n);
+	}
+	struct mg_str *ims = mg_http_get_header(hm, "If-Modified-Since");
+	time_t t;
+	return ims && http_date_parse(*ims, &t) == 0 && v->mtime <= t;
+}
+
+/* http_validators() for v, empty if v is NULL */
+static void
+val_headers(const Validator *v, int gz, char *out, size_t cap)
+{
+	if (!v) {
+		*out = '\0';
+		return;
+	}
+	http_validators(v->tag, v->mtime, gz, out, cap);
+}
+
+/* Render workers: cache misses are rendered off the loop thread. The page
+ * goes back to the loop on the Inbox, which caches it and answers every
+ * connection that asked for the route in the meantime. */
+
+typedef struct {
+	unsigned long id; /* connection */
+	int gz;
+	int close;   /* client sent "Connection: close" */
+	uint64_t t0; /* when the request came in, for --stats */
+} Waiter;
+
+typedef struct Render {
+	char *mdp;
+	char *route;
+	Buf body;
+	Deps deps;
+	int rc;
+	int want_gz;       /* a waiter takes gzip; set by the loop, __atomic */
+	unsigned char *gz; /* gzip of body, made by the worker if want_gz */
+	size_t gzlen;
+	Waiter *w;
+	size_t nw, capw;
+	struct Render *next;  /* RenderQ, then Inbox.done */
+	struct Render *inext; /* ServeCtx.inflight, loop thread only */
+} Render;
+
+typedef struct {
+	Render *head, *tail;
+	int closed;
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+} RenderQ;
+
+static void
+rq_push(RenderQ *q, Render *r)
+{
+	r->next = NULL;
+	pthread_mutex_lock(&q->mu);
+	if (q->tail)
+		q->tail->next = r;
+	else
+		q->head = r;
+	q->tail = r;
+	pthread_cond_signal(&q->cv);
+	pthread_mutex_unlock(&q->mu);
+}
+static Render *
+rq_pop(RenderQ *q)
+{
+	pthread_mutex_lock(&q->mu);
+	while (!q->head && !q->closed)
+		pthread_cond_wait(&q->cv, &q->mu);
+	Render *r = q->head;
+	if (r) {
+		q->head = r->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	pthread_mutex_unlock(&q->mu);
+	return r;
+}
+static void
+rq_close(RenderQ *q)
+{
+	pthread_mutex_lock(&q->mu);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cv);
+	pthread_mutex_unlock(&q->mu);
+}
+
+/* What the worker and watcher threads hand to the loop. mg_wakeup() only
+ * rings the bell: its datagram is dropped when the socket buffer is full,
+ * so the loop also drains the inbox on every poll and nothing is lost. */
+typedef struct {
+	pthread_mutex_t mu;
+	Render *done; /* finished renders, through Render.next */
+	Buf paths;    /* changed paths from the watcher, each ending in '\n' */
+	struct mg_mgr *mgr;
+	unsigned long lid; /* listener; receives every wakeup */
+} Inbox;
+
+static void
+inbox_ring(Inbox *in)
+{
+	(void)mg_wakeup(in->mgr, in->lid, "", 1);
+}
+static void
+inbox_render(Inbox *in, Render *r)
+{
+	pthread_mutex_lock(&in->mu);
+	r->next = in->done;
+	in->done = r;
+	pthread_mutex_unlock(&in->mu);
+	inbox_ring(in);
+}
+/* "*\n" when the paths cannot be queued: a reload of every page */
+static void
+inbox_paths(Inbox *in, const char *p, size_t n)
+{
+	pthread_mutex_lock(&in->mu);
+	if (buf_putn(&in->paths, p, n) != 0)
+		(void)buf_putn(&in->paths, "*\n", 2);
+	pthread_mutex_unlock(&in->mu);
+	inbox_ring(in);
+}
+
+static void
+render_free(Render *r)
+{
+	free(r->mdp);
+	free(r->route);
+	free(r->body.p);
+	free(r->gz);
+	deps_free(&r->deps);
+	free(r->w);
+	free(r);
+}
+
+typedef struct {
+	const char *root;
+	LayoutCache layouts; /* shared with the render workers */
+	RenderCache cache;   /* loop thread only */
+	AssetCache assets;   /* loop thread only */
+	Validators vals;     /* loop thread only */
+	int live;            /* -l: inject LIVE_SNIPPET, serve LIVE_PATH */
+	Inbox inbox;
+	RenderQ rq;
+	Render *inflight;
+	pthread_t *ths;
+	int nthreads;
+} ServeCtx;
+
+/* Live reload (-l): rendered pages carry a script listening on LIVE_PATH.
+ * A watcher thread hands changed paths to the loop on the Inbox, and
+ * the loop tells every listener which route changed, or "*" for a change it
+ * cannot pin to pages (a stylesheet, say). */
+
+#define LIVE_PATH "/__huap/events"
+#define LIVE_SNIPPET                                                        \
+	"<script>new EventSource(\"" LIVE_PATH "\").addEventListener("     \
+	"\"change\",function(e){var p=location.pathname;if(p===\"/\")"      \
+	"p=\"/index\";if(e.data===\"*\"||e.data===p)location.reload()})"     \
+	"</script>\n"
+#define LIVE_MARK 'L' /* c->data[0] of an event stream connection */
+
+/* put LIVE_SNIPPET before the last </body>, or at the end */
+static void
+live_inject(Buf *b)
+{
+	size_t n = sizeof(LIVE_SNIPPET) - 1, at = b->len;
+	for (size_t i = b->len; i >= 7; i--) {
+		if (memcmp(b->p + i - 7, "</body>", 7) == 0) {
+			at = i - 7;
+			break;
+		}
+	}
+	if (buf_grow(b, n) != 0)
+		return;
+	memmove(b->p + at + n, b->p + at, b->len - at);
+	memcpy(b->p + at, LIVE_SNIPPET, n);
+	b->len += n;
+}
+
+static void
+live_send(struct mg_mgr *mgr, const char *route)
+{
+	for (struct mg_connection *c = mgr->conns; c; c = c->next)
+		if (c->data[0] == LIVE_MARK)
+			mg_printf(c, "event: change\ndata: %s\n\n", route);
+}
+
+/* "./posts/a.md" -> "/posts/a" */
+static void
+live_route(const ServeCtx *ctx, const char *src, char *out, size_t cap)
+{
+	size_t rlen = strlen(ctx->root);
+	const char *rel = strncmp(src, ctx->root, rlen) == 0 ? src + rlen : src;
+	while (*rel == '/')
+		rel++;
+	size_t n = strlen(rel);
+	if (has_ext(rel, ".md"))
+		n -= 3;
+	snprintf(out, cap, "/%.*s", (int)n, rel);
+}
+
+/* path changed on disk: announce its own route and every cached page
+ * built from it */
+static void
+live_changed(struct mg_mgr *mgr, ServeCtx *ctx, const char *path)
+{
+	char route[1024];
+	int n = 0;
+	ac_changed(&ctx->assets, path);
+	if (strcmp(path, "*") != 0) {
+		if (has_ext(path, ".md")) {
+			live_route(ctx, path, route, sizeof(route));
+			live_send(mgr, route);
+			n++;
+		}
+		for (CacheEnt *e = ctx->cache.head; e; e = e->next) {
+			for (size_t i = 0; i < e->deps.n; i++) {
+				if ((!same_path(e->deps.v[i].path, path) &&
+				    !in_dir(e->deps.v[i].path, path)) ||
+				    strcmp(e->key, path) == 0)
+					continue;
+				live_route(ctx, e->key, route, sizeof(route));
+				live_send(mgr, route);
+				n++;
+				break;
+			}
+		}
+	}
+	if (!n)
+		live_send(mgr, "*");
+}
+
+static char *
+req_to_md_path(const char *root, struct mg_str uri)
+{
+	/* uri is not NUL-terminated; copy into a buffer */
+	char *u = malloc(uri.len + 1);
+	if (!u)
+		return NULL;
+	memcpy(u, uri.buf, uri.len);
+	u[uri.len] = '\0';
+
+	/* strip query etc already handled by mongoose in hm->uri; still
+	 * normalize */
+	char *path = u;
+	if (path[0] == '\0') {
+		free(u);
+		return NULL;
+	}
+
+	/* map "/" to "/index" */
+	if (strcmp(path, "/") == 0) {
+		free(u);
+		u = strdup("/index");
+		if (!u)
+			return NULL;
+		path = u;
+	}
+
+	/* prevent simple .. traversal (keep it basic) */
+	if (strstr(path, "..")) {
+		free(u);
+		return NULL;
+	}
+
+	/* root + path(without leading /) + ".md" */
+	const char *rel = (path[0] == '/') ? path + 1 : path;
+	size_t need = strlen(root) + 1 + strlen(rel) + 3 + 1;
+	char *mdp = malloc(need);
+	if (!mdp) {
+		free(u);
+		return NULL;
+	}
+	snprintf(mdp, need, "%s/%s.md", root, rel);
+
+	free(u);
+	return mdp;
+}
+
+static int
+accepts_gzip(struct mg_http_message *hm)
+{
+	struct mg_str *ae = mg_http_get_header(hm, "Accept-Encoding");
+	return ae && mg_match(*ae, mg_str("*gzip*"), NULL);
+}
+
+static void
+reply_html(struct mg_connection *c, const void *body, size_t len, int gz,
+    const Validator *v)
+{
+	char vh[256];
+	val_headers(v, gz, vh, sizeof(vh));
+	mg_printf(c,
+	    "HTTP/1.1 200 OK\r\n"
+	    "Content-Type: text/html; charset=utf-8\r\n"
+	    "Vary: Accept-Encoding\r\n"
+	    "%s%s"
+	    "Content-Length: %lu\r\n\r\n",
+	    gz ? "Content-Encoding: gzip\r\n" : "", vh, (unsigned long)len);
+	mg_send(c, body, len);
+	stats_bytes(0, len);
+	c->is_resp = 0; /* lets mongoose read the next request */
+}
+
+/* a complete, uncached reply generated in the loop */
+static void
+reply_body(struct mg_connection *c, const char *type, const void *body,
+    size_t len)
+{
+	mg_printf(c,
+	    "HTTP/1.1 200 OK\r\n"
+	    "Content-Type: %s\r\n"
+	    "Cache-Control: no-cache\r\n"
+	    "Content-Length: %lu\r\n\r\n",
+	    type, (unsigned long)len);
+	mg_send(c, body, len);
+	c->is_resp = 0;
+}
+
+/* Queue n bytes, writing what the socket takes at once when nothing is
+ * queued ahead of them; 0 if out of memory */
+static int
+send_now(struct mg_connection *c, const char *p, size_t n)
+{
+	if (c->send.len == 0) {
+		long w = mg_io_send(c, p, n);
+		if (w > 0) {
+			p += w;
+			n -= (size_t)w;
+		}
+	}
+	return n == 0 || mg_send(c, p, n);
+}
+
+static void
+reply_not_modified(struct mg_connection *c, int gz, const Validator *v)
+{
+	char vh[256];
+	val_headers(v, gz, vh, sizeof(vh));
+	mg_printf(c,
+	    "HTTP/1.1 304 Not Modified\r\n"
+	    "Vary: Accept-Encoding\r\n"
+	    "%s\r\n",
+	    vh);
+	c->is_resp = 0;
+}
+
+/* gzip is only ever made on the render workers: without z the identity
+ * body goes out, which any client accepts */
+static void
+reply_page(struct mg_connection *c, int gz, const char *body, size_t len,
+    const unsigned char *z, size_t zlen, const Validator *v)
+{
+	if (gz && z)
+		reply_html(c, z, zlen, 1, v);
+	else
+		reply_html(c, body ? body : "", len, 0, v);
+}
+
+/* render mdp wrapped in its layout into body; deps receives every input.
+ * Runs on the render workers, with scratch memory from their arena a. */
+static int
+render_page(ServeCtx *ctx, Arena *a, Sink *sink, const char *mdp,
+    const char *route, Buf *body, Deps *deps)
+{
+	(void)deps_add(deps, mdp);
+	Layout *layout = lc_for_page(&ctx->layouts, mdp, deps);
+	int rc = -1;
+
+	uint64_t t0 = stats_now();
+	size_t mdlen;
+	char *mdsrc = read_file(a, mdp, &mdlen);
+	if (!mdsrc)
+		goto out;
+	stats_stage(ST_READ, t0);
+	stats_bytes(mdlen, 0);
+
+	PageVars v;
+	if (layout) {
+		struct stat st;
+		page_vars_init(&v, mdsrc, mdp, route,
+		    stat(mdp, &st) == 0 ? st.st_mtime : 0);
+	}
+
+	t0 = stats_now();
+	size_t plen;
+	char *prep = preprocess(a, mdsrc, strlen(mdsrc), deps, &plen);
+	if (!prep)
+		goto out;
+	stats_stage(ST_PREPROCESS, t0);
+
+	t0 = stats_now();
+	sink_open(sink, -1, body);
+	rc = render_to_sink(sink, layout, &v, prep, plen, &serve_links);
+	if (rc == 0 && ctx->live)
+		live_inject(body);
+	stats_stage(ST_RENDER, t0);
+out:
+	lc_release(&ctx->layouts, layout);
+	return rc;
+}
+
+static void *
+render_main(void *arg)
+{
+	ServeCtx *ctx = arg;
+	Sink *sink = malloc(sizeof(*sink)); /* reused by every page */
+	if (!sink) {
+		perror("malloc");
+		exit(1);
+	}
+	Arena a; /* scratch for each page, reset after it */
+	arena_init(&a, ARENA_BLOCK);
+	Render *r;
+	while ((r = rq_pop(&ctx->rq))) {
+		r->rc = render_page(ctx, &a, sink, r->mdp, r->route, &r->body,
+		    &r->deps);
+		if (r->rc == 0 && __atomic_load_n(&r->want_gz, __ATOMIC_ACQUIRE))
+			r->gz = dfl_gzip(r->body.p ? r->body.p : "", r->body.len,
+			    DFL_LEVEL_DEFAULT, &r->gzlen);
+		arena_reset(&a);
+		inbox_render(&ctx->inbox, r);
+	}
+	arena_destroy(&a);
+	free(sink);
+	return NULL;
+}
+
+/* loop thread: a worker finished r */
+static void
+render_done(struct mg_mgr *mgr, ServeCtx *ctx, Render *r)
+{
+	for (Render **pp = &ctx->inflight; *pp; pp = &(*pp)->inext) {
+		if (*pp == r) {
+			*pp = r->inext;
+			break;
+		}
+	}
+	CacheEnt *e = NULL;
+	Validator *v = NULL;
+	if (r->rc == 0) {
+		v = val_put(&ctx->vals, r->mdp, &r->deps, (uint64_t)ctx->live);
+		e = rc_put(&ctx->cache, r->mdp, &r->body, &r->deps);
+		if (e && r->gz) {
+			rc_attach_gz(&ctx->cache, e, r->gz, r->gzlen);
+			r->gz = NULL;
+		}
+	}
+	const char *body = e ? e->body : r->body.p;
+	size_t len = e ? e->len : r->body.len;
+	const unsigned char *z = e ? e->gz : r->gz;
+	size_t zlen = e ? e->gzlen : r->gzlen;
+	for (size_t i = 0; i < r->nw; i++) {
+		struct mg_connection *c;
+		for (c = mgr->conns; c && c->id != r->w[i].id; c = c->next)
+			;
+		if (!c)
+			continue; /* went away while we rendered */
+		if (r->rc != 0)
+			mg_http_reply(c, 500, "", "Render failed\n");
+		else
+			reply_page(c, r->w[i].gz, body, len, z, zlen, v);
+		stats_req(RQ_RENDER, r->w[i].t0);
+		if (r->w[i].close)
+			c->is_draining = 1;
+	}
+	render_free(r);
+}
+
+/* loop thread: answer finished renders and announce changed paths */
+static void
+inbox_drain(struct mg_mgr *mgr, ServeCtx *ctx)
+{
+	Inbox *in = &ctx->inbox;
+	pthread_mutex_lock(&in->mu);
+	Render *done = in->done;
+	Buf paths = in->paths;
+	in->done = NULL;
+	memset(&in->paths, 0, sizeof(in->paths));
+	pthread_mutex_unlock(&in->mu);
+
+	while (done) {
+		Render *r = done;
+		done = r->next;
+		render_done(mgr, ctx, r);
+	}
+	for (size_t i = 0; i < paths.len;) {
+		char *p = paths.p + i, *nl = memchr(p, '\n', paths.len - i);
+		if (!nl)
+			break;
+		*nl = '\0';
+		live_changed(mgr, ctx, p);
+		i += (size_t)(nl - p) + 1;
+	}
+	free(paths.p);
+}
+
+static int
+wants_close(struct mg_http_message *hm)
+{
+	struct mg_str *cc = mg_http_get_header(hm, "Connection");
+	return cc && mg_strcasecmp(*cc, mg_str("close")) == 0;
+}
+
+/* A static file from the asset cache, read into it on a miss. 0 leaves the
+ * request to mg_http_serve_dir(): a method other than GET or HEAD, a Range
+ * request, a directory, a missing or big file, or a path it would resolve
+ * differently. */
+static int
+serve_asset(struct mg_connection *c, struct mg_http_message *hm,
+    ServeCtx *ctx, uint64_t t0)
+{
+	char key[4096];
+	size_t rl = strlen(ctx->root);
+	int head = mg_strcasecmp(hm->method, mg_str("HEAD")) == 0;
+	if (!ctx->assets.budget || rl + hm->uri.len >= sizeof(key) ||
+	    (!head && mg_strcasecmp(hm->method, mg_str("GET")) != 0) ||
+	    mg_http_get_header(hm, "Range"))
+		return 0;
+	memcpy(key, ctx->root, rl);
+	int n = mg_url_decode(hm->uri.buf, hm->uri.len, key + rl,
+	    sizeof(key) - rl, 0);
+	if (n < 1 || key[rl] != '/' || strstr(key + rl, "..") ||
+	    memchr(key + rl, '\0', (size_t)n) != NULL)
+		return 0;
+
+	Asset *e = ac_get(&ctx->assets, key);
+	if (!e) {
+		struct stat st;
+		if (stat(key, &st) != 0 || !S_ISREG(st.st_mode) ||
+		    !(e = ac_put(&ctx->assets, key, &st)))
+			return 0;
+	}
+	int gz = e->zresp && accepts_gzip(hm);
+	Validator v = {.tag = e->tag, .mtime = e->mtime};
+	if (not_modified(hm, &v, gz)) {
+		reply_not_modified(c, gz, &v);
+		stats_req(RQ_304, t0);
+		return 1;
+	}
+	size_t hlen = gz ? e->zhlen : e->hlen;
+	size_t len = head ? 0 : gz ? e->zlen : e->len;
+	if (!send_now(c, gz ? e->zresp : e->resp, hlen + len))
+		c->is_closing = 1;
+	c->is_resp = 0;
+	if (wants_close(hm))
+		c->is_draining = 1;
+	stats_bytes(0, len);
+	stats_req(RQ_ASSET, t0);
+	return 1;
+}
+
+static void
+serve_markdown(struct mg_connection *c, struct mg_http_message *hm,
+    ServeCtx *ctx, uint64_t t0)
+{
+	char *mdp = req_to_md_path(ctx->root, hm->uri);
+	if (!mdp) {
+		mg_http_reply(c, 400, "", "Bad request\n");
+		return;
+	}
+
+	/* a current validator settles conditional requests with no I/O
+	 * beyond the stats it just made */
+	int gz = accepts_gzip(hm);
+	Validator *v = val_get(&ctx->vals, mdp);
+	if (v && not_modified(hm, v, gz)) {
+		free(mdp);
+		reply_not_modified(c, gz, v);
+		stats_req(RQ_304, t0);
+		return;
+	}
+
+	/* an entry without the gzip this client takes is rendered again,
+	 * gzip included, rather than compressed here on the loop thread */
+	CacheEnt *e = rc_get(&ctx->cache, mdp);
+	if (e && (!gz || e->gz)) {
+		free(mdp);
+		reply_page(c, gz, e->body, e->len, e->gz, e->gzlen, v);
+		stats_req(RQ_CACHED, t0);
+		return;
+	}
+
+	struct stat st;
+	if (stat(mdp, &st) != 0 || !S_ISREG(st.st_mode)) {
+		free(mdp);
+		mg_http_reply(c, 404, "", "Not found\n");
+		return;
+	}
+
+	/* c->is_resp stays set until render_done() answers */
+	Waiter w = {c->id, gz, wants_close(hm), t0};
+	Render *r;
+	for (r = ctx->inflight; r; r = r->inext)
+		if (mg_strcmp(hm->uri, mg_str(r->route)) == 0)
+			break;
+	if (r) {
+		free(mdp);
+	} else {
+		r = calloc(1, sizeof(*r));
+		if (!r || !(r->route = strndup(hm->uri.buf, hm->uri.len))) {
+			free(r);
+			free(mdp);
+			mg_http_reply(c, 500, "", "oom\n");
+			return;
+		}
+		r->mdp = mdp;
+		r->want_gz = gz;
+		r->inext = ctx->inflight;
+		ctx->inflight = r;
+		rq_push(&ctx->rq, r);
+	}
+	/* too late once the worker has rendered: that waiter gets identity */
+	if (gz)
+		__atomic_store_n(&r->want_gz, 1, __ATOMIC_RELEASE);
+	if (r->nw == r->capw) {
+		size_t ncap = r->capw ? r->capw * 2 : 4;
+		Waiter *nw = realloc(r->w, ncap * sizeof(*nw));
+		if (!nw) {
+			mg_http_reply(c, 500, "", "oom\n");
+			return;
+		}
+		r->w = nw;
+		r->capw = ncap;
+	}
+	r->w[r->nw++] = w;
+}
+
+/* the endpoints both serve modes answer: 1 if hm was one of them */
+static int
+serve_api(struct mg_connection *c, struct mg_http_message *hm)
+{
+	if (stats_on && mg_match(hm->uri, mg_str(METRICS_PATH), NULL)) {
+		Buf b = {0};
+		stats_metrics(&b);
+		reply_body(c, "text/plain; version=0.0.4", b.p, b.len);
+		free(b.p);
+		return 1;
+	}
+
+	if (search_index && mg_match(hm->uri, mg_str(SEARCH_PATH), NULL)) {
+		char q[256], n[16];
+		int limit = SEARCH_RESULTS;
+		if (mg_http_get_var(&hm->query, "q", q, sizeof(q)) < 0)
+			q[0] = '\0';
+		if (mg_http_get_var(&hm->query, "n", n, sizeof(n)) > 0)
+			limit = atoi(n);
+		if (limit < 1 || limit > SEARCH_RESULTS_MAX)
+			limit = limit < 1 ? 1 : SEARCH_RESULTS_MAX;
+		Buf b = {0};
+		sidx_query(search_idx(), q, limit, &b);
+		reply_body(c, "application/json", b.p, b.len);
+		free(b.p);
+		return 1;
+	}
+	return 0;
+}
+
+static void
+http_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+	ServeCtx *ctx = (ServeCtx *)c->fn_data;
+	if (ev == MG_EV_WAKEUP ||
+	    (ev == MG_EV_POLL && c->id == ctx->inbox.lid)) {
+		inbox_drain(c->mgr, ctx);
+		return;
+	}
+	if (ev != MG_EV_HTTP_MSG)
+		return;
+	struct mg_http_message *hm = ev_data;
+	uint64_t t0 = stats_now();
+
+	if (serve_api(c, hm))
+		return;
+
+	if (feed.url && mg_match(hm->uri, mg_str("/" FEED_NAME), NULL)) {
+		Buf b = {0};
+		if (feed_render(&b) != 0 || !b.p) {
+			mg_http_reply(c, 500, "", "cannot read " FEED_DIR "/\n");
+		} else {
+			reply_body(c, "application/rss+xml", b.p, b.len);
+		}
+		free(b.p);
+		return;
+	}
+
+	if (ctx->live && mg_match(hm->uri, mg_str(LIVE_PATH), NULL)) {
+		mg_printf(c, "HTTP/1.1 200 OK\r\n"
+			     "Content-Type: text/event-stream\r\n"
+			     "Cache-Control: no-cache\r\n\r\n"
+			     ": huap\n\n");
+		c->data[0] = LIVE_MARK;
+		return;
+	}
+
+	/* If request path has an extension, serve raw file unprocessed */
+	{
+		char *u = malloc(hm->uri.len + 1);
+		if (!u) {
+			mg_http_reply(c, 500, "", "oom\n");
+			return;
+		}
+		memcpy(u, hm->uri.buf, hm->uri.len);
+		u[hm->uri.len] = '\0';
+		int ext = path_has_extension(u);
+		free(u);
+
+		if (ext && serve_asset(c, hm, ctx, t0))
+			return;
+		if (ext) {
+			struct mg_http_serve_opts opts;
+			memset(&opts, 0, sizeof(opts));
+			opts.root_dir = ctx->root;
+			/* mongoose picks up a precompressed FILE.gz itself */
+			opts.extra_headers = "Vary: Accept-Encoding\r\n";
+			opts.mime_types = mime_list();
+			mg_http_serve_dir(c, hm, &opts);
+			stats_req(RQ_STATIC, t0);
+			return;
+		}
+	}
+
+	/* No extension => render Markdown */
+	serve_markdown(c, hm, ctx, t0);
+}
+
+#ifdef __linux__
+typedef struct {
+	Watch w;
+	Inbox *in;
+	int stop[2]; /* pipe; written to end the watcher */
+	pthread_t th;
+} LiveWatch;
+
+static void *
+live_main(void *arg)
+{
+	LiveWatch *lw = arg;
+	Deps changed = {0};
+	while (watch_collect(&lw->w, &changed) == 0) {
+		Buf msg = {0};
+		if (lw->w.overflow) {
+			lw->w.overflow = 0;
+			buf_puts(&msg, "*\n");
+		}
+		for (size_t i = 0; i < changed.n; i++) {
+			const char *p = changed.v[i].path;
+			struct stat st;
+			if (lstat(p, &st) == 0 && S_ISDIR(st.st_mode)) {
+				watch_walk(&lw->w, p);
+				continue;
+			}
+			buf_puts(&msg, p);
+			buf_putn(&msg, "\n", 1);
+		}
+		if (msg.len)
+			inbox_paths(lw->in, msg.p, msg.len);
+		free(msg.p);
+		deps_free(&changed);
 	}
+	deps_free(&changed);
 	return NULL;
 }
 
-/* Build traversal (fts) */
+static int
+live_start(LiveWatch *lw, Inbox *in, const char *root)
+{
+	memset(lw, 0, sizeof(*lw));
+	lw->in = in;
+	if (pipe(lw->stop) != 0)
+		return -1;
+	lw->w.stopfd = lw->stop[0];
+	lw->w.fd = inotify_init1(IN_CLOEXEC);
+	if (lw->w.fd >= 0) {
+		watch_walk(&lw->w, root);
+		if (pthread_create(&lw->th, NULL, live_main, lw) == 0)
+			return 0;
+	}
+	if (lw->w.fd >= 0)
+		watch_free(&lw->w);
+	close(lw->stop[0]);
+	close(lw->stop[1]);
+	return -1;
+}
 
 static void
-build_tree_parallel(const char *srcroot, const char *dstroot, int nthreads)
+live_stop(LiveWatch *lw)
 {
-	/* layout is discovered in srcroot/layout.html (optional) */
-	char *layout_path = xjoin2(srcroot, "layout.html");
-	const char *layout_use = NULL;
-	struct stat st;
-	if (layout_path && stat(layout_path, &st) == 0 && S_ISREG(st.st_mode))
-		layout_use = layout_path;
+	ssize_t r = write(lw->stop[1], "", 1);
+	(void)r;
+	pthread_join(lw->th, NULL);
+	watch_free(&lw->w);
+	close(lw->stop[0]);
+	close(lw->stop[1]);
+}
+#else
+typedef int LiveWatch;
 
-	if (mkdir(dstroot, 0755) == -1 && errno != EEXIST) {
-		perror("mkdir dest");
-		free(layout_path);
-		exit(1);
-	}
+static int
+live_start(LiveWatch *lw, Inbox *in, const char *root)
+{
+	(void)lw;
+	(void)in;
+	(void)root;
+	return -1; /* needs inotify */
+}
 
-	JobQ q;
-	jq_init(&q);
+static void
+live_stop(LiveWatch *lw)
+{
+	(void)lw;
+}
+#endif
+
+static void
+serve_http(const char *root, const char *port, size_t cache_bytes,
+    size_t asset_bytes, int live, int nthreads)
+{
+	char url[128];
+	snprintf(url, sizeof(url), "http://0.0.0.0:%s", port);
+
+	ServeCtx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.root = root;
+	lc_init(&ctx.layouts, root, 1);
+	rc_init(&ctx.cache, cache_bytes);
+	ac_init(&ctx.assets, asset_bytes);
+	pthread_mutex_init(&ctx.rq.mu, NULL);
+	pthread_cond_init(&ctx.rq.cv, NULL);
+	pthread_mutex_init(&ctx.inbox.mu, NULL);
+
+	signal(SIGINT, on_sig);
+	signal(SIGTERM, on_sig);
+
+	struct mg_mgr mgr;
+	mg_mgr_init(&mgr);
 
-	WorkerCtx wctx = {.q = &q, .layout_path = layout_use};
+	struct mg_connection *lc = mg_http_listen(&mgr, url, http_fn, &ctx);
+	if (lc == NULL || !mg_wakeup_init(&mgr)) {
+		fprintf(stderr, "Failed to listen on %s\n", url);
+		mg_mgr_free(&mgr);
+		rc_free(&ctx.cache);
+		ac_free(&ctx.assets);
+		lc_free(&ctx.layouts);
+		exit(1);
+	}
+	ctx.inbox.mgr = &mgr;
+	ctx.inbox.lid = lc->id;
 
 	if (nthreads < 1)
 		nthreads = 1;
-	pthread_t *ths = calloc((size_t)nthreads, sizeof(*ths));
-	if (!ths) {
+	ctx.ths = calloc((size_t)nthreads, sizeof(*ctx.ths));
+	if (!ctx.ths) {
 		perror("calloc");
-		free(layout_path);
 		exit(1);
 	}
-
-	for (int i = 0; i < nthreads; i++) {
-		if (pthread_create(&ths[i], NULL, worker_main, &wctx) != 0) {
+	for (ctx.nthreads = 0; ctx.nthreads < nthreads; ctx.nthreads++) {
+		if (pthread_create(&ctx.ths[ctx.nthreads], NULL, render_main,
+			&ctx) != 0) {
 			fprintf(stderr, "pthread_create failed\n");
 			exit(1);
 		}
 	}
 
-	char *paths[] = {(char *)srcroot, NULL};
-	FTS *fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
-	if (!fts) {
-		perror("fts_open");
-		exit(1);
+	LiveWatch lw;
+	if (live) {
+		if (live_start(&lw, &ctx.inbox, root) == 0)
+			ctx.live = 1;
+		else
+			fprintf(stderr, "live reload unavailable\n");
 	}
 
-	size_t base = strlen(srcroot);
-
-	while (1) {
-		FTSENT *ent = fts_read(fts);
-		if (!ent)
-			break;
-
-		if (ent->fts_level == 0)
-			continue;
-
-		/* skip dotfiles/dirs like original */
-		if (ent->fts_name[0] == '.') {
-			if (ent->fts_info == FTS_D)
-				fts_set(fts, ent, FTS_SKIP);
-			continue;
-		}
-
-		const char *src = ent->fts_path;
-		const char *rel = src + base;
-		if (*rel == '/')
-			rel++;
-
-		char *dst = xjoin2(dstroot, rel);
-		if (!dst) {
-			perror("malloc");
-			continue;
-		}
+	printf("Serving %s on %s (Ctrl-C to stop)\n", root, url);
+	while (!g_stop)
+		mg_mgr_poll(&mgr, 200);
 
-		if (ent->fts_info == FTS_D) {
-			if (mkdir(dst, 0755) == -1 && errno != EEXIST)
-				perror("mkdir");
-			free(dst);
-			continue;
-		}
+	if (ctx.live)
+		live_stop(&lw);
+	rq_close(&ctx.rq);
+	for (int i = 0; i < ctx.nthreads; i++)
+		pthread_join(ctx.ths[i], NULL);
+	free(ctx.ths);
+	/* renders left in the inbox are still in flight */
+	while (ctx.inflight) {
+		Render *r = ctx.inflight;
+		ctx.inflight = r->inext;
+		render_free(r);
+	}
+	free(ctx.inbox.paths.p);
+	pthread_mutex_destroy(&ctx.inbox.mu);
+	mg_mgr_free(&mgr);
+	rc_report(&ctx.cache);
+	rc_free(&ctx.cache);
+	ac_report(&ctx.assets);
+	ac_free(&ctx.assets);
+	val_free(&ctx.vals);
+	lc_free(&ctx.layouts);
+	includes_free();
+}
 
-		if (ent->fts_info != FTS_F) {
-			free(dst);
-			continue;
-		}
+/* Serving a bundle (--bundle FILE with :PORT). A request is a binary
+ * search in the mapping and a send of the precomputed headers and the body
+ * straight from it: nothing is opened, stat()ed or read per request. The
+ * body goes to the socket with mg_io_send() for as long as it takes data;
+ * only when it is full is a chunk queued in c->send, so that mongoose wakes
+ * us with MG_EV_WRITE once it drains. c->is_resp stays set meanwhile, which
+ * holds back pipelined requests. The file is checked once a second and
+ * mapped again when a build replaced it; the old mapping goes away with the
+ * last connection sending from it. */
 
-		/* ensure parent exists (cheap safety net) */
-		{
-			char *slash = strrchr(dst, '/');
-			if (slash) {
-				*slash = '\0';
-				if (mkdir_p(dst, 0755) == -1 && errno != EEXIST)
-					perror("mkdir_p");
-				*slash = '/';
-			}
-		}
+#define BUNDLE_MARK 'B'        /* c->data[0] while a body is being sent */
+#define BUNDLE_CHUNK 65536     /* queued when the socket is full */
+#define BUNDLE_CHECK_MS 1000
 
-		if (has_ext(ent->fts_name, ".md")) {
-			char *dst2 = md_to_html_ext(dst);
-			free(dst);
-			if (!dst2)
-				continue;
-			if (!needs_rebuild_from_mtime(src, dst2)) {
-				free(dst2);
-				continue;
-			}
-			dst = dst2;
-		} else {
-			if (!needs_rebuild_from_mtime(src, dst)) {
-				free(dst);
-				continue;
-			}
-		}
+/* c->data of a connection that is sending from a bundle */
+typedef struct {
+	char mark;
+	char close; /* client sent "Connection: close" */
+	Bundle *bd;
+	const char *p;
+	size_t left;
+} BnSend;
 
-		Job *j = calloc(1, sizeof(*j));
-		if (!j) {
-			perror("calloc");
-			free(dst);
-			continue;
-		}
+_Static_assert(sizeof(BnSend) <= sizeof(((struct mg_connection *)0)->data),
+    "BnSend must fit in c->data");
 
-		j->src = strdup(src);
-		if (!j->src) {
-			free(j);
-			free(dst);
-			continue;
-		}
-		j->dst = dst;
-		j->t = has_ext(ent->fts_name, ".md") ? JOB_MD : JOB_COPY;
+static Bundle *bundle_cur;
 
-		jq_push(&q, j);
+static void
+bnd_release(Bundle *bd)
+{
+	if (--bd->refs == 0 && bd != bundle_cur) {
+		bnd_close(bd);
+		free(bd);
 	}
-
-	(void)fts_close(fts);
-	jq_close(&q);
-
-	for (int i = 0; i < nthreads; i++)
-		pthread_join(ths[i], NULL);
-
-	free(ths);
-	free(layout_path);
 }
 
-/* Serve mode (mongoose) */
-
-static volatile sig_atomic_t g_stop = 0;
+/* map bundle_path again if a build replaced it */
 static void
-on_sig(int sig)
+bnd_check(void)
 {
-	(void)sig;
-	g_stop = 1;
+	static struct stat tried;
+	struct stat st;
+	if (stat(bundle_path, &st) != 0 ||
+	    (st.st_dev == tried.st_dev && st.st_ino == tried.st_ino &&
+		st.st_size == tried.st_size && st.st_mtime == tried.st_mtime))
+		return;
+	tried = st;
+	Bundle *bd = malloc(sizeof(*bd));
+	if (!bd || bnd_open(bd, bundle_path) != 0) {
+		/* the last good one stays */
+		free(bd);
+		fprintf(stderr, "ignoring unreadable bundle %s\n", bundle_path);
+		return;
+	}
+	Bundle *old = bundle_cur;
+	bundle_cur = bd;
+	if (old && old->refs == 0) {
+		bnd_close(old);
+		free(old);
+	}
 }
 
-typedef struct {
-	const char *root;
-	char *layout_path; /* root/layout.html (optional) */
-} ServeCtx;
-
-static char *
-req_to_md_path(const char *root, struct mg_str uri)
+/* the entry for uri: the path itself, then PATH.html, then PATH/index.html */
+static const BnEnt *
+bnd_route(const Bundle *bd, struct mg_str uri)
 {
-	/* uri is not NUL-terminated; copy into a buffer */
-	char *u = malloc(uri.len + 1);
-	if (!u)
-		return NULL;
-	memcpy(u, uri.buf, uri.len);
-	u[uri.len] = '\0';
-
-	/* strip query etc already handled by mongoose in hm->uri; still
-	 * normalize */
-	char *path = u;
-	if (path[0] == '\0') {
-		free(u);
+	char path[4096];
+	int n = mg_url_decode(uri.buf, uri.len, path, sizeof(path) - 16, 0);
+	if (n < 1 || path[0] != '/')
 		return NULL;
+	const char *rel = path + 1;
+	const BnEnt *e = *rel ? bnd_find(bd, rel) : NULL;
+	if (!e && path[n - 1] != '/') {
+		memcpy(path + n, ".html", 6);
+		e = bnd_find(bd, rel);
+		memcpy(path + n, "/", 2);
+		n++;
 	}
-
-	/* map "/" to "/index" */
-	if (strcmp(path, "/") == 0) {
-		free(u);
-		u = strdup("/index");
-		if (!u)
-			return NULL;
-		path = u;
+	if (!e) {
+		memcpy(path + n, "index.html", 11);
+		e = bnd_find(bd, rel);
 	}
+	return e;
+}
 
-	/* prevent simple .. traversal (keep it basic) */
-	if (strstr(path, "..")) {
-		free(u);
-		return NULL;
+/* send what is left of the body in c->data; ends the response when done */
+static void
+bnd_pump(struct mg_connection *c)
+{
+	BnSend s;
+	memcpy(&s, c->data, sizeof(s));
+	while (s.left && c->send.len == 0) {
+		long n = mg_io_send(c, s.p, s.left);
+		if (n == MG_IO_WAIT) {
+			size_t k = s.left;
+			if (k > BUNDLE_CHUNK)
+				k = BUNDLE_CHUNK;
+			if (!mg_send(c, s.p, k))
+				break; /* retried on the next poll */
+			s.p += k;
+			s.left -= k;
+			break;
+		}
+		if (n <= 0) {
+			c->is_closing = 1;
+			break;
+		}
+		s.p += n;
+		s.left -= (size_t)n;
+	}
+	if (s.left || c->is_closing) {
+		memcpy(c->data, &s, sizeof(s));
+		return;
 	}
+	c->data[0] = '\0';
+	bnd_release(s.bd);
+	c->is_resp = 0; /* lets mongoose read the next request */
+	if (s.close)
+		c->is_draining = 1;
+}
 
-	/* root + path(without leading /) + ".md" */
-	const char *rel = (path[0] == '/') ? path + 1 : path;
-	size_t need = strlen(root) + 1 + strlen(rel) + 3 + 1;
-	char *mdp = malloc(need);
-	if (!mdp) {
-		free(u);
-		return NULL;
+/* digits of s from *i on; -1 if there are none or too many */
+static int64_t
+range_num(struct mg_str s, size_t *i)
+{
+	int64_t v = 0;
+	size_t from = *i;
+	for (; *i < s.len && isdigit((unsigned char)s.buf[*i]); (*i)++) {
+		if (v > (INT64_MAX - 9) / 10)
+			return -1;
+		v = v * 10 + (s.buf[*i] - '0');
 	}
-	snprintf(mdp, need, "%s/%s.md", root, rel);
+	return *i > from ? v : -1;
+}
 
-	free(u);
-	return mdp;
+/* A single "Range: bytes=A-B", "bytes=A-" or "bytes=-N" of a len-byte body:
+ * 1 with *off and *n set, -1 if it lies past the end (416), 0 to answer
+ * with the whole body. That is also the answer to a list of ranges, to
+ * anything unparsed and to an If-Range that is not the body's own ETag,
+ * which RFC 9110 all allow. */
+static int
+http_range(struct mg_http_message *hm, uint64_t tag, uint64_t len,
+    uint64_t *off, uint64_t *n)
+{
+	struct mg_str *r = mg_http_get_header(hm, "Range");
+	struct mg_str *ir = mg_http_get_header(hm, "If-Range");
+	if (!r || r->len < 7 ||
+	    mg_strcasecmp(mg_str_n(r->buf, 6), mg_str("bytes=")) != 0)
+		return 0;
+	if (ir) {
+		char want[24];
+		snprintf(want, sizeof(want), "\"%016llx\"",
+		    (unsigned long long)tag);
+		if (mg_strcmp(*ir, mg_str(want)) != 0)
+			return 0;
+	}
+	size_t i = 6;
+	int64_t a = -1, b = -1;
+	if (r->buf[i] == '-') {
+		i++;
+		if ((b = range_num(*r, &i)) < 0 || i != r->len)
+			return 0;
+		if (b == 0)
+			return -1;
+		*n = (uint64_t)b < len ? (uint64_t)b : len;
+		*off = len - *n;
+		return len ? 1 : -1;
+	}
+	if ((a = range_num(*r, &i)) < 0 || i == r->len || r->buf[i++] != '-')
+		return 0;
+	if (i < r->len && ((b = range_num(*r, &i)) < 0 || b < a))
+		return 0;
+	if (i != r->len)
+		return 0;
+	if ((uint64_t)a >= len)
+		return -1;
+	if (b < 0 || (uint64_t)b >= len)
+		b = (int64_t)len - 1;
+	*off = (uint64_t)a;
+	*n = (uint64_t)(b - a) + 1;
+	return 1;
 }
 
+/* GET and HEAD only, as the directory server. A Range is served from the
+ * identity body with headers made here; everything else is the stored
+ * header block. */
 static void
-serve_markdown(struct mg_connection *c, struct mg_http_message *hm,
-    ServeCtx *ctx)
+bnd_reply(struct mg_connection *c, struct mg_http_message *hm, uint64_t t0)
 {
-	char *mdp = req_to_md_path(ctx->root, hm->uri);
-	if (!mdp) {
-		mg_http_reply(c, 400, "", "Bad request\n");
+	int head = mg_strcasecmp(hm->method, mg_str("HEAD")) == 0;
+	if (!head && mg_strcasecmp(hm->method, mg_str("GET")) != 0) {
+		mg_http_reply(c, 405, "Allow: GET, HEAD\r\n",
+		    "Method not allowed\n");
 		return;
 	}
-
-	struct stat st;
-	if (stat(mdp, &st) != 0 || !S_ISREG(st.st_mode)) {
-		free(mdp);
+	Bundle *bd = bundle_cur;
+	const BnEnt *e = bd ? bnd_route(bd, hm->uri) : NULL;
+	if (!e) {
 		mg_http_reply(c, 404, "", "Not found\n");
 		return;
 	}
-
-	/* render into memory, then reply */
-	Arena a;
-	arena_init(&a, 8 * 1024 * 1024);
-	char *layout = NULL;
-	if (ctx->layout_path && stat(ctx->layout_path, &st) == 0 &&
-	    S_ISREG(st.st_mode))
-		layout = read_file(&a, ctx->layout_path, 0);
-
-	char *mdsrc = read_file(&a, mdp, 0);
-	free(mdp);
-	if (!mdsrc) {
-		arena_destroy(&a);
-		mg_http_reply(c, 500, "", "Read failed\n");
-		return;
-	}
-
-	char *prep = preprocess(&a, mdsrc);
-	if (!prep) {
-		arena_destroy(&a);
-		mg_http_reply(c, 500, "", "Render failed\n");
+	int gz = e->zhlen && accepts_gzip(hm);
+	Validator v = {.tag = e->tag, .mtime = (time_t)e->mtime};
+	if (not_modified(hm, &v, gz)) {
+		reply_not_modified(c, gz, &v);
+		stats_req(RQ_304, t0);
 		return;
 	}
-	arena_reset_temp(&a);
 
-	Buf html = {0};
-	if (md_html(prep, strlen(prep), md_cb, &html, MD_DIALECT_GITHUB, 0) !=
-	    0) {
-		free(prep);
-		free(html.p);
-		arena_destroy(&a);
-		mg_http_reply(c, 500, "", "Render failed\n");
+	const char *hdr = bnd_str(bd, gz ? e->zhdr : e->hdr);
+	size_t hlen = gz ? e->zhlen : e->hlen;
+	BnSend s = {BUNDLE_MARK, (char)wants_close(hm), bd,
+		bd->map + (gz ? e->gz : e->body), gz ? e->gzlen : e->len};
+	uint64_t off = 0, n = 0;
+	int rg = http_range(hm, e->tag, e->len, &off, &n);
+	char rhdr[512];
+	if (rg < 0) {
+		char cr[64];
+		snprintf(cr, sizeof(cr), "Content-Range: bytes */%llu\r\n",
+		    (unsigned long long)e->len);
+		mg_http_reply(c, 416, cr, "");
+		stats_req(RQ_STATIC, t0);
 		return;
 	}
-	free(prep);
-
-	if (html.p)
-		postprocess_links_strip_md(html.p);
-
-	/* wrap into response body */
-	Buf body = {0};
-	if (layout) {
-		const char *ip = strstr(layout, BODY_PH);
-		if (ip) {
-			buf_putn(&body, layout, (size_t)(ip - layout));
-			buf_puts(&body, html.p ? html.p : "");
-			buf_puts(&body, ip + (sizeof(BODY_PH) - 1));
-		} else {
-			buf_puts(&body, layout);
-			buf_puts(&body, html.p ? html.p : "");
+	if (rg > 0) {
+		char vh[256];
+		http_validators(e->tag, (time_t)e->mtime, 0, vh, sizeof(vh));
+		hlen = (size_t)snprintf(rhdr, sizeof(rhdr),
+		    "HTTP/1.1 206 Partial Content\r\n"
+		    "Content-Type: %s\r\n"
+		    "Vary: Accept-Encoding\r\n"
+		    "%s"
+		    "Content-Range: bytes %llu-%llu/%llu\r\n"
+		    "Content-Length: %llu\r\n\r\n",
+		    mime_type(bnd_str(bd, e->path)), vh,
+		    (unsigned long long)off, (unsigned long long)(off + n - 1),
+		    (unsigned long long)e->len, (unsigned long long)n);
+		if (hlen >= sizeof(rhdr)) {
+			mg_http_reply(c, 500, "", "header too long\n");
+			return;
 		}
-	} else {
-		buf_puts(&body, html.p ? html.p : "");
+		hdr = rhdr;
+		s.p = bd->map + e->body + off;
+		s.left = (size_t)n;
 	}
-
-	mg_http_reply(c, 200, "Content-Type: text/html; charset=utf-8\r\n",
-	    "%.*s", (int)body.len, body.p ? body.p : "");
-
-	free(body.p);
-	free(html.p);
-	arena_destroy(&a);
+	if (head)
+		s.left = 0;
+	stats_bytes(0, s.left);
+	if (!send_now(c, hdr, hlen)) {
+		c->is_closing = 1;
+		return;
+	}
+	bd->refs++;
+	memcpy(c->data, &s, sizeof(s));
+	bnd_pump(c);
+	stats_req(RQ_STATIC, t0);
 }
 
 static void
-http_fn(struct mg_connection *c, int ev, void *ev_data)
+bundle_fn(struct mg_connection *c, int ev, void *ev_data)
 {
+	if (c->data[0] == BUNDLE_MARK) {
+		if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+			bnd_pump(c);
+		} else if (ev == MG_EV_CLOSE) {
+			BnSend s;
+			memcpy(&s, c->data, sizeof(s));
+			c->data[0] = '\0';
+			bnd_release(s.bd);
+		}
+		return;
+	}
 	if (ev != MG_EV_HTTP_MSG)
 		return;
 	struct mg_http_message *hm = ev_data;
-	ServeCtx *ctx = (ServeCtx *)c->fn_data;
-
-	/* If request path has an extension, serve raw file unprocessed */
-	{
-		char *u = malloc(hm->uri.len + 1);
-		if (!u) {
-			mg_http_reply(c, 500, "", "oom\n");
-			return;
-		}
-		memcpy(u, hm->uri.buf, hm->uri.len);
-		u[hm->uri.len] = '\0';
-		int ext = path_has_extension(u);
-		free(u);
-
-		if (ext) {
-			struct mg_http_serve_opts opts;
-			memset(&opts, 0, sizeof(opts));
-			opts.root_dir = ctx->root;
-			mg_http_serve_dir(c, hm, &opts);
-			return;
-		}
-	}
-
-	/* No extension => render Markdown */
-	serve_markdown(c, hm, ctx);
+	uint64_t t0 = stats_now();
+	if (!serve_api(c, hm))
+		bnd_reply(c, hm, t0);
 }
 
 static void
-serve_http(const char *root, const char *port)
+serve_bundle(const char *port)
 {
 	char url[128];
 	snprintf(url, sizeof(url), "http://0.0.0.0:%s", port);
 
-	ServeCtx ctx;
-	ctx.root = root;
-	ctx.layout_path = xjoin2(root, "layout.html");
+	bnd_check();
+	if (!bundle_cur) {
+		fprintf(stderr, "cannot map bundle %s\n", bundle_path);
+		exit(1);
+	}
 
 	signal(SIGINT, on_sig);
 	signal(SIGTERM, on_sig);
 
 	struct mg_mgr mgr;
 	mg_mgr_init(&mgr);
-
-	if (mg_http_listen(&mgr, url, http_fn, &ctx) == NULL) {
+	if (mg_http_listen(&mgr, url, bundle_fn, NULL) == NULL) {
 		fprintf(stderr, "Failed to listen on %s\n", url);
 		mg_mgr_free(&mgr);
-		free(ctx.layout_path);
 		exit(1);
 	}
 
-	printf("Serving %s on %s (Ctrl-C to stop)\n", root, url);
-	while (!g_stop)
+	printf("Serving %s (%u files) on %s (Ctrl-C to stop)\n", bundle_path,
+	    bundle_cur->h->n, url);
+	double last = now_ms();
+	while (!g_stop) {
 		mg_mgr_poll(&mgr, 200);
-
-	mg_mgr_free(&mgr);
-	free(ctx.layout_path);
+		if (now_ms() - last >= BUNDLE_CHECK_MS) {
+			bnd_check();
+			last = now_ms();
+		}
+	}
+	mg_mgr_free(&mgr); /* closing releases what connections held */
+	bnd_close(bundle_cur);
+	free(bundle_cur);
+	bundle_cur = NULL;
 }
 
 static int
@@ -1091,47 +7560,147 @@ usage(const char *argv0)
 	    "  %s              # serve current dir on :8080\n"
 	    "  %s :PORT        # serve current dir on :PORT\n"
 	    "  %s DESTDIR      # build into DESTDIR\n"
+	    "  %s -w DESTDIR   # build, then rebuild on changes\n"
 	    "Options:\n"
-	    "  -j N            # parallel build workers (default: CPU count)\n",
-	    argv0, argv0, argv0);
+	    "  -j N            # build / render workers (default: CPU count)\n"
+	    "  -z              # also write .gz siblings of text outputs\n"
+	    "  --explain       # print why each output is rebuilt\n"
+	    "  --io-uring      # build: batch small-file I/O through io_uring\n"
+	    "  --stats         # build: print stage timings; serve: "
+	    METRICS_PATH "\n"
+	    "  --feed URL      # write " FEED_NAME " for " FEED_DIR
+	    "/ of the site at URL\n"
+	    "  --feed-title T  # feed title (default: URL)\n"
+	    "  --feed-desc D   # feed description (default: title)\n"
+	    "  --search        # build: write " SEARCH_NAME " and " SEARCH_DIR
+	    "/*.json\n"
+	    "  --search-index F # serve: answer " SEARCH_PATH "?q= from F\n"
+	    "  --bundle FILE   # build: also pack DESTDIR into FILE; serve: "
+	    "serve FILE\n"
+	    "  -l              # serve: reload open pages when files change\n"
+	    "  -c MB           # serve render cache budget (default: %d, 0 = "
+	    "off)\n"
+	    "  --asset-cache MB # serve static file cache budget (default: %d, "
+	    "0 = off)\n",
+	    argv0, argv0, argv0, argv0, RCACHE_DEFAULT_MB, ACACHE_DEFAULT_MB);
 }
 
 int
 main(int argc, char **argv)
 {
 	int j = cpu_count();
+	long cache_mb = RCACHE_DEFAULT_MB;
+	long asset_mb = ACACHE_DEFAULT_MB;
+	int gzip = 0;
+	int explain = 0;
+	int uring = 0;
+	int watch = 0;
+	int live = 0;
 	int opt;
+	static const struct option longopts[] = {
+		{"explain", no_argument, NULL, 'E'},
+		{"io-uring", no_argument, NULL, 'U'},
+		{"stats", no_argument, NULL, 'S'},
+		{"feed", required_argument, NULL, 'F'},
+		{"feed-title", required_argument, NULL, 'T'},
+		{"feed-desc", required_argument, NULL, 'D'},
+		{"search", no_argument, NULL, 'X'},
+		{"search-index", required_argument, NULL, 'I'},
+		{"bundle", required_argument, NULL, 'B'},
+		{"asset-cache", required_argument, NULL, 'A'},
+		{NULL, 0, NULL, 0},
+	};
 
-	while ((opt = getopt(argc, argv, "j:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "c:j:lwz", longopts, NULL)) != -1) {
 		switch (opt) {
+		case 'E':
+			explain = 1;
+			break;
+		case 'U':
+			uring = 1;
+			break;
+		case 'S':
+			stats_on = 1;
+			break;
+		case 'F':
+			feed.url = optarg;
+			break;
+		case 'T':
+			feed.title = optarg;
+			break;
+		case 'D':
+			feed.desc = optarg;
+			break;
+		case 'X':
+			search_on = 1;
+			break;
+		case 'I':
+			search_index = optarg;
+			break;
+		case 'B':
+			bundle_path = optarg;
+			break;
+		case 'A':
+			asset_mb = atol(optarg);
+			if (asset_mb < 0)
+				asset_mb = 0;
+			break;
+		case 'c':
+			cache_mb = atol(optarg);
+			if (cache_mb < 0)
+				cache_mb = 0;
+			break;
 		case 'j':
 			j = atoi(optarg);
 			if (j < 1)
 				j = 1;
 			break;
+		case 'l':
+			live = 1;
+			break;
+		case 'w':
+			watch = 1;
+			break;
+		case 'z':
+			gzip = 1;
+			break;
 		default:
 			usage(argv[0]);
 			return 2;
 		}
 	}
 
+	if (feed.url && !feed.title)
+		feed.title = feed.url;
+	if (feed.url && !feed.desc)
+		feed.desc = feed.title;
+
 	const char *dest = NULL;
 	if (optind < argc)
 		dest = argv[optind];
 
-	/* No args => server on :8080, serving current directory */
-	if (!dest) {
-		serve_http(".", "8080");
+	if (watch) {
+		if (!dest || is_port_spec(dest)) {
+			usage(argv[0]);
+			return 2;
+		}
+		watch_tree(".", dest, j, gzip, explain, uring);
 		return 0;
 	}
 
-	/* dest is :PORT => server mode */
-	if (is_port_spec(dest)) {
-		serve_http(".", dest + 1);
+	/* No args => server on :8080, serving current directory */
+	if (!dest || is_port_spec(dest)) {
+		const char *port = dest ? dest + 1 : "8080";
+		if (bundle_path)
+			serve_bundle(port);
+		else
+			serve_http(".", port, (size_t)cache_mb << 20,
+			    (size_t)asset_mb << 20, live, j);
 		return 0;
 	}
 
 	/* else dest is directory => build mode */
-	build_tree_parallel(".", dest, j);
+	map_inputs = 1;
+	build_tree_parallel(".", dest, j, gzip, explain, uring);
 	return 0;
 }
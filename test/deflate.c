@@ -0,0 +1,210 @@
+/*
+ * deflate.c against zlib: every stream dfl_deflate() and dfl_gzip() write
+ * must inflate back to its input, and dfl_crc32() must agree with crc32().
+ *
+ *   make test
+ *
+ * Inputs are edge sizes, runs, incompressible bytes, matches at the far end
+ * of the window and text, at every level; gzip members are checked by
+ * zlib's own CRC and length trailer test. Exits 1 on the first mismatch.
+ */
+
+#include "deflate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+static unsigned long long rng = 1;
+
+static unsigned
+next(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (unsigned)((rng * 2685821657736338717ULL) >> 32);
+}
+
+static unsigned long ncases;
+
+static void
+fail(const char *what, const char *name, size_t len, int level)
+{
+	fprintf(stderr, "deflate: %s: %s, %zu bytes, level %d\n", what, name,
+	    len, level);
+	exit(1);
+}
+
+/* inflate z (raw DEFLATE if wbits < 0, gzip if wbits > 15) into out */
+static int
+inflate_all(const unsigned char *z, size_t zlen, int wbits,
+    unsigned char *out, size_t cap, size_t *outlen)
+{
+	z_stream s;
+	memset(&s, 0, sizeof(s));
+	if (inflateInit2(&s, wbits) != Z_OK)
+		return -1;
+	s.next_in = (unsigned char *)z;
+	s.avail_in = (uInt)zlen;
+	s.next_out = out;
+	s.avail_out = (uInt)cap;
+	int rc = inflate(&s, Z_FINISH);
+	*outlen = cap - s.avail_out;
+	/* trailing bytes after the end of the stream are an error too */
+	int ok = rc == Z_STREAM_END && s.avail_in == 0;
+	inflateEnd(&s);
+	return ok ? 0 : -1;
+}
+
+static void
+check(const char *name, const unsigned char *in, size_t len)
+{
+	unsigned char *back = malloc(len + 1);
+	if (!back) {
+		perror("malloc");
+		exit(1);
+	}
+	/* 0 and 10 are clamped to 1 and 9 */
+	for (int level = 0; level <= 10; level++) {
+		size_t zlen, blen;
+		unsigned char *z = dfl_deflate(in, len, level, &zlen);
+		if (!z)
+			fail("dfl_deflate() failed", name, len, level);
+		/* a block (at most 32768 symbols) never beats stored */
+		if (zlen > len + 5 * (len / 32768 + 1) + 8)
+			fail("stream longer than stored", name, len, level);
+		if (inflate_all(z, zlen, -15, back, len + 1, &blen) != 0 ||
+		    blen != len || memcmp(back, in, len) != 0)
+			fail("raw stream does not inflate back", name, len,
+			    level);
+		free(z);
+
+		z = dfl_gzip(in, len, level, &zlen);
+		if (!z)
+			fail("dfl_gzip() failed", name, len, level);
+		if (zlen < 18 || z[0] != 0x1f || z[1] != 0x8b || z[2] != 8)
+			fail("bad gzip header", name, len, level);
+		if (inflate_all(z, zlen, 16 + 15, back, len + 1, &blen) != 0 ||
+		    blen != len || memcmp(back, in, len) != 0)
+			fail("gzip member does not inflate back", name, len,
+			    level);
+		free(z);
+		ncases++;
+	}
+	free(back);
+}
+
+static void
+check_crc(void)
+{
+	unsigned char buf[4096];
+	for (int round = 0; round < 200; round++) {
+		size_t n = next() % sizeof(buf), cut = n ? next() % n : 0;
+		for (size_t i = 0; i < n; i++)
+			buf[i] = (unsigned char)next();
+		uint32_t want = (uint32_t)crc32(0, buf, (uInt)n);
+		uint32_t got = dfl_crc32(dfl_crc32(0, buf, cut), buf + cut,
+		    n - cut);
+		if (got != want)
+			fail("dfl_crc32() differs from crc32()", "random", n,
+			    0);
+	}
+}
+
+/* words from a small vocabulary: long and short matches everywhere */
+static void
+gen_text(unsigned char *p, size_t n)
+{
+	static const char *const words[] = {"the", "static", "site",
+		"generator", "renders", "markdown", "into", "html", "page",
+		"layout", "{{Body}}", "<p>", "</p>", "\n\n", "of", "a"};
+	size_t i = 0;
+	while (i < n) {
+		const char *w =
+		    words[next() % (sizeof(words) / sizeof(words[0]))];
+		for (; *w && i < n; w++)
+			p[i++] = (unsigned char)*w;
+		if (i < n)
+			p[i++] = ' ';
+	}
+}
+
+/* random bytes repeating with period d: every match is d back */
+static void
+gen_far(unsigned char *p, size_t n, size_t d)
+{
+	for (size_t i = 0; i < n; i++)
+		p[i] = i < d ? (unsigned char)next() : p[i - d];
+}
+
+static void
+check_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return;
+	unsigned char *p = NULL;
+	size_t len = 0, cap = 0, r;
+	do {
+		if (len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			unsigned char *np = realloc(p, cap);
+			if (!np) {
+				perror("realloc");
+				exit(1);
+			}
+			p = np;
+		}
+		r = fread(p + len, 1, cap - len, f);
+		len += r;
+	} while (r);
+	fclose(f);
+	check(path, p, len);
+	free(p);
+}
+
+int
+main(void)
+{
+	enum { MAX = 300000 };
+	static unsigned char buf[MAX];
+	/* around the window, stored block and symbol buffer limits */
+	static const size_t sizes[] = {0, 1, 2, 3, 4, 257, 258, 259, 4095,
+		4096, 32767, 32768, 32769, 65534, 65535, 65536, 65537, 131072,
+		MAX};
+
+	check_crc();
+
+	for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		size_t n = sizes[k];
+		memset(buf, 'a', n);
+		check("run", buf, n);
+		for (size_t i = 0; i < n; i++)
+			buf[i] = (unsigned char)next();
+		check("random", buf, n);
+		gen_text(buf, n);
+		check("text", buf, n);
+	}
+	/* matches at the largest distances, and just past TOO_FAR */
+	static const size_t far[] = {3, 258, 4096, 4097, 32767, 32768};
+	for (size_t k = 0; k < sizeof(far) / sizeof(far[0]); k++) {
+		gen_far(buf, 100000, far[k]);
+		check("far", buf, 100000);
+	}
+	/* short random lengths of mixed content */
+	for (int round = 0; round < 300; round++) {
+		size_t n = next() % 2000;
+		for (size_t i = 0; i < n; i++)
+			buf[i] = next() % 3 ? (unsigned char)('a' + next() % 4)
+					    : (unsigned char)next();
+		check("mixed", buf, n);
+	}
+	check_file("deflate.c");
+	check_file("huap.c");
+
+	printf("deflate: %lu inputs round-trip through zlib at levels 0-10\n",
+	    ncases / 11);
+	return 0;
+}